@@ -0,0 +1,53 @@
+#!/bin/sh
+# Button action benchmark : replays a trace of chords with a launcher button (calculator, documents, music,
+# pictures) pressed now and then, once launching from the note path (--sync-actions) then through the executor
+# thread, and compares how long button reports stall the note path and the decode time of the notes.
+#
+# usage: bench/actions.sh [PRODIKEYSD] [LAUNCHES]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   LAUNCHES    number of launcher button presses in the generated trace (default 200)
+#
+# Launchers are replaced by no-op scripts (first in PATH), what is measured is starting them.
+# Needs the ALSA sequencer (/dev/snd/seq) like bench/chords.sh, unless built with the null sink.
+
+PRODIKEYSD=${1:-./prodikeysd}
+LAUNCHES=${2:-200}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+mkdir "$OUT/bin"
+for launcher in xdg-open gnome-calculator; do
+    printf '#!/bin/sh\nexit 0\n' > "$OUT/bin/$launcher"
+    chmod +x "$OUT/bin/$launcher"
+done
+
+# a launcher press and release (report 1 bit 15, report 4 bits 2, 5 and 7) every 20 chords, 1 ms apart
+python3 - "$OUT/actions.pktrace" "$LAUNCHES" <<'PY'
+import struct, sys
+path, launches = sys.argv[1], int(sys.argv[2])
+launchers = [(0x01, 1 << 15), (0x04, 1 << 2), (0x04, 1 << 5), (0x04, 1 << 7)]
+with open(path, "wb") as f:
+    f.write(b"PKTRACE1")
+    t = 0
+    def record(report):
+        global t
+        f.write(struct.pack("<QBB", t, 0, len(report)) + report)
+        t += 1000000
+    for n in range(launches):
+        report_id, bit = launchers[n % len(launchers)]
+        record(struct.pack("<BI", report_id, bit))
+        record(struct.pack("<BI", report_id, 0))
+        for chord in range(20):
+            record(bytes([0x03, 0x54, 0x40, 0x58, 0x40, 0x5b, 0x40]))
+            record(bytes([0x03, 0x94, 0x00, 0x98, 0x00, 0x9b, 0x00]))
+PY
+
+export PATH="$OUT/bin:$PATH" HOME="$OUT" DISPLAY=${DISPLAY:-:bench}
+"$PRODIKEYSD" --replay="$OUT/actions.pktrace" --no-output-thread --sync-actions --stats="$OUT/sync.json"
+"$PRODIKEYSD" --replay="$OUT/actions.pktrace" --no-output-thread --stats="$OUT/executor.json"
+
+for run in sync executor; do
+    echo "$run:"
+    grep -o '"buttons": {[^}]*}\|"decode": {[^}]*}\|"action": {[^}]*}' "$OUT/$run.json" | sed 's/^/  /'
+done
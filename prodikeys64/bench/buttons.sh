@@ -0,0 +1,47 @@
+#!/bin/sh
+# Function button benchmark : replays a trace of report 1 and 4 button presses (media keys, channel, pitch, octave
+# and fn lock, no application launchers) as fast as possible through two prodikeysd builds, and compares how long
+# handling a report takes. Used to compare the button table dispatch with the if chain it replaced.
+#
+# usage: bench/buttons.sh NEW OLD [REPORTS]
+#   NEW         prodikeysd binary to measure
+#   OLD         prodikeysd binary to compare with, e.g. built from a worktree of an older revision
+#   REPORTS     number of button reports in the generated trace (default 100000)
+#
+# Needs the ALSA sequencer (/dev/snd/seq) like bench/chords.sh, unless both are built with the null sink.
+
+NEW=$1
+OLD=$2
+REPORTS=${3:-100000}
+if [ -z "$NEW" ] || [ -z "$OLD" ]; then
+    echo "usage: $0 NEW OLD [REPORTS]" >&2
+    exit 1
+fi
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# every report presses or releases one to three buttons, the fn lock key (report 4 bit 20) now and then
+python3 - "$OUT/buttons.pktrace" "$REPORTS" <<'PY'
+import random, struct, sys
+path, reports = sys.argv[1], int(sys.argv[2])
+buttons = {1: [0, 1, 2, 3, 4, 7, 8, 13, 14, 18], 4: [4, 20]}
+state = {1: 0, 4: 0}
+random.seed(1)
+with open(path, "wb") as f:
+    f.write(b"PKTRACE1")
+    for n in range(reports):
+        report_id = 1 if random.random() < 0.9 else 4
+        for bit in random.sample(buttons[report_id], random.randint(1, min(3, len(buttons[report_id])))):
+            state[report_id] ^= 1 << bit
+        report = struct.pack("<BI", report_id, state[report_id])
+        f.write(struct.pack("<QBB", n * 1000000, 0, len(report)) + report)
+PY
+
+"$OLD" --replay="$OUT/buttons.pktrace" --fast --no-output-thread --stats="$OUT/old.json"
+"$NEW" --replay="$OUT/buttons.pktrace" --fast --no-output-thread --stats="$OUT/new.json"
+
+for run in old new; do
+    echo "$run:"
+    grep -o '"total": {[^}]*}' "$OUT/$run.json" | sed 's/^/  /'
+done
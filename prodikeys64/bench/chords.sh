@@ -0,0 +1,40 @@
+#!/bin/sh
+# Chord benchmark : replays a chord-heavy trace as fast as possible, writing every note on its own (--no-batch, with the
+# prodikeysd-baselines build next to PRODIKEYSD) then a whole report at once, and compares sequencer writes, the time spent in them and the time to handle a report.
+#
+# usage: bench/chords.sh [PRODIKEYSD] [CHORDS] [NOTES]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   CHORDS      number of chords in the generated trace (default 10000)
+#   NOTES       notes per chord, 2 to 15 (default 10)
+#
+# Needs the ALSA sequencer (/dev/snd/seq), the replayed keyboard publishes a port like a plugged one.
+
+PRODIKEYSD=${1:-./prodikeysd}
+BASELINES=${PRODIKEYSD}-baselines
+CHORDS=${2:-10000}
+NOTES=${3:-10}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# every chord is one report 3 pressing NOTES keys, then one releasing them, 1 ms apart (see prodikeys-trace.h)
+python3 - "$OUT/chords.pktrace" "$CHORDS" "$NOTES" <<'PY'
+import struct, sys
+path, chords, notes = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+with open(path, "wb") as f:
+    f.write(b"PKTRACE1")
+    t = 0
+    for c in range(chords):
+        for base, velocity in ((0x54, 0x40), (0x94, 0x00)):
+            report = bytes([0x03]) + b"".join(bytes([base + n, velocity]) for n in range(notes))
+            f.write(struct.pack("<QBB", t, 0, len(report)) + report)
+            t += 1000000
+PY
+
+"$BASELINES" --replay="$OUT/chords.pktrace" --fast --no-batch --stats="$OUT/single.json"
+"$PRODIKEYSD" --replay="$OUT/chords.pktrace" --fast --stats="$OUT/batched.json"
+
+for run in single batched; do
+    echo "$run:"
+    grep -o '"notes": [0-9]*\|"sink_calls": [0-9]*\|"sink": {[^}]*}\|"total": {[^}]*}' "$OUT/$run.json" | sed 's/^/  /'
+done
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Jitter benchmark : replays a trace with its original timing, first with default scheduling then with
+# real-time scheduling, pinned and locked, while every cpu is kept busy, and compares the dispatch lateness.
+#
+# usage: bench/jitter.sh TRACE [PRODIKEYSD] [CPU]
+#   TRACE       trace captured with --capture
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   CPU         cpu the real-time run is pinned to (default 1)
+#
+# Real-time scheduling needs CAP_SYS_NICE or an rtprio limit, otherwise the second run says so and runs as the first.
+
+TRACE=$1
+PRODIKEYSD=${2:-./prodikeysd}
+CPU=${3:-1}
+if [ -z "$TRACE" ]; then
+    sed -n '5,9p' "$0"
+    exit 1
+fi
+
+OUT=$(mktemp -d)
+trap 'kill $LOAD 2>/dev/null; rm -rf "$OUT"' EXIT
+
+# one busy loop per cpu
+LOAD=
+for i in $(seq "$(nproc)"); do
+    sh -c 'while :; do :; done' &
+    LOAD="$LOAD $!"
+done
+
+"$PRODIKEYSD" --no-midi --replay="$TRACE" --stats="$OUT/default.json"
+"$PRODIKEYSD" --no-midi --replay="$TRACE" --stats="$OUT/realtime.json" --rt=fifo --cpu="$CPU" --mlock
+
+for run in default realtime; do
+    printf '%-9s %s\n' "$run" "$(grep -o '"lateness": {[^}]*}' "$OUT/$run.json")"
+done
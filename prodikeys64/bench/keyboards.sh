@@ -0,0 +1,26 @@
+#!/bin/sh
+# Keyboard count benchmark : plays 1, 8 and 16 simulated keyboards at once (a studio full of them, all decoded by the
+# same thread and written by the same output thread) and prints the latency of every keyboard against the 1 ms budget,
+# so the keyboards held up by the others show. Fails if any keyboard ends up out of step with the daemon. No keyboard needed.
+#
+# usage: bench/keyboards.sh [PRODIKEYSD] [SECONDS]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   SECONDS     virtual seconds played per run (default 300)
+#
+# Needs the ALSA sequencer (/dev/snd/seq) like bench/chords.sh, unless built with the null sink.
+
+PRODIKEYSD=${1:-./prodikeysd}
+SECONDS_PLAYED=${2:-300}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+status=0
+for keyboards in 1 8 16; do
+    echo "$keyboards keyboards:"
+    "$PRODIKEYSD" --simulate="$SECONDS_PLAYED" --sim-keyboards=$keyboards --stats="$OUT/stats.json" \
+        2>"$OUT/log" >/dev/null || status=1
+    grep '^prodikeysd: \(simulated\|keyboard [0-9]*: [0-9]* reports\)' "$OUT/log" | sed 's/^prodikeysd: /  /'
+    grep -o '"output": {"count[^}]*}' "$OUT/stats.json" | sed 's/^/  /'
+done
+exit $status
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Note translation benchmark : replays a chord-heavy trace as fast as possible, translating keys with arithmetic
+# (--no-note-map, with the prodikeysd-baselines build next to PRODIKEYSD) then through the note table, and compares the
+# decode stage of both runs.
+# The octave keeps moving between -2 and +2 and chords span the whole key code range, so the table gets rebuilt
+# and keys falling outside MIDI notes are counted (notes_out_of_range, identical in both runs).
+#
+# usage: bench/notes.sh [PRODIKEYSD] [CHORDS] [NOTES]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   CHORDS      number of chords in the generated trace (default 10000)
+#   NOTES       notes per chord, 2 to 15 (default 10)
+#
+# Needs the ALSA sequencer (/dev/snd/seq) like bench/chords.sh, unless prodikeysd is built with the null sink.
+
+PRODIKEYSD=${1:-./prodikeysd}
+BASELINES=${PRODIKEYSD}-baselines
+CHORDS=${2:-10000}
+NOTES=${3:-10}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# chords as in bench/chords.sh, with an octave change (instant messaging key up, e-mail key down) every 100 chords
+python3 - "$OUT/notes.pktrace" "$CHORDS" "$NOTES" <<'PY'
+import struct, sys
+path, chords, notes = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+octave_up = (bytes([0x04, 0x10, 0, 0, 0]), bytes([0x04, 0, 0, 0, 0]))
+octave_down = (bytes([0x01, 0x00, 0x40, 0, 0]), bytes([0x01, 0, 0, 0, 0]))
+shifts = [octave_up, octave_up, octave_down, octave_down, octave_down, octave_down, octave_up, octave_up]
+with open(path, "wb") as f:
+    f.write(b"PKTRACE1")
+    t = 0
+    def record(report):
+        global t
+        f.write(struct.pack("<QBB", t, 0, len(report)) + report)
+        t += 1000000
+    for c in range(chords):
+        if c % 100 == 0:
+            for report in shifts[(c // 100) % len(shifts)]:
+                record(report)
+        keys = [0x20 + (c * 7 + n * 5) % 0x61 for n in range(notes)]
+        record(bytes([0x03]) + b"".join(bytes([k, 0x40]) for k in keys))
+        record(bytes([0x03]) + b"".join(bytes([k + 0x40, 0x00]) for k in keys))
+PY
+
+"$BASELINES" --replay="$OUT/notes.pktrace" --fast --no-output-thread --no-note-map --stats="$OUT/computed.json"
+"$PRODIKEYSD" --replay="$OUT/notes.pktrace" --fast --no-output-thread --stats="$OUT/table.json"
+
+for run in computed table; do
+    echo "$run:"
+    grep -o '"notes": [0-9]*\|"notes_out_of_range": [0-9]*\|"decode": {[^}]*}' "$OUT/$run.json" | sed 's/^/  /'
+done
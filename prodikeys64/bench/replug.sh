@@ -0,0 +1,47 @@
+#!/bin/sh
+# Replug benchmark : replays a short trace setting a keyboard up (octave, instrument, channel, pitch, sustain), then
+# unplugs and replugs it in a loop through the daemon's detach and attach path, a simulated keyboard coming back in
+# the same place each time. Runs once keeping its state and libusb context (the default) and once as every reconnect
+# used to (--cold-replug : libusb initialized again, devices scanned, default values). Compares the time from replug
+# to the first note the keyboard plays handed to the port, and how many replugs came back with the state they had.
+#
+# usage: bench/replug.sh [PRODIKEYSD] [REPLUGS]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   REPLUGS     unplug/replug cycles (default 1000)
+#
+# Needs the ALSA sequencer (/dev/snd/seq) like bench/chords.sh, unless built with the null sink.
+
+PRODIKEYSD=${1:-./prodikeysd}
+REPLUGS=${2:-1000}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# piano keys are on : octave up (report 4 bit 4), sustain (report 1 bit 18), then with fn lock (report 4 bit 20) on,
+# next instrument twice (report 4 bit 4), next channel (report 1 bit 0) and pitch up (report 1 bit 7), each pressed then released
+python3 - "$OUT/replug.pktrace" <<'PY'
+import struct, sys
+with open(sys.argv[1], "wb") as f:
+    f.write(b"PKTRACE1")
+    t = 0
+    def press(report_id, bit):
+        global t
+        for value in (bit, 0):
+            f.write(struct.pack("<QBB", t, 0, 5) + struct.pack("<BI", report_id, value))
+            t += 1000000
+    press(0x04, 1 << 4)
+    press(0x01, 1 << 18)
+    press(0x04, 1 << 20)
+    press(0x04, 1 << 4)
+    press(0x04, 1 << 4)
+    press(0x01, 1 << 0)
+    press(0x01, 1 << 7)
+PY
+
+"$PRODIKEYSD" --replay="$OUT/replug.pktrace" --fast --no-output-thread --replug="$REPLUGS" --stats="$OUT/warm.json"
+"$PRODIKEYSD" --replay="$OUT/replug.pktrace" --fast --no-output-thread --replug="$REPLUGS" --cold-replug --stats="$OUT/cold.json"
+
+for run in warm cold; do
+    echo "$run:"
+    grep -o '"replug": {[^}]*}' "$OUT/$run.json" | sed 's/^/  /'
+done
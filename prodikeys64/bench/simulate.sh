@@ -0,0 +1,28 @@
+#!/bin/sh
+# Simulation benchmark : plays simulated keyboards (made up chords, glissandi and buttons on a virtual clock) for a few
+# seeds and keyboard counts, and prints reports/s, decoding latency and the keyboards left out of step with the daemon
+# (FN led, piano keys, held notes). Fails if any keyboard ends up out of step. No keyboard needed.
+#
+# usage: bench/simulate.sh [PRODIKEYSD] [SECONDS]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   SECONDS     virtual seconds played per run (default 600)
+#
+# Needs the ALSA sequencer (/dev/snd/seq) like bench/chords.sh, unless built with the null sink.
+
+PRODIKEYSD=${1:-./prodikeysd}
+SECONDS_PLAYED=${2:-600}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+status=0
+for keyboards in 1 4; do
+    for seed in 1 2 3; do
+        echo "$keyboards keyboards, seed $seed:"
+        "$PRODIKEYSD" --simulate="$SECONDS_PLAYED" --sim-keyboards=$keyboards --sim-seed=$seed --stats="$OUT/stats.json" \
+            2>"$OUT/log" >/dev/null || status=1
+        grep '^prodikeysd: \(simulated\|commands\)' "$OUT/log" | sed 's/^prodikeysd: /  /'
+        grep -o '"total": {[^}]*}' "$OUT/stats.json" | sed 's/^/  /'
+    done
+done
+exit $status
@@ -0,0 +1,51 @@
+#!/bin/sh
+# State snapshot stress test : replays a trace of chords and buttons changing octave, channel, pitch, instrument and
+# fn lock as fast as possible, once alone then with reader threads taking state snapshots in a loop (as the tray
+# menu or a control client would). Readers report torn or out of range snapshots, which must stay at 0, and the
+# decoding times show whether readers slow the note path down.
+#
+# usage: bench/snapshot.sh [PRODIKEYSD] [READERS] [REPORTS]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   READERS     snapshot reader threads (default 4)
+#   REPORTS     number of reports in the generated trace (default 200000)
+#
+# Needs the ALSA sequencer (/dev/snd/seq) like bench/chords.sh, unless built with the null sink.
+
+PRODIKEYSD=${1:-./prodikeysd}
+READERS=${2:-4}
+REPORTS=${3:-200000}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# piano keys are on : octave up/down (report 4 bit 4, report 1 bit 14), and with fn lock (report 4 bit 20) on,
+# channel up/down, pitch up/down and instruments, each pressed then released, between chords
+python3 - "$OUT/snapshot.pktrace" "$REPORTS" <<'PY'
+import random, struct, sys
+path, reports = sys.argv[1], int(sys.argv[2])
+buttons = [(0x04, 1 << 4), (0x01, 1 << 14), (0x01, 1 << 0), (0x01, 1 << 1), (0x01, 1 << 7), (0x01, 1 << 8), (0x04, 1 << 20)]
+random.seed(1)
+with open(path, "wb") as f:
+    f.write(b"PKTRACE1")
+    n = 0
+    def record(report):
+        global n
+        f.write(struct.pack("<QBB", n * 100000, 0, len(report)) + report)
+        n += 1
+    while n < reports:
+        if random.random() < 0.5:
+            report_id, bit = random.choice(buttons)
+            record(struct.pack("<BI", report_id, bit))
+            record(struct.pack("<BI", report_id, 0))
+        else:
+            record(bytes([0x03, 0x54, 0x40, 0x58, 0x40, 0x5b, 0x40]))
+            record(bytes([0x03, 0x94, 0x00, 0x98, 0x00, 0x9b, 0x00]))
+PY
+
+"$PRODIKEYSD" --replay="$OUT/snapshot.pktrace" --fast --no-output-thread --stats="$OUT/alone.json"
+"$PRODIKEYSD" --replay="$OUT/snapshot.pktrace" --fast --no-output-thread --snapshot-readers="$READERS" --stats="$OUT/readers.json"
+
+for run in alone readers; do
+    echo "$run:"
+    grep -o '"buttons": {[^}]*}\|"decode": {[^}]*}' "$OUT/$run.json" | sed 's/^/  /'
+done
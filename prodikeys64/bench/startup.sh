@@ -0,0 +1,36 @@
+#!/bin/sh
+# Startup benchmark : launches prodikeysd on a one report trace again and again, and reports the time from launch to
+# the keyboard being ready to play (port created, piano keys on), as dumped under "ready_us" in the statistics.
+#
+# usage: bench/startup.sh [PRODIKEYSD] [LAUNCHES]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   LAUNCHES    number of launches (default 100)
+#
+# Needs the ALSA sequencer (/dev/snd/seq) like bench/chords.sh, unless built with the null sink.
+
+PRODIKEYSD=${1:-./prodikeysd}
+LAUNCHES=${2:-100}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# a single middle C, the replay is only there to stand in for a keyboard
+python3 - "$OUT/startup.pktrace" <<'PY'
+import struct, sys
+with open(sys.argv[1], "wb") as f:
+    f.write(b"PKTRACE1")
+    f.write(struct.pack("<QBB", 0, 0, 3) + bytes([0x03, 0x54, 0x40]))
+PY
+
+n=0
+while [ $n -lt "$LAUNCHES" ]; do
+    "$PRODIKEYSD" --replay="$OUT/startup.pktrace" --fast --stats="$OUT/stats.json" 2>/dev/null
+    grep -o '"ready_us": [0-9.]*' "$OUT/stats.json" | sed 's/.*: //' >> "$OUT/ready"
+    n=$((n + 1))
+done
+
+sort -n "$OUT/ready" | awk '{ v[NR] = $1; sum += $1 }
+    END { if (NR == 0) { print "no launch got ready"; exit 1 }
+          p99 = int(NR * 0.99); if (p99 < 1) p99 = 1
+          printf "ready_us: launches %d, avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+                 NR, sum / NR, v[int((NR + 1) / 2)], v[p99], v[NR] }'
@@ -0,0 +1,45 @@
+#!/bin/sh
+# MIDI mode toggle benchmark : replays a trace alternating piano key presses and chords, once with the port
+# created and closed on every toggle (--port-per-toggle, with the prodikeysd-baselines build next to PRODIKEYSD) then
+# with the port kept for the whole session, and compares the time the note path spends toggling and the decode time
+# of the notes right after.
+#
+# usage: bench/toggle.sh [PRODIKEYSD] [TOGGLES]
+#   PRODIKEYSD  prodikeysd binary (default ./prodikeysd)
+#   TOGGLES     number of piano key presses in the generated trace (default 1000)
+#
+# Needs the ALSA sequencer (/dev/snd/seq), port creation is what is being measured.
+
+PRODIKEYSD=${1:-./prodikeysd}
+BASELINES=${PRODIKEYSD}-baselines
+TOGGLES=${2:-1000}
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# piano keys start enabled : every press (report 4 bit 1) disables or enables them, each enable is followed by a chord
+python3 - "$OUT/toggle.pktrace" "$TOGGLES" <<'PY'
+import struct, sys
+path, toggles = sys.argv[1], int(sys.argv[2])
+with open(path, "wb") as f:
+    f.write(b"PKTRACE1")
+    t = 0
+    def record(report):
+        global t
+        f.write(struct.pack("<QBB", t, 0, len(report)) + report)
+        t += 1000000
+    for n in range(toggles):
+        record(bytes([0x04, 0x02, 0, 0, 0]))
+        record(bytes([0x04, 0, 0, 0, 0]))
+        if n % 2 == 1:
+            record(bytes([0x03, 0x54, 0x40, 0x58, 0x40, 0x5b, 0x40]))
+            record(bytes([0x03, 0x94, 0x00, 0x98, 0x00, 0x9b, 0x00]))
+PY
+
+"$BASELINES" --replay="$OUT/toggle.pktrace" --fast --no-output-thread --port-per-toggle --stats="$OUT/per_toggle.json"
+"$PRODIKEYSD" --replay="$OUT/toggle.pktrace" --fast --no-output-thread --stats="$OUT/session.json"
+
+for run in per_toggle session; do
+    echo "$run:"
+    grep -o '"midi_toggle": {[^}]*}\|"decode": {[^}]*}' "$OUT/$run.json" | sed 's/^/  /'
+done
@@ -8,79 +8,355 @@
  * Copyright 2009 Don Prince
  *
  */
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include "prodikeys-core.h"
+#include "prodikeys-executor.h"
+#include "prodikeys-keymap.h"
+#include "prodikeys-os.h"
+#include "prodikeys-output.h"
+#include "prodikeys-sim.h"
+#include "prodikeys-stats.h"
+
+static void prodikeys_cmd_next(struct pcmidi_snd *pm);
+static void prodikeys_snapshot_publish_cmd(struct pcmidi_snd *pm);
+
+static void LIBUSB_CALL prodikeys_cmd_cb(struct libusb_transfer *transfer){
+    struct pcmidi_snd *pm = static_cast<pcmidi_snd *>(transfer->user_data);
+    struct prodikeys_cmd_queue *cmd = &pm->cmd;
+
+    uint64_t latency_ns = prodikeys_now_ns() - cmd->submitted_ns;
+    unsigned long latency = (unsigned long) (latency_ns / 1000);
+    prodikeys_stats_stage(PRODIKEYS_STAGE_COMMAND, latency_ns);
+    prodikeys_stats_transfer(transfer->status);
+    cmd->last_latency_us = latency;
+    if (latency > cmd->max_latency_us) cmd->max_latency_us = latency;
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED){
+        cmd->sent++;
+        cmd->written[cmd->current] = cmd->buffer[2];
+    } else {
+        cmd->failed++;
+        cmd->written[cmd->current] = 0;
+    }
 
-bool prodikeys_send_hid_data(libusb_device_handle* handle, uint8_t byte){
-    if (handle == NULL) return false;
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED || transfer->status == LIBUSB_TRANSFER_NO_DEVICE){
+        cmd->busy = false;
+        prodikeys_snapshot_publish_cmd(pm);
+        return;
+    }
+    //still owning the transfer, go on with the next pending command
+    prodikeys_cmd_next(pm);
+    prodikeys_snapshot_publish_cmd(pm);
+}
 
-    int res;
-    int numBytes                 = 0;  /* Actual bytes transferred. */
-    uint8_t buffer[3];                /* 3 byte transfer buffer */
+/* Write the next pending command, caller must own the transfer (busy set) */
+static void prodikeys_cmd_next(struct pcmidi_snd *pm){
+    struct prodikeys_cmd_queue *cmd = &pm->cmd;
+    while (true){
+        for (int group = 0; group < PRODIKEYS_CMD_GROUPS; group++){
+            uint8_t byte = cmd->pending[group].exchange(0);
+            if (byte == 0) continue;
+            if (byte == cmd->written[group] && byte != 0xC3 && byte != 0xC4){
+                cmd->coalesced++; //device is already in that state
+                continue;
+            }
 
-    memset(buffer, 0, 3);
-    buffer[0] = 6; //report ID
-    buffer[1] = 0x01;
-    buffer[2] = byte;
+            cmd->current = group;
+            cmd->buffer[0] = 6; //report ID
+            cmd->buffer[1] = 0x01;
+            cmd->buffer[2] = byte;
+            libusb_fill_interrupt_transfer(cmd->transfer, cmd->handle, PRODIKEYS_ENDPOINT_OUT, cmd->buffer, 3,
+                                           prodikeys_cmd_cb, pm, 1000);
+            cmd->submitted_ns = prodikeys_now_ns();
+            int res = libusb_submit_transfer(cmd->transfer);
+            if (res == 0) return;
+            prodikeys_stats_error(res);
+            cmd->failed++;
+        }
+        cmd->busy = false;
 
-    res = libusb_interrupt_transfer(handle, 3, buffer, 3, &numBytes, 1000);
-    if (res == 0)
-    {
-        //printf("OK.\n", numBytes);
-        return true;
+        //a command may have been queued after its group was checked, take it unless another caller already did
+        bool pending = false;
+        for (int group = 0; group < PRODIKEYS_CMD_GROUPS; group++)
+            if (cmd->pending[group] != 0) pending = true;
+        if (!pending || cmd->busy.exchange(true)) return;
     }
-    else
-    {
-        //fprintf(stderr, "Error sending message to device.\n");
+}
+
+bool prodikeys_cmd_init(struct pcmidi_snd *pm){
+    struct prodikeys_cmd_queue *cmd = &pm->cmd;
+    cmd->handle = pm->handle;
+    cmd->busy = false;
+    for (int group = 0; group < PRODIKEYS_CMD_GROUPS; group++){
+        cmd->pending[group] = 0;
+        cmd->written[group] = 0;
+    }
+    cmd->transfer = libusb_alloc_transfer(0);
+    return cmd->transfer != NULL;
+}
+
+void prodikeys_cmd_free(struct pcmidi_snd *pm){
+    struct prodikeys_cmd_queue *cmd = &pm->cmd;
+    if (cmd->transfer == NULL) return;
+
+    //the transfer goes on with pending commands by itself, so the queue is empty once it is back
+    uint64_t deadline_ns = prodikeys_now_ns() + PRODIKEYS_CMD_DRAIN_NS;
+    while (cmd->busy && prodikeys_now_ns() < deadline_ns){
+        struct timeval tv = {0, 10000};
+        libusb_handle_events_timeout_completed(pm->context, &tv, NULL);
+    }
+    for (int group = 0; group < PRODIKEYS_CMD_GROUPS; group++)
+        cmd->pending[group] = 0;
+    if (cmd->busy){
+        libusb_cancel_transfer(cmd->transfer);
+        for (int retries = 0; cmd->busy && retries < 10; retries++){
+            struct timeval tv = {0, 100000};
+            libusb_handle_events_timeout_completed(pm->context, &tv, NULL);
+        }
+        if (cmd->busy) return; //still owned by libusb, leaking is safer than freeing it
+    }
+    libusb_free_transfer(cmd->transfer);
+    cmd->transfer = NULL;
+}
+
+int prodikeys_cmd_depth(struct pcmidi_snd *pm){
+    int depth = pm->cmd.busy ? 1 : 0;
+    for (int group = 0; group < PRODIKEYS_CMD_GROUPS; group++)
+        if (pm->cmd.pending[group] != 0) depth++;
+    return depth;
+}
+
+bool prodikeys_send_hid_data(struct pcmidi_snd *pm, uint8_t byte){
+    struct prodikeys_cmd_queue *cmd = &pm->cmd;
+    if (pm->offline) return pm->sim != NULL ? prodikeys_sim_command(pm->sim, byte) : byte >= 0xC1 && byte <= 0xC6;
+    if (pm->handle == NULL || cmd->transfer == NULL || byte < 0xC1 || byte > 0xC6) return false;
+
+    int group = (byte - 0xC1) / 2;
+    if (cmd->pending[group].exchange(byte) != 0)
+        cmd->coalesced++; //replaced a command which wasn't written yet
+    if (!cmd->busy.exchange(true))
+        prodikeys_cmd_next(pm);
+    prodikeys_snapshot_publish_cmd(pm);
+    return true;
+}
+
+//the command writer counters are published on their own by whichever thread runs the command callback
+static_assert(offsetof(struct prodikeys_snapshot, cmd_sent) % 4 == 0, "command counters must start a snapshot word");
+
+/* Command writer counters of a snapshot, all of them atomics any thread can read */
+static void prodikeys_snapshot_cmd(struct pcmidi_snd *pm, struct prodikeys_snapshot *snapshot){
+    snapshot->cmd_sent = (uint32_t) pm->cmd.sent;
+    snapshot->cmd_failed = (uint32_t) pm->cmd.failed;
+    snapshot->cmd_coalesced = (uint32_t) pm->cmd.coalesced;
+    snapshot->cmd_max_latency_us = (uint32_t) pm->cmd.max_latency_us;
+    snapshot->cmd_depth = (uint32_t) prodikeys_cmd_depth(pm);
+}
+
+/* Store the snapshot words from offset on, as a writer of the seqlock */
+static void prodikeys_snapshot_store(struct pcmidi_snd *pm, const struct prodikeys_snapshot *snapshot, size_t offset){
+    uint32_t words[PRODIKEYS_SNAPSHOT_WORDS];
+    memset(words, 0, sizeof(words));
+    memcpy(words, snapshot, sizeof(*snapshot));
+
+    //take the writer side : even to odd, a concurrent writer (UI thread) is only waited for here
+    struct prodikeys_seqlock *lock = &pm->snapshot;
+    uint32_t sequence = lock->sequence.load(std::memory_order_relaxed);
+    do {
+        while (sequence & 1) sequence = lock->sequence.load(std::memory_order_relaxed);
+    } while (!lock->sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire));
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = offset / 4; i < PRODIKEYS_SNAPSHOT_WORDS; i++)
+        lock->words[i].store(words[i], std::memory_order_relaxed);
+    lock->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void prodikeys_snapshot_publish(struct pcmidi_snd *pm){
+    struct prodikeys_snapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.connected = pm->handle != NULL || pm->offline;
+    snapshot.midi_mode = pm->midi_mode;
+    snapshot.fn_state = pm->fn_state;
+    snapshot.sustain_mode = pm->midi_sustain_mode;
+    snapshot.channel = pm->midi_channel;
+    snapshot.instrument = pm->midi_inst;
+    snapshot.octave = pm->midi_octave;
+    snapshot.pitch = pm->midi_pitch;
+    prodikeys_snapshot_cmd(pm, &snapshot);
+    prodikeys_snapshot_store(pm, &snapshot, 0);
+}
+
+/* Publish the command writer counters only, the device state being the reading thread's to publish */
+static void prodikeys_snapshot_publish_cmd(struct pcmidi_snd *pm){
+    struct prodikeys_snapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    prodikeys_snapshot_cmd(pm, &snapshot);
+    prodikeys_snapshot_store(pm, &snapshot, offsetof(struct prodikeys_snapshot, cmd_sent));
+}
+
+int prodikeys_snapshot_read(const struct pcmidi_snd *pm, struct prodikeys_snapshot *snapshot){
+    const struct prodikeys_seqlock *lock = &pm->snapshot;
+    uint32_t words[PRODIKEYS_SNAPSHOT_WORDS];
+    int retries = -1;
+    uint32_t before, after;
+    do {
+        retries++;
+        before = lock->sequence.load(std::memory_order_acquire);
+        if (before & 1) continue;
+        for (size_t i = 0; i < PRODIKEYS_SNAPSHOT_WORDS; i++)
+            words[i] = lock->words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = lock->sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    memcpy(snapshot, words, sizeof(*snapshot));
+    snapshot->version = before / 2;
+    return retries;
+}
+
+bool pcmidi_open_port(struct pcmidi_snd *pm){
+    if (pm->port) return true;
+    if (pm->shared_port){
+        if (*pm->shared_port == NULL)
+            *pm->shared_port = pcmidi_port_open( pm->port_name );
+        pm->port = *pm->shared_port;
+    } else {
+        pm->port = pcmidi_port_open( pm->port_name );
+    }
+    if ( !pm->port ) {
         return false;
     }
+    if (pm->ring) prodikeys_ring_bind(pm->ring, pm->port);
+    return true;
+}
+
+void pcmidi_close_port(struct pcmidi_snd *pm){
+    pcmidi_release_notes(pm);
+    pm->midi_mode = false;
+    if (pm->ring) prodikeys_ring_unbind(pm->ring);
+    if (pm->port && pm->shared_port == NULL){
+        pcmidi_port_close( pm->port );
+    }
+    pm->port = NULL;
+    prodikeys_snapshot_publish(pm);
 }
 
 bool prodikeys_disable_midi(struct pcmidi_snd *pm){
-    if (pm->handle == NULL || prodikeys_send_hid_data(pm->handle, 0xC2)) {
+    if (pm->handle == NULL || prodikeys_send_hid_data(pm, 0xC2)) {
+        pcmidi_release_notes(pm); //while the gate is still open
         pm->midi_mode = false;
-        if (pm->port){
-            virtualMIDIClosePort( pm->port );
-        }
-        pm->port = NULL;
+#ifdef PRODIKEYS_BASELINES
+        if (pm->port_per_toggle)
+            pcmidi_close_port(pm);
+#endif
+        prodikeys_snapshot_publish(pm);
         return true;
     }
     return false;
 }
 
-bool prodikeys_claim_interface(libusb_device_handle** handle){
-    int res = libusb_init(0);
-    if (res != 0)
-    {
-        //fprintf(stderr, "Error initialising libusb.\n");
+void prodikeys_handle_request(struct pcmidi_snd *pm){
+    int request = pm->request.exchange(PRODIKEYS_REQUEST_NONE);
+    if (request == PRODIKEYS_REQUEST_MIDI_ON && !pm->midi_mode)
+        prodikeys_enable_midi(pm);
+    else if (request == PRODIKEYS_REQUEST_MIDI_OFF && pm->midi_mode)
+        prodikeys_disable_midi(pm);
+}
+
+bool prodikeys_claim_device(libusb_device *device, libusb_device_handle** handle){
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(device, &desc) != 0
+        || desc.idVendor != PRODIKEYS_VID || desc.idProduct != PRODIKEYS_PID)
         return false;
-    }
 
-    /* Get the first device with the matching Vendor ID and Product ID. If
-     * intending to allow multiple demo boards to be connected at once, you
-     * will need to use libusb_get_device_list() instead. Refer to the libusb
-     * documentation for details. */
-    *handle = libusb_open_device_with_vid_pid(0, 0x041e, 0x2801);
-    if (!*handle)
+    /* Already attached keyboards fail here (WinUSB only allows one open handle) or on claim */
+    if (libusb_open(device, handle) != 0)
     {
         //fprintf(stderr, "Unable to open device.\n");
-        libusb_exit(0);
         return false;
     }
-    /* Claim interface #1. */
-    res = libusb_claim_interface(*handle, 1);
-    if (res != 0)
+    /* Claim interface #1, on linux hid-prodikeys or usbhid get detached from it meanwhile (not supported, and not needed, on windows) */
+    libusb_set_auto_detach_kernel_driver(*handle, 1);
+    if (libusb_claim_interface(*handle, 1) != 0)
     {
         //fprintf(stderr, "Error claiming interface. \nMake sure WinUSB driver is installed for Prodikeys interface 1\n");
-        libusb_exit(0);
+        libusb_close(*handle);
+        *handle = NULL;
         return false;
     }
-
     return true;
 }
 
+/* Claim a device listed in the default context from a new context, where it is listed at the same bus and address */
+static bool prodikeys_claim_alone(libusb_device *device, libusb_device_handle** handle, libusb_context** context){
+    if (libusb_init(context) != 0) return false;
+    libusb_device **list;
+    bool claimed = false;
+
+    ssize_t num_devices = libusb_get_device_list(*context, &list);
+    for (ssize_t i = 0; i < num_devices && !claimed; i++)
+    {
+        if (libusb_get_bus_number(list[i]) == libusb_get_bus_number(device)
+            && libusb_get_device_address(list[i]) == libusb_get_device_address(device))
+            claimed = prodikeys_claim_device(list[i], handle);
+    }
+    if (num_devices >= 0)
+        libusb_free_device_list(list, 1);
+    if (!claimed){
+        libusb_exit(*context);
+        *context = NULL;
+    }
+    return claimed;
+}
+
+int prodikeys_claim_interfaces(libusb_device_handle** handles, libusb_context** contexts, int max){
+    libusb_device **list;
+    int count = 0;
+
+    ssize_t num_devices = libusb_get_device_list(NULL, &list);
+    for (ssize_t i = 0; i < num_devices && count < max; i++)
+    {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) != 0
+            || desc.idVendor != PRODIKEYS_VID || desc.idProduct != PRODIKEYS_PID)
+            continue;
+        if (prodikeys_claim_alone(list[i], &handles[count], &contexts[count]))
+            count++;
+    }
+    if (num_devices >= 0)
+        libusb_free_device_list(list, 1);
+    return count;
+}
+
+void prodikeys_location_get(libusb_device *device, struct prodikeys_location *location){
+    memset(location, 0, sizeof(struct prodikeys_location));
+    int num_ports = libusb_get_port_numbers(device, location->ports, PRODIKEYS_PORT_PATH_MAX);
+    if (num_ports <= 0) return;
+    location->bus = libusb_get_bus_number(device);
+    location->num_ports = (uint8_t) num_ports;
+}
+
+/* Hand a MIDI message to the port (or queue it for the output thread), accounting for the decode and sink stages.
+ * Nothing goes out of MIDI mode, the port stays open for the whole device session. */
+static void pcmidi_port_write(struct pcmidi_snd *pm, const unsigned char *buffer, int length){
+    if (pm->port == NULL || !pm->midi_mode) return;
+    uint64_t start = prodikeys_now_ns();
+    uint64_t report_ns = pm->report_ns != 0 ? pm->report_ns : start;
+    if (pm->report_ns != 0){
+        prodikeys_stats_stage(PRODIKEYS_STAGE_DECODE, start - pm->report_ns);
+        pm->report_ns = 0;
+    }
+    if (pm->ring){
+        prodikeys_ring_push(pm->ring, buffer, length, report_ns);
+        return;
+    }
+    if (!pcmidi_port_send(pm->port, buffer, length))
+        prodikeys_stats.sink_errors.fetch_add(1, std::memory_order_relaxed);
+    prodikeys_stats.sink_calls.fetch_add(1, std::memory_order_relaxed);
+    prodikeys_stats_stage(PRODIKEYS_STAGE_SINK, prodikeys_now_ns() - start);
+}
+
 void pcmidi_send_note(struct pcmidi_snd *pm,
                              unsigned char status, unsigned char note, unsigned char velocity)
 {
@@ -90,7 +366,7 @@ void pcmidi_send_note(struct pcmidi_snd *pm,
     buffer[1] = note;
     buffer[2] = velocity;
 
-    virtualMIDISendData(pm->port, buffer, 3);
+    pcmidi_port_write(pm, buffer, 3);
 
     return;
 }
@@ -100,31 +376,32 @@ void pcmidi_send_control(struct pcmidi_snd *pm, unsigned char number, unsigned c
     buffer[0] = 128+32+16+pm->midi_channel;
     buffer[1] = number;
     buffer[2] = value;
-    virtualMIDISendData(pm->port, buffer, 3);
+    pcmidi_port_write(pm, buffer, 3);
 }
 
 void pcmidi_send_pitch(struct pcmidi_snd *pm){
     unsigned char buffer[3];
     buffer[0] = 128+64+32+pm->midi_channel;
-    buffer[1] = pm->midi_pitch & 0x1F;
+    buffer[1] = pm->midi_pitch & 0x7F;
     buffer[2] = pm->midi_pitch >> 7;
-    virtualMIDISendData(pm->port, buffer, 3);
+    pcmidi_port_write(pm, buffer, 3);
 }
 
-void pcmidi_next_instrument(struct pcmidi_snd *pm){
+void pcmidi_send_program(struct pcmidi_snd *pm){
     unsigned char buffer[2];
-    if (pm->midi_inst < PCMIDI_INST_MAX) pm->midi_inst++;
     buffer[0] = 128+64+pm->midi_channel;
     buffer[1] = pm->midi_inst;
-    virtualMIDISendData(pm->port, buffer, 2);
+    pcmidi_port_write(pm, buffer, 2);
+}
+
+void pcmidi_next_instrument(struct pcmidi_snd *pm){
+    if (pm->midi_inst < PCMIDI_INST_MAX) pm->midi_inst++;
+    pcmidi_send_program(pm);
 }
 
 void pcmidi_prev_instrument(struct pcmidi_snd *pm){
-    unsigned char buffer[2];
     if (pm->midi_inst > PCMIDI_INST_MIN) pm->midi_inst--;
-    buffer[0] = 128+64+pm->midi_channel;
-    buffer[1] = pm->midi_inst;
-    virtualMIDISendData(pm->port, buffer, 2);
+    pcmidi_send_program(pm);
 }
 
 bool prodikeys_sustain_switch(struct pcmidi_snd *pm){
@@ -146,280 +423,251 @@ bool prodikeys_sustain_switch(struct pcmidi_snd *pm){
 }
 
 bool prodikeys_fn_switch(struct pcmidi_snd *pm){
-    bool ret;
+    bool ret = prodikeys_send_hid_data(pm, pm->fn_state ? 0xC6 : 0xC5);
     //in case send_hid_data didn't work, force fn_state to false as keyboard is probably unplugged anyway
-    if (pm->fn_state){
-        ret = prodikeys_send_hid_data(pm->handle, 0xC6);
-        pm->fn_state = false;
-    } else {
-        ret = prodikeys_send_hid_data(pm->handle, 0xC5);
-        if (ret)
-            pm->fn_state = true;
-    }
+    pm->fn_state = ret && !pm->fn_state;
     return ret;
 }
 
 void pm_init_values(struct pcmidi_snd *pm){
-    pm->midi_channel = 0;
+    pm->midi_channel = pm->base_channel;
     pm->midi_inst = 0;
     pm->midi_octave = 0;
+    pcmidi_note_map_update(pm);
     pm->midi_pitch = PCMIDI_PITCH_BASE;
     pm->fn_state = true;
     prodikeys_fn_switch(pm);
-    pm->port = NULL;
     pm->midi_sustain_mode = false;
     pm->midi_mode = true;
     prodikeys_disable_midi(pm);
+    prodikeys_snapshot_publish(pm);
+}
+
+void prodikeys_restore_values(struct pcmidi_snd *pm, const struct prodikeys_snapshot *state){
+    pm->midi_channel = state->channel <= PCMIDI_CHANNEL_MAX ? state->channel : pm->base_channel;
+    pm->midi_inst = state->instrument <= PCMIDI_INST_MAX ? state->instrument : 0;
+    pm->midi_octave = state->octave >= PCMIDI_OCTAVE_MIN && state->octave <= PCMIDI_OCTAVE_MAX ? state->octave : 0;
+    pcmidi_note_map_update(pm);
+    pm->midi_pitch = state->pitch <= PCMIDI_PITCH_MAX ? state->pitch : PCMIDI_PITCH_BASE;
+    pm->midi_sustain_mode = state->sustain_mode;
+    if (state->fn_state && !pm->fn_state)
+        prodikeys_fn_switch(pm);
+    if (state->midi_mode && pcmidi_open_port(pm) && prodikeys_send_hid_data(pm, 0xC1)){
+        pm->midi_mode = true;
+        //program, pitch bend and sustain pedal in one write, the synth has them before the first note
+        unsigned char buffer[8];
+        buffer[0] = 128+64+pm->midi_channel;
+        buffer[1] = pm->midi_inst;
+        buffer[2] = 128+64+32+pm->midi_channel;
+        buffer[3] = pm->midi_pitch & 0x7F;
+        buffer[4] = pm->midi_pitch >> 7;
+        buffer[5] = 128+32+16+pm->midi_channel;
+        buffer[6] = 64;
+        buffer[7] = pm->midi_sustain_mode ? 127 : 0;
+        pcmidi_port_write(pm, buffer, 8);
+    }
+    prodikeys_snapshot_publish(pm);
 }
 
 bool prodikeys_enable_midi(struct pcmidi_snd *pm){
     pm_init_values(pm);
+    //the port is normally created on attach, this is only a retry (or the port_per_toggle baseline)
+    if (!pcmidi_open_port(pm)) return false;
     //printf("Activating MIDI keys.\n");
-    bool ret = prodikeys_send_hid_data(pm->handle, 0xC1);
-    if (ret){
-        pm->port = virtualMIDICreatePortEx2( L"Prodikeys MIDI Interface", NULL, 0, MAX_SYSEX_BUFFER, TE_VM_FLAGS_PARSE_RX );
-        if ( !pm->port ) {
-            //printf( "could not create port: %d\n", GetLastError() );
-            return false;
+    bool ret = prodikeys_send_hid_data(pm, 0xC1);
+    if (ret) pm->midi_mode = true;
+    prodikeys_snapshot_publish(pm);
+    return ret;
+}
+
+/* MIDI note of a raw key code at the given octave, outside 0 to 127 for keys beyond the MIDI range */
+static inline int pcmidi_key_note(uint8_t key, short octave){
+    return key < 0x81 ? key - 0x54 + PCMIDI_MIDDLE_C + octave * 12  /* note on */
+                      : key - 0x94 + PCMIDI_MIDDLE_C + octave * 12; /* note off */
+}
+
+void pcmidi_note_map_update(struct pcmidi_snd *pm){
+    for (int key = 0; key < PCMIDI_NOTE_KEYS; key++){
+        int note = pcmidi_key_note((uint8_t) key, pm->midi_octave);
+        if (note < 0 || note > 127){
+            pm->note_map[key].status = 0;
+            pm->note_map[key].note = 0;
+            continue;
         }
-        pm->midi_mode = true;
+        pm->note_map[key].status = (uint8_t) ((key < 0x81 ? 0x90 : 0x80) | pm->midi_channel); /* 1001nnnn / 1000nnnn */
+        pm->note_map[key].note = (uint8_t) note;
     }
-    return ret;
+    pm->note_map_octave = pm->midi_octave;
+    pm->note_map_channel = pm->midi_channel;
+}
+
+/* Add a note message to a report buffer with running status */
+static inline void pcmidi_note_append(struct pcmidi_snd *pm, unsigned char *buffer, int *length, unsigned char *running_status,
+                                      unsigned char status, unsigned char note, unsigned char velocity){
+#ifdef PRODIKEYS_BASELINES
+    if (pm->single_note_sends){
+        pcmidi_send_note(pm, status, note, velocity);
+        return;
+    }
+#endif
+    if (status != *running_status){
+        buffer[(*length)++] = status;
+        *running_status = status;
+    }
+    buffer[(*length)++] = note;
+    buffer[(*length)++] = velocity;
+}
+
+void pcmidi_release_notes(struct pcmidi_snd *pm){
+    unsigned char buffer[PCMIDI_PHYSICAL_KEYS * 3];
+    unsigned char running_status = 0;
+    int length = 0;
+
+    for (int word = 0; word < PCMIDI_PHYSICAL_KEYS / 32; word++){
+        uint32_t held = pm->held[word];
+        pm->held[word] = 0;
+        while (held != 0){
+            int physical = word * 32 + prodikeys_ctz(held);
+            held &= held - 1;
+            pcmidi_note_append(pm, buffer, &length, &running_status,
+                               pm->held_notes[physical].status, pm->held_notes[physical].note, 0);
+        }
+    }
+    if (length > 0)
+        pcmidi_port_write(pm, buffer, length);
 }
 
 void pcmidi_handle_note_report(struct pcmidi_snd *pm, uint8_t *data, int size)
 {
-    unsigned i, j;
+    unsigned j;
     unsigned char status, note, velocity;
+    unsigned char buffer[PCMIDI_NOTE_BUFFER_SIZE];
+    unsigned char running_status = 0;
+    int length = 0;
 
+    if (!pm->midi_mode) return; //keys pressed now must not be tracked as held
     unsigned num_notes = (size-1)/2;
+    if (num_notes > (PRODIKEYS_REPORT_SIZE - 1) / 2) num_notes = (PRODIKEYS_REPORT_SIZE - 1) / 2;
+    prodikeys_stats.notes.fetch_add(num_notes, std::memory_order_relaxed);
+    if (pm->note_map_octave != pm->midi_octave || pm->note_map_channel != pm->midi_channel)
+        pcmidi_note_map_update(pm);
 
     for (j = 0; j < num_notes; j++)	{
-        note = data[j*2+1];
+        uint8_t key = data[j*2+1];
         velocity = data[j*2+2];
+        unsigned physical = key < 0x81 ? key : key - 0x40u;
+        uint32_t bit = (uint32_t) 1 << (physical & 31);
+        uint32_t *held = &pm->held[physical >> 5];
+
+        if (key >= 0x81) { /* note off : the exact note and channel the key was pressed with */
+            if (!(*held & bit)) continue; //its note on was never sent (out of range, or pressed before MIDI mode)
+            *held &= ~bit;
+            pcmidi_note_append(pm, buffer, &length, &running_status,
+                               pm->held_notes[physical].status, pm->held_notes[physical].note, velocity);
+            continue;
+        }
 
-        if (note < 0x81) { /* note on */
-            status = 128 + 16 + pm->midi_channel; /* 1001nnnn */
-            note = note - 0x54 + PCMIDI_MIDDLE_C +
-                   (pm->midi_octave * 12);
-            if (velocity == 0){
-                //printf("VELOCITY 0!!\n");
-                velocity = 0x20; /* force note on */
-            }
-            pcmidi_send_note(pm, status, note, velocity);
-        } else { /* note off */
-            status = 128 + pm->midi_channel; /* 1000nnnn */
-            note = note - 0x94 + PCMIDI_MIDDLE_C +
-                   (pm->midi_octave*12);
-            pcmidi_send_note(pm, status, note, velocity);
+#ifdef PRODIKEYS_BASELINES
+        if (pm->computed_notes){
+            int value = pcmidi_key_note(key, pm->midi_octave);
+            status = value < 0 || value > 127 ? 0 : 0x90 | pm->midi_channel;
+            note = (unsigned char) value;
+        } else
+#endif
+        {
+            status = pm->note_map[key].status;
+            note = pm->note_map[key].note;
+        }
+        if (status == 0){
+            //key shifted out of the MIDI range by the octave, its note on and off are both dropped
+            prodikeys_stats.notes_out_of_range.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        if (velocity == 0){
+            //printf("VELOCITY 0!!\n");
+            velocity = 0x20; /* force note on */
         }
+        if (*held & bit) //pressed again without a release in between, end the previous note first
+            pcmidi_note_append(pm, buffer, &length, &running_status,
+                               pm->held_notes[physical].status, pm->held_notes[physical].note, 0);
+        *held |= bit;
+        pm->held_notes[physical].status = (uint8_t) (0x80 | (status & 0x0F)); /* 1000nnnn */
+        pm->held_notes[physical].note = note;
+        pcmidi_note_append(pm, buffer, &length, &running_status, status, note, velocity);
+    }
 
+    if (length > 0)
+        pcmidi_port_write(pm, buffer, length);
+}
+
+/* Run the actions of every button which changed, only visiting the bits set in cur ^ prev */
+static int prodikeys_dispatch_buttons(struct pcmidi_snd *pm, const struct prodikeys_button *buttons,
+                                      uint32_t cur, uint32_t prev, uint8_t *keys, bool *pressed){
+    uint32_t changed = cur ^ prev;
+    int num_keys = 0;
+    while (changed != 0){
+        int bit = prodikeys_ctz(changed);
+        changed &= changed - 1;
+        bool down = (cur >> bit) & 1;
+        //the state is read for every button, the piano and fn keys change it
+        const struct prodikeys_action *action = &buttons[bit].state[prodikeys_state(pm)];
+        if (action->key != 0){
+            keys[num_keys] = action->key;
+            pressed[num_keys++] = down;
+        }
+        if (down && action->press != NULL)
+            action->press(pm, action);
     }
+    return num_keys;
 }
 
-//TODO: write an easier to read code using a 4 state thing ( neutral / fn / midi / midi+fn )
 void pcmidi_handle_report_extra(struct pcmidi_snd *pm, uint8_t *data, int size)
 {
-    static uint32_t prev_data1 = 0;
-    static uint8_t prev_data2 = 0;
-    static uint32_t prev_data4 = 0;
-
-INPUT in[20] = {0}; // up to 20 state changes at once (buttons)
-uint8_t keys[20];
-int key_index = 0;
-bool keyState[20] = {false};
-
-if (data[0] == 0x02) {
-    if (data[1] != prev_data2) {
-        //printf("SLEEP\n");
-        if (data[1] == 0x02) keyState[key_index] = true;
-        keys[key_index++] = VK_SLEEP;
-        prev_data2 = data[1];
+    uint8_t keys[32]; // one key event per button at most
+    bool pressed[32];
+    int num_keys = 0;
+    uint32_t report = 0;
+    if (size > 1) memcpy(&report, data + 1, size - 1 < 4 ? size - 1 : 4); //little endian, as the report
+
+    //a reload swaps the whole keymap, every button of a report is dispatched with the same one, held until then
+    unsigned hold;
+    const struct prodikeys_keymap *map = prodikeys_keymap_hold(&hold);
+    if (data[0] == 0x02) {
+        num_keys = prodikeys_dispatch_buttons(pm, map->buttons[prodikeys_keymap_report(2)],
+                                              report & 0xFF, pm->prev_data2, keys, pressed);
+        pm->prev_data2 = (uint8_t) report;
+    } else if (data[0] == 0x01) {
+        num_keys = prodikeys_dispatch_buttons(pm, map->buttons[prodikeys_keymap_report(1)],
+                                              report, pm->prev_data1, keys, pressed);
+        pm->prev_data1 = report;
+    } else if (data[0] == 0x04) {
+        num_keys = prodikeys_dispatch_buttons(pm, map->buttons[prodikeys_keymap_report(4)],
+                                              report, pm->prev_data4, keys, pressed);
+        pm->prev_data4 = report;
     }
-}
-else if (data[0] == 0x01)
-{
-    uint32_t *report1 = (uint32_t *) &(data[1]);
-    if (*report1 != prev_data1){
-        if ((*report1 & 0x040000) != (prev_data1 & 0x040000)){
-            if (*report1 & 0x040000){
-                if (pm->midi_mode) prodikeys_sustain_switch(pm);
-                else keyState[key_index] = true;
-            }
-            if (!pm->midi_mode)
-                keys[key_index++] = VK_BROWSER_HOME;
-        }
-        if ((*report1 & 0x0100) != (prev_data1 & 0x0100)){
-            if (*report1 & 0x0100) {
-                if (pm->midi_mode && pm->fn_state){
-                    if (pm->midi_pitch>PCMIDI_PITCH_MIN+1000) {
-                        pm->midi_pitch -= 1000;
-                        pcmidi_send_pitch(pm);
-                    }
-                } else {
-                    keyState[key_index] = true;
-                }
-            }
-            if (!((pm->midi_mode && pm->fn_state)))
-                keys[key_index++] = VK_VOLUME_DOWN;
-        }
-        if ((*report1 & 0x2000) != (prev_data1 & 0x2000)){
-                if (*report1 & 0x2000) {
-                    if (pm->midi_mode && pm->fn_state){
-                        pm->midi_channel = 9; //switch to drum channel. TODO: remember previous channel to restore?
-                    } else {
-                        keyState[key_index] = true;
-                    }
-                }
-                if (!((pm->midi_mode && pm->fn_state)))
-                    keys[key_index++] = VK_LAUNCH_MEDIA_SELECT; // EJECT CD, TODO: implement CD drive eject?
-            }
+    prodikeys_keymap_release(hold);
 
-        if ((*report1 & 0x4000) != (prev_data1 & 0x4000)){
-            if (*report1 & 0x4000){
-                if(pm->midi_mode){
-                    if (pm->fn_state){
-                        pcmidi_prev_instrument(pm);
-                    } else if (pm->midi_octave > PCMIDI_OCTAVE_MIN) pm->midi_octave--;
-                }
-                else keyState[key_index] = true;
-            }
-            if (!pm->midi_mode) keys[key_index++] = VK_LAUNCH_MAIL;
-        }
-        if ((*report1 & 0x8000) != (prev_data1 & 0x8000)){
-            if (*report1 & 0x8000) ShellExecute(NULL, "open", "calc.exe", NULL, NULL, SW_SHOWDEFAULT); //system("calc.exe");
-        }
+    //buttons may have changed channel, octave, pitch, instrument, fn, sustain or MIDI mode
+    if (prodikeys_keymap_report(data[0]) >= 0)
+        prodikeys_snapshot_publish(pm);
 
-        //next track (becomes next channel in midi mode)
-        if ((*report1 & 0x01) != (prev_data1 & 0x01)){
-            if (*report1 & 0x01) {
-                if (pm->midi_mode && pm->fn_state){
-                    if (pm->midi_channel<PCMIDI_CHANNEL_MAX) pm->midi_channel++;
-                } else {
-                    keyState[key_index] = true;
-                }
-            }
-            if (!((pm->midi_mode && pm->fn_state)))
-                keys[key_index++] = VK_MEDIA_PREV_TRACK;
-        }
-        if ((*report1 & 0x02) != (prev_data1 & 0x02)){
-            if (*report1 & 0x02) {
-                if (pm->midi_mode && pm->fn_state){
-                    if (pm->midi_channel>PCMIDI_CHANNEL_MIN) pm->midi_channel--;
-                } else {
-                    keyState[key_index] = true;
-                }
-            }
-            if (!((pm->midi_mode && pm->fn_state)))
-                keys[key_index++] = VK_MEDIA_PREV_TRACK;
-        }
-        if ((*report1 & 0x04) != (prev_data1 & 0x04)){
-            if (*report1 & 0x04) {
-                if (pm->midi_mode && pm->fn_state) pm->midi_channel = 0;
-                else keyState[key_index] = true;
-            }
-            if (!((pm->midi_mode && pm->fn_state)))
-                keys[key_index++] = VK_MEDIA_STOP;
-        }
-        if ((*report1 & 0x08) != (prev_data1 & 0x08)){
-            if (*report1 & 0x08) keyState[key_index] = true;
-            keys[key_index++] = VK_MEDIA_PLAY_PAUSE;
-        }
-        if ((*report1 & 0x10) != (prev_data1 & 0x10)){
-            if (*report1 & 0x10) {
-                if (pm->midi_mode && pm->fn_state){
-                    pm->midi_pitch = PCMIDI_PITCH_BASE;
-                    pcmidi_send_pitch(pm);
-                } else {
-                    keyState[key_index] = true;
-                }
-            }
-            if (!((pm->midi_mode && pm->fn_state)))
-                keys[key_index++] = VK_VOLUME_MUTE;
-        }
-        if ((*report1 & 0x80) != (prev_data1 & 0x80)){
-            if (*report1 & 0x80) {
-                if (pm->midi_mode && pm->fn_state){
-                    if (pm->midi_pitch<PCMIDI_PITCH_MAX-1000) {
-                        pm->midi_pitch += 1000;
-                        pcmidi_send_pitch(pm);
-                    }
-                } else {
-                    keyState[key_index] = true;
-                }
-            }
-            if (!((pm->midi_mode && pm->fn_state)))
-                keys[key_index++] = VK_VOLUME_UP;
-        }
-        prev_data1 = *report1;
-    }
+    //finished collecting data, sending key updates
+    if (num_keys > 0)
+        prodikeys_executor_keys(keys, pressed, num_keys);
 }
-else if (data[0] == 0x04)
+
+void pcmidi_handle_report(struct pcmidi_snd *pm, struct prodikeys_report *report)
 {
-    uint32_t *report4 = (uint32_t *) &(data[1]);
-    if (*report4 != prev_data4){
-        if ((*report4 & 0x100000) != (prev_data4 & 0x100000)){
-            if (*report4 & 0x100000) {
-                prodikeys_fn_switch(pm);
-            }
-        }
-        if ((*report4 & 0x01) != (prev_data4 & 0x01)){
-            if (*report4 & 0x01) keyState[key_index] = true; //TODO: implement session lock?
-            //printf("LOCK\n");
-            //lock keys[key_index++] = VK_L;
-        }
-        if ((*report4 & 0x02) != (prev_data4 & 0x02)){
-            if (*report4 & 0x02) {
-                pm->midi_mode? prodikeys_disable_midi(pm): prodikeys_enable_midi(pm);
-            }
-        }
-        if ((*report4 & 0x04) != (prev_data4 & 0x04)){
-            if (*report4 & 0x04) system("explorer.exe \"%userprofile%\\Documents\"");
-        }
-        if ((*report4 & 0x08) != (prev_data4 & 0x08)){
-            if (*report4 & 0x08) keyState[key_index] = true; //TODO: implement address book
-            //printf("adress book\n");
-            //key_index++;
-            //keys[key_index++] = ;
-        }
-        if ((*report4 & 0x10) != (prev_data4 & 0x10)){
-            if (*report4 & 0x10) {
-                if(pm->midi_mode){
-                    if (pm->fn_state){
-                        pcmidi_next_instrument(pm);
-                    } else if (pm->midi_octave < PCMIDI_OCTAVE_MAX) pm->midi_octave++;
-                }
-            }
-            //instant messaging is octave++ when in midi mode, and instrument++ when in midi+fn
-            //key_index++;
-            //keys[key_index++] = VK_MEDIA_NEXT_TRACK;
-        }
-        if ((*report4 & 0x20) != (prev_data4 & 0x20)){
-            //My Music
-            if (*report4 & 0x20) system("explorer.exe \"%userprofile%\\Music\"");
-        }
-        if ((*report4 & 0x40) != (prev_data4 & 0x40)){
-            if (*report4 & 0x40) keyState[key_index] = true; //TODO: implement calendar
-            //printf("calendar\n");
-            //key_index++;
-            //keys[key_index++] = VK_MEDIA_STOP;
-        }
-        if ((*report4 & 0x80) != (prev_data4 & 0x80)){
-            if (*report4 & 0x80) system("explorer.exe \"%userprofile%\\Pictures\"");
-            //keys[key_index++] = VK_MEDIA_PLAY_PAUSE;
-        }
-        prev_data4 = *report4;
+    if (report->length <= 0) return;
+    uint8_t id = report->data[0] < PRODIKEYS_STATS_REPORT_IDS ? report->data[0] : 0;
+    prodikeys_stats.reports[id].fetch_add(1, std::memory_order_relaxed);
+    pm->report_ns = report->timestamp_ns;
+    if (report->data[0] == 0x03)
+        pcmidi_handle_note_report(pm, report->data, report->length);
+    else {
+        uint64_t start = prodikeys_now_ns();
+        pcmidi_handle_report_extra(pm, report->data, report->length);
+        prodikeys_stats_stage(PRODIKEYS_STAGE_BUTTONS, prodikeys_now_ns() - start);
     }
+    pm->report_ns = 0; //report sent nothing
 }
-
-//finished collecting data, sending key updates
-for (int i = 0; i < key_index; i++){
-        in[i].type = INPUT_KEYBOARD;
-        in[i].ki.time = 0;
-        in[i].ki.dwExtraInfo = 0;
-        in[i].ki.wVk = keys[i];
-        in[i].ki.dwFlags = 0x0000; // 0x0008 is for unicode, disables wVk and uses wScan instead
-        if (!keyState[i]) in[i].ki.dwFlags |= 0x0002;
-}
-        SendInput(key_index, in, sizeof(INPUT));
-}
\ No newline at end of file
@@ -8,8 +8,99 @@
  * Copyright 2009 Don Prince
  *
  */
-#include "teVirtualMIDI.h"
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
 #include "libusb-1.0/libusb.h"
+#include "prodikeys-midi.h"
+
+#define PRODIKEYS_ENDPOINT_OUT 0x03
+#define PRODIKEYS_REPORT_SIZE 31
+
+//A hid report as received from the interrupt IN endpoint, one cache line per report.
+//Reports are filled in place by the USB transport and handed to the decoder by pointer, never copied
+struct alignas(64) prodikeys_report {
+    uint64_t            timestamp_ns;                   // when the transfer completed (prodikeys_now_ns)
+    int                 length;                         // bytes received
+    uint8_t             data[PRODIKEYS_REPORT_SIZE];    // report id followed by report data
+};
+#define PRODIKEYS_CMD_GROUPS 3      // midi keys (C1/C2), queries (C3/C4), FN led (C5/C6)
+#define PRODIKEYS_CMD_DRAIN_NS 250000000ULL     // time queued commands get to be written when a device is released
+
+//Asynchronous report id 6 command writer. Commands are written one at a time by a single OUT transfer.
+//A command waiting for its turn is replaced by any newer command of its group, so callers never wait for the device
+struct prodikeys_cmd_queue {
+    libusb_device_handle        *handle;                        // libusb handle the commands are written to
+    struct libusb_transfer      *transfer;                      // the OUT transfer
+    uint8_t                     buffer[3];                      // report being written
+    int                         current;                        // group of the command being written
+    uint8_t                     written[PRODIKEYS_CMD_GROUPS];  // last command of each group acknowledged by the device
+    uint64_t                    submitted_ns;                   // when the command being written was submitted
+    std::atomic<uint8_t>        pending[PRODIKEYS_CMD_GROUPS];  // next command of each group, 0 if none
+    std::atomic<bool>           busy;                           // transfer is in flight or being prepared
+    std::atomic<unsigned long>  sent;                           // commands acknowledged by the device
+    std::atomic<unsigned long>  failed;                         // commands which couldn't be written
+    std::atomic<unsigned long>  coalesced;                      // commands replaced before being written, or already in effect
+    std::atomic<unsigned long>  last_latency_us;                // submit to completion time of the last command
+    std::atomic<unsigned long>  max_latency_us;                 // worst submit to completion time
+};
+
+#define PCMIDI_NOTE_KEYS 256              // raw key codes of report id 3 (note on below 0x81, note off from 0x81)
+#define PCMIDI_PHYSICAL_KEYS 0xC0         // physical keys : note on code, note off code minus 0x40
+
+//MIDI bytes a raw key code translates to, for the octave and channel in use
+struct pcmidi_note {
+    uint8_t             status;             // note on / note off status byte with the channel, 0 if the note falls outside 0 to 127
+    uint8_t             note;               // MIDI note number
+};
+
+//Device state as seen by UI and control threads, taken at once by prodikeys_snapshot_read
+struct prodikeys_snapshot {
+    uint32_t            version;            // publications so far, a reader can tell whether anything changed
+    bool                connected;          // a keyboard (or a replayed one) is behind the device
+    bool                midi_mode;
+    bool                fn_state;
+    bool                sustain_mode;
+    uint16_t            channel;
+    uint16_t            instrument;
+    int16_t             octave;
+    uint16_t            pitch;
+    //report id 6 command writer, published again whenever a command is queued or completes
+    uint32_t            cmd_sent;           // commands acknowledged by the device
+    uint32_t            cmd_failed;         // commands which couldn't be written
+    uint32_t            cmd_coalesced;      // commands replaced before being written, or already in effect
+    uint32_t            cmd_max_latency_us; // worst submit to completion time
+    uint32_t            cmd_depth;          // commands queued or being written (prodikeys_cmd_depth)
+};
+#define PRODIKEYS_SNAPSHOT_WORDS ((sizeof(struct prodikeys_snapshot) + 3) / 4)
+
+//Where a keyboard is plugged : bus and hub port path, the same again when it is replugged in the same port
+#define PRODIKEYS_PORT_PATH_MAX 7           // USB 3.0 tree depth
+struct prodikeys_location {
+    uint8_t             bus;
+    uint8_t             num_ports;          // 0 for an unknown location
+    uint8_t             ports[PRODIKEYS_PORT_PATH_MAX];
+};
+
+//Seqlock the state is published through : the sequence is odd while a writer stores the words.
+//Readers retry instead of waiting, writers (reading thread, UI thread) only ever wait for each other
+struct prodikeys_seqlock {
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> words[PRODIKEYS_SNAPSHOT_WORDS];  // the prodikeys_snapshot, version left to 0
+};
+
+struct prodikeys_sim;
+
+//Changes to a device asked for by another thread (the tray menu), made by its reading thread between two reports
+//so that the device state and its output ring only ever have the reading thread as writer (its reads and commands
+//completing on that thread too, its libusb context being its own : pcmidi_snd::context)
+enum prodikeys_request {
+    PRODIKEYS_REQUEST_NONE,
+    PRODIKEYS_REQUEST_MIDI_ON,      // prodikeys_enable_midi, unless piano keys are on already
+    PRODIKEYS_REQUEST_MIDI_OFF,     // prodikeys_disable_midi, unless piano keys are off already
+};
 
 //Prodikeys device global struct
 struct pcmidi_snd {
@@ -20,10 +111,49 @@ struct pcmidi_snd {
     unsigned short		midi_inst;          // instrument in use
     short				midi_octave;        // current octave
     unsigned short		midi_pitch;         // current pitch
-    LPVM_MIDI_PORT port;                    // teVirtualMIDI handle
+    unsigned short		base_channel;       // midi channel assigned to this keyboard (merged port mode)
+    struct pcmidi_port  *port;              // virtual MIDI port
+    struct pcmidi_port  **shared_port;      // port shared by all keyboards and owned by the application, or NULL
+    char                port_name[64];      // name of the port created by this keyboard (UTF-8)
+    struct prodikeys_ring *ring;            // output thread ring MIDI messages are queued to, or NULL to write them inline
     libusb_device_handle *handle;           // libusb handle
+    libusb_context      *context;           // context the handle was opened in, NULL for the default one. Only the thread
+                                            // reading the keyboard handles its events (then the one releasing it)
+    bool                offline;            // no keyboard behind (trace replay), commands are taken as acknowledged
+#ifdef PRODIKEYS_BASELINES
+    //former code paths the benchmarks compare against, only built into prodikeysd-baselines
+    bool                single_note_sends;  // one port send per note instead of one per report
+    bool                computed_notes;     // notes computed for every key instead of looked up in note_map
+    bool                port_per_toggle;    // port closed when MIDI mode ends and created again when it starts
+#endif
+    struct prodikeys_cmd_queue cmd;         // report id 6 command writer
+    uint32_t            prev_data1;         // last report id 1 received (media keys)
+    uint8_t             prev_data2;         // last report id 2 received (system keys)
+    uint32_t            prev_data4;         // last report id 4 received (extra keys)
+    uint64_t            report_ns;          // completion time of the report being decoded, until its first MIDI message is sent
+    short               note_map_octave;    // octave and channel note_map was built for, rebuilt by the note
+    unsigned short      note_map_channel;   // report handler as soon as either differs from the ones in use
+    struct pcmidi_note  note_map[PCMIDI_NOTE_KEYS]; // raw key code to ready to send MIDI bytes
+    uint32_t            held[PCMIDI_PHYSICAL_KEYS / 32]; // physical keys whose note on was sent and not released yet
+    struct pcmidi_note  held_notes[PCMIDI_PHYSICAL_KEYS]; // note off (status with channel, note) each held key must send
+    struct prodikeys_seqlock snapshot;      // state published for other threads, cf. prodikeys_snapshot_publish
+    struct prodikeys_sim *sim;              // simulated keyboard commands are written to instead (offline only), or NULL
+    std::atomic<int>    request;            // prodikeys_request waiting for the reading thread, the latest one wins
 };
 
+//Keyboard states the function buttons act upon
+enum prodikeys_state {
+    PRODIKEYS_STATE_NEUTRAL,    // piano keys and fn lock off
+    PRODIKEYS_STATE_FN,         // fn lock on
+    PRODIKEYS_STATE_MIDI,       // piano keys on
+    PRODIKEYS_STATE_MIDI_FN,    // piano keys and fn lock on
+    PRODIKEYS_STATES
+};
+
+#define PRODIKEYS_VID 0x041e
+#define PRODIKEYS_PID 0x2801
+#define PRODIKEYS_MAX_DEVICES 16
+
 #define PCMIDI_PITCH_MAX 0x3FFF
 #define PCMIDI_PITCH_BASE 0x2000
 #define PCMIDI_PITCH_MIN 0x0
@@ -34,21 +164,87 @@ struct pcmidi_snd {
 #define PCMIDI_OCTAVE_MAX 2
 #define PCMIDI_INST_MIN 0
 #define PCMIDI_INST_MAX 127
+#define PCMIDI_NOTE_BUFFER_SIZE ((PRODIKEYS_REPORT_SIZE - 1) / 2 * 6)  // every note of a report, status byte each, maybe after a retrigger note off
+
+/**
+ * Monotonic clock used for timestamps and latency measurements
+ * @return current time in nanoseconds
+ */
+static inline uint64_t prodikeys_now_ns(){
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-#define MAX_SYSEX_BUFFER	65535
+/**
+ * Current state of a device for its function buttons
+ * @param pm the Prodikeys device
+ * @return the prodikeys_state
+ */
+static inline enum prodikeys_state prodikeys_state(const struct pcmidi_snd *pm){
+    return (enum prodikeys_state) ((pm->midi_mode ? PRODIKEYS_STATE_MIDI : PRODIKEYS_STATE_NEUTRAL) | (pm->fn_state ? PRODIKEYS_STATE_FN : 0));
+}
+
+/**
+ * Publish the device state (channel, octave, instrument, pitch, fn, sustain, MIDI mode, connection and command
+ * writer counters) for prodikeys_snapshot_read. Called by the core whenever it changes them; the application calls it after
+ * changing handle or offline. Never waits on readers.
+ * @param pm the Prodikeys device
+ */
+void prodikeys_snapshot_publish(struct pcmidi_snd *pm);
+
+/**
+ * Consistent copy of the last published device state, from any thread, without locking
+ * @param pm the Prodikeys device
+ * @param snapshot receives the state
+ * @return times the copy had to be taken again because a publication was in progress
+ */
+int prodikeys_snapshot_read(const struct pcmidi_snd *pm, struct prodikeys_snapshot *snapshot);
 
 /**
  * Init prodikeys default values :
- * channel, instrument, octave set to 0
+ * channel set to base_channel, instrument, octave set to 0
  * fn_state, sustain_mode, midi_mode set to false
  * pitch set to 0x2000
- * VirtualMIDI port handle set to NULL
+ * (the MIDI port is left open)
  * @param pm the Prodikeys device
  */
 void pm_init_values(struct pcmidi_snd *pm);
 
 /**
- * Send a 3-byte HID message to report id 6. The message will be 06 01 nn with nn = byte.
+ * Give a replugged keyboard back the state it had when it was unplugged, instead of the default values :
+ * channel, octave, instrument, pitch, fn lock and sustain, and piano keys if they were enabled. The instrument,
+ * pitch and sustain are then sent again as a single MIDI batch, so the synth plays as it did before the unplug.
+ * To be called once the port is open, after pm_init_values.
+ * @param pm the Prodikeys device
+ * @param state the device state before the unplug (from prodikeys_snapshot_read)
+ */
+void prodikeys_restore_values(struct pcmidi_snd *pm, const struct prodikeys_snapshot *state);
+
+/**
+ * Allocate the report id 6 command writer of a device (pm->handle must be valid)
+ * @param pm the Prodikeys device
+ * @return true iff the OUT transfer could be allocated
+ */
+bool prodikeys_cmd_init(struct pcmidi_snd *pm);
+
+/**
+ * Free the command writer. Queued commands (the C2 of a last prodikeys_disable_midi) are written first, for up to
+ * PRODIKEYS_CMD_DRAIN_NS, then the command being written is cancelled and the rest dropped.
+ * Handles the events of the device context (pm->context) until the OUT transfer is back, so it must not be called
+ * from a libusb callback, nor while a reading thread handles them.
+ * @param pm the Prodikeys device
+ */
+void prodikeys_cmd_free(struct pcmidi_snd *pm);
+
+/**
+ * Number of commands waiting to be written, including the one being written
+ * @param pm the Prodikeys device
+ * @return command queue depth
+ */
+int prodikeys_cmd_depth(struct pcmidi_snd *pm);
+
+/**
+ * Queue a 3-byte HID message to report id 6. The message will be 06 01 nn with nn = byte.
  * C1 enable piano keys
  * C2 disable piano keys
  * C3 unknown, gets a reply message on report id 5 ( 05 c3 0a 00 00 02 )
@@ -56,14 +252,34 @@ void pm_init_values(struct pcmidi_snd *pm);
  * C5 turn the FN led ON
  * C6 turn the FN led OFF
  *
- * @param handle libusb handle to the device
+ * Returns immediately, the message is written from libusb event handling. A message still waiting to be written
+ * is replaced by a newer one of the same pair (C1/C2, C3/C4, C5/C6), and C1/C2/C5/C6 messages matching the state
+ * last acknowledged by the device are dropped.
+ * Without a keyboard (offline), messages are taken as acknowledged, or written to the simulated keyboard.
+ *
+ * @param pm the Prodikeys device
  * @param byte the command byte
- * @return true iff the message was sent successfully.
+ * @return true iff the message was queued successfully.
  */
-bool prodikeys_send_hid_data(libusb_device_handle* handle, uint8_t byte);
+bool prodikeys_send_hid_data(struct pcmidi_snd *pm, uint8_t byte);
+
+/**
+ * Create the device virtual MIDI port, or open the shared one if shared_port is set.
+ * Done once when the keyboard is attached, MIDI mode then only gates what is written to the port.
+ * @param pm the prodikeys device
+ * @return true iff the port is open
+ */
+bool pcmidi_open_port(struct pcmidi_snd *pm);
+
+/**
+ * Release held notes, leave MIDI mode and close the device port (a shared port is only let go of)
+ * @param pm the prodikeys device
+ */
+void pcmidi_close_port(struct pcmidi_snd *pm);
 
 /**
  * Enable midi keys
+ * (creates the device port if it couldn't be on attach)
  * @param pm the prodikeys device
  * @return true iff the message was sent successfully
  */
@@ -77,11 +293,46 @@ bool prodikeys_enable_midi(struct pcmidi_snd *pm);
 bool prodikeys_disable_midi(struct pcmidi_snd *pm);
 
 /**
- * Attach to the Prodikeys device (VID_041E&PID_2801) interface 1
+ * Make the change another thread last asked for (pm->request), if any. Called by the reading thread only.
+ * @param pm the prodikeys device
+ */
+void prodikeys_handle_request(struct pcmidi_snd *pm);
+
+/**
+ * Attach to interface 1 of a Prodikeys device (VID_041E&PID_2801)
+ * @param device the libusb device, anything else than a Prodikeys is ignored
  * @param handle resulting handle if successful, or NULL
  * @return true iff the interface was claimed successfully
  */
-bool prodikeys_claim_interface(libusb_device_handle** handle);
+bool prodikeys_claim_device(libusb_device *device, libusb_device_handle** handle);
+
+/**
+ * Attach to interface 1 of every Prodikeys device (VID_041E&PID_2801) which isn't already in use.
+ * Devices are listed in the default libusb context, which must be initialized and is kept from one call to the next,
+ * and each one is opened in a context of its own : the events of a keyboard are then only handled by the thread
+ * reading it, never by the thread of another keyboard. A context is exited once its handle is closed.
+ * @param handles array receiving the handles of the claimed devices
+ * @param contexts array receiving the context each handle was opened in
+ * @param max size of the arrays
+ * @return number of devices claimed
+ */
+int prodikeys_claim_interfaces(libusb_device_handle** handles, libusb_context** contexts, int max);
+
+/**
+ * Bus and port path of a device
+ * @param device the libusb device
+ * @param location receives the location (num_ports is 0 if it couldn't be read)
+ */
+void prodikeys_location_get(libusb_device *device, struct prodikeys_location *location);
+
+/**
+ * Whether two locations are the same known port
+ * @return true iff both are known and equal
+ */
+static inline bool prodikeys_location_equal(const struct prodikeys_location *a, const struct prodikeys_location *b){
+    return a->num_ports != 0 && a->bus == b->bus && a->num_ports == b->num_ports
+           && memcmp(a->ports, b->ports, a->num_ports) == 0;
+}
 
 /**
  * Send a midi NOTE ON or NOTE OFF message to the VirtualMIDI driver
@@ -127,12 +378,19 @@ void pcmidi_next_instrument(struct pcmidi_snd *pm);
  * @param pm the Prodikeys device
  */
 void pcmidi_prev_instrument(struct pcmidi_snd *pm);
+/**
+ * Send a MIDI instrument change message to the VirtualMIDI driver, taking value from the struct midi_inst field
+ * Status byte : 1100 CCCC
+ * Data byte 1 : 0XXX XXXX //instrument number
+ * @param pm the Prodikeys device
+ */
+void pcmidi_send_program(struct pcmidi_snd *pm);
 
 /**
  * handle keypress on Prodikeys FN key
  * (updates the fn_state field and light the FN led accordingly)
  * @param pm the Prodikeys device
- * @return true iff message was successfully sent.
+ * @return true iff message was successfully queued.
  */
 bool prodikeys_fn_switch(struct pcmidi_snd *pm);
 
@@ -145,8 +403,24 @@ bool prodikeys_fn_switch(struct pcmidi_snd *pm);
  */
 bool prodikeys_sustain_switch(struct pcmidi_snd *pm);
 
+/**
+ * Send the note off of every key still held, and forget them (before the port changes or MIDI mode ends)
+ * @param pm the Prodikeys device
+ */
+void pcmidi_release_notes(struct pcmidi_snd *pm);
+
+/**
+ * Rebuild the key code to MIDI note table for the current octave and channel
+ * @param pm the Prodikeys device
+ */
+void pcmidi_note_map_update(struct pcmidi_snd *pm);
+
 /**
  * Handle prodikeys report id 3 hid messages (piano keys : note on/off forwarding to VirtualMIDI driver)
+ * Every note of the report is encoded in a single buffer with running status (the status byte is only
+ * repeated when it changes) and handed to the port at once (one send per note with the single_note_sends baseline).
+ * Keys are translated through note_map; keys whose note would fall outside 0 to 127 are dropped and counted.
+ * A released key sends the note off matching the note on it sent (see held), whatever the octave and channel are now.
  * @param pm the Prodikeys device
  * @param data hid report data
  * @param size hid report size
@@ -155,6 +429,8 @@ void pcmidi_handle_note_report(struct pcmidi_snd *pm, uint8_t *data, int size);
 
 /**
  * Handle prodikeys report id 1/2/4 hid messages (special function keys and volume wheel..)
+ * Only the bits which changed since the previous report are visited, each one running the action the
+ * active keymap (prodikeys-keymap.h) gives its button in the current prodikeys_state.
  * cf. appendix for details
  * @param pm the Prodikeys device
  * @param data hid report data
@@ -162,6 +438,14 @@ void pcmidi_handle_note_report(struct pcmidi_snd *pm, uint8_t *data, int size);
  */
 void pcmidi_handle_report_extra(struct pcmidi_snd *pm, uint8_t *data, int size);
 
+/**
+ * Dispatch a hid report read from the interrupt IN endpoint to the note or extra keys handler
+ * according to its report id (first byte)
+ * @param pm the Prodikeys device
+ * @param report the received report
+ */
+void pcmidi_handle_report(struct pcmidi_snd *pm, struct prodikeys_report *report);
+
 /*
  * Appendix: Prodikeys HID messages reference
  *
@@ -0,0 +1,132 @@
+/* Prodikeys MIDI Interface - slow button actions executor
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "prodikeys-core.h"
+#include "prodikeys-executor.h"
+#include "prodikeys-stats.h"
+
+enum prodikeys_job_type {
+    PRODIKEYS_JOB_KEYS,
+    PRODIKEYS_JOB_LAUNCH,
+};
+
+struct prodikeys_job {
+    uint64_t                        queued_ns;
+    enum prodikeys_job_type         type;
+    enum prodikeys_launch_target    target;                         // PRODIKEYS_JOB_LAUNCH
+    int                             count;                          // PRODIKEYS_JOB_KEYS
+    uint8_t                         keys[PRODIKEYS_EXECUTOR_KEYS];
+    bool                            pressed[PRODIKEYS_EXECUTOR_KEYS];
+};
+
+static struct {
+    struct prodikeys_job        jobs[PRODIKEYS_EXECUTOR_QUEUE];
+    unsigned                    head;       // next job queued
+    unsigned                    tail;       // next job run
+    std::mutex                  mutex;
+    std::condition_variable     wake;
+    std::thread                 thread;
+    bool                        running;
+    std::atomic<bool>           started;    // jobs are queued, run inline otherwise
+    std::atomic<struct prodikeys_injector *> injector;  // virtual keyboard key jobs go to, NULL to drop them
+} prodikeys_executor;
+
+static void prodikeys_job_run(const struct prodikeys_job *job){
+    if (job->type == PRODIKEYS_JOB_KEYS){
+        struct prodikeys_injector *injector = prodikeys_executor.injector.load(std::memory_order_acquire);
+        if (injector != NULL)
+            prodikeys_injector_send(injector, job->keys, job->pressed, job->count);
+    } else
+        prodikeys_launch(job->target);
+}
+
+static void prodikeys_executor_run(){
+    struct prodikeys_job job;
+    std::unique_lock<std::mutex> lock(prodikeys_executor.mutex);
+    while (true){
+        if (prodikeys_executor.head == prodikeys_executor.tail){
+            if (!prodikeys_executor.running) break;
+            prodikeys_executor.wake.wait(lock);
+            continue;
+        }
+        job = prodikeys_executor.jobs[prodikeys_executor.tail++ % PRODIKEYS_EXECUTOR_QUEUE];
+        lock.unlock();
+        prodikeys_job_run(&job);
+        prodikeys_stats_stage(PRODIKEYS_STAGE_ACTION, prodikeys_now_ns() - job.queued_ns);
+        lock.lock();
+    }
+}
+
+/* Hand a job to the executor, or run it now if there is none */
+static void prodikeys_executor_queue(const struct prodikeys_job *job){
+    if (!prodikeys_executor.started.load(std::memory_order_acquire)){
+        prodikeys_job_run(job);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(prodikeys_executor.mutex);
+        if (prodikeys_executor.head - prodikeys_executor.tail >= PRODIKEYS_EXECUTOR_QUEUE){
+            prodikeys_stats.actions_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        prodikeys_executor.jobs[prodikeys_executor.head++ % PRODIKEYS_EXECUTOR_QUEUE] = *job;
+    }
+    prodikeys_executor.wake.notify_one();
+}
+
+bool prodikeys_executor_start(){
+    if (prodikeys_executor.started) return true;
+    prodikeys_executor.head = 0;
+    prodikeys_executor.tail = 0;
+    prodikeys_executor.running = true;
+    try {
+        prodikeys_executor.thread = std::thread(prodikeys_executor_run);
+    } catch (const std::system_error &) {
+        prodikeys_executor.running = false;
+        return false;
+    }
+    prodikeys_executor.started.store(true, std::memory_order_release);
+    return true;
+}
+
+void prodikeys_executor_stop(){
+    if (!prodikeys_executor.started) return;
+    {
+        std::lock_guard<std::mutex> lock(prodikeys_executor.mutex);
+        prodikeys_executor.running = false;
+    }
+    prodikeys_executor.wake.notify_one();
+    prodikeys_executor.thread.join();
+    prodikeys_executor.started = false;
+}
+
+void prodikeys_executor_injector(struct prodikeys_injector *injector){
+    prodikeys_executor.injector.store(injector, std::memory_order_release);
+}
+
+void prodikeys_executor_keys(const uint8_t *keys, const bool *pressed, int count){
+    struct prodikeys_job job;
+    if (count > PRODIKEYS_EXECUTOR_KEYS) count = PRODIKEYS_EXECUTOR_KEYS;
+    job.queued_ns = prodikeys_now_ns();
+    job.type = PRODIKEYS_JOB_KEYS;
+    job.target = PRODIKEYS_LAUNCH_CALCULATOR;
+    job.count = count;
+    memcpy(job.keys, keys, count);
+    memcpy(job.pressed, pressed, count * sizeof(bool));
+    prodikeys_executor_queue(&job);
+}
+
+void prodikeys_executor_launch(enum prodikeys_launch_target target){
+    struct prodikeys_job job;
+    job.queued_ns = prodikeys_now_ns();
+    job.type = PRODIKEYS_JOB_LAUNCH;
+    job.target = target;
+    job.count = 0;
+    prodikeys_executor_queue(&job);
+}
@@ -0,0 +1,47 @@
+/* Prodikeys MIDI Interface - slow button actions executor
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Launching an application (a shell, explorer, calc.exe) and injecting keys are system calls which can take
+ * hundreds of milliseconds. Function buttons queue them here instead, and an executor thread with default
+ * scheduling runs them in order, so the reading threads go straight back to decoding notes.
+ * Queueing only takes a mutex the executor holds while taking a job out, never while running one.
+ * Until the executor is started (or if it couldn't be), jobs run on the calling thread.
+ */
+#pragma once
+#include <stdint.h>
+#include "prodikeys-inject.h"
+#include "prodikeys-os.h"
+
+#define PRODIKEYS_EXECUTOR_QUEUE 64         // jobs waiting at most, more are dropped (and counted)
+#define PRODIKEYS_EXECUTOR_KEYS PRODIKEYS_INJECT_KEYS   // key events of a job, one per button of a report at most
+
+/**
+ * Start the executor thread
+ * @return true iff the thread is running
+ */
+bool prodikeys_executor_start();
+
+/**
+ * Run the jobs still queued and stop the executor thread
+ */
+void prodikeys_executor_stop();
+
+/**
+ * Set where key jobs are injected
+ * @param injector the virtual keyboard, NULL to drop key jobs (the default)
+ */
+void prodikeys_executor_injector(struct prodikeys_injector *injector);
+
+/**
+ * Queue key presses and releases, injected as one batch through the executor injector
+ * @param keys prodikeys_key values
+ * @param pressed true for a key press, false for a key release
+ * @param count number of key events (up to PRODIKEYS_EXECUTOR_KEYS)
+ */
+void prodikeys_executor_keys(const uint8_t *keys, const bool *pressed, int count);
+
+/**
+ * Queue an application or folder launch (prodikeys_launch)
+ * @param target what to open
+ */
+void prodikeys_executor_launch(enum prodikeys_launch_target target);
@@ -0,0 +1,38 @@
+/* Prodikeys MIDI Interface - key injection, windows SendInput implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Keys go to the system input queue, as if typed on the regular keyboard. prodikeys_key values are virtual-key codes.
+ */
+#include <stdlib.h>
+#include <windows.h>
+#include "prodikeys-inject.h"
+
+struct prodikeys_injector {
+    INPUT               in[PRODIKEYS_INJECT_KEYS];  // keyboard inputs of the batch being injected
+};
+
+struct prodikeys_injector *prodikeys_injector_open(const char *name){
+    struct prodikeys_injector *injector = static_cast<prodikeys_injector *>(calloc(1, sizeof(struct prodikeys_injector)));
+    if (injector == NULL) return NULL;
+    for (int i = 0; i < PRODIKEYS_INJECT_KEYS; i++)
+        injector->in[i].type = INPUT_KEYBOARD;
+    return injector;
+}
+
+bool prodikeys_injector_send(struct prodikeys_injector *injector, const uint8_t *keys, const bool *pressed, int count){
+    if (injector == NULL || count <= 0) return false;
+    if (count > PRODIKEYS_INJECT_KEYS) count = PRODIKEYS_INJECT_KEYS;
+
+    for (int i = 0; i < count; i++){
+        injector->in[i].ki.time = 0;
+        injector->in[i].ki.dwExtraInfo = 0;
+        injector->in[i].ki.wVk = keys[i];
+        injector->in[i].ki.dwFlags = 0x0000; // 0x0008 is for unicode, disables wVk and uses wScan instead
+        if (!pressed[i]) injector->in[i].ki.dwFlags |= 0x0002;
+    }
+    return SendInput(count, injector->in, sizeof(INPUT)) == (UINT) count;
+}
+
+void prodikeys_injector_close(struct prodikeys_injector *injector){
+    free(injector);
+}
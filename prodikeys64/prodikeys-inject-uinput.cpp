@@ -0,0 +1,112 @@
+/* Prodikeys MIDI Interface - key injection, linux uinput implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ * A uinput keyboard only able to send the Prodikeys media and system keys is created once. A batch is written
+ * as one array of key events closed by a single SYN_REPORT, so readers get the whole batch in one frame.
+ * Needs write access to /dev/uinput (e.g. an udev rule giving it to the input group).
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#include "prodikeys-core.h"
+#include "prodikeys-inject.h"
+
+struct prodikeys_injector {
+    int                 fd;                                     // /dev/uinput, the device lives as long as it is open
+    struct input_event  events[PRODIKEYS_INJECT_KEYS + 1];      // key events of the batch being injected, then SYN_REPORT
+};
+
+/* Linux key code of a prodikeys_key, 0 if there is none */
+static unsigned short prodikeys_uinput_code(uint8_t key){
+    switch (key){
+        case PRODIKEYS_KEY_SLEEP:               return KEY_SLEEP;
+        case PRODIKEYS_KEY_BROWSER_HOME:        return KEY_HOMEPAGE;
+        case PRODIKEYS_KEY_VOLUME_MUTE:         return KEY_MUTE;
+        case PRODIKEYS_KEY_VOLUME_DOWN:         return KEY_VOLUMEDOWN;
+        case PRODIKEYS_KEY_VOLUME_UP:           return KEY_VOLUMEUP;
+        case PRODIKEYS_KEY_MEDIA_NEXT_TRACK:    return KEY_NEXTSONG;
+        case PRODIKEYS_KEY_MEDIA_PREV_TRACK:    return KEY_PREVIOUSSONG;
+        case PRODIKEYS_KEY_MEDIA_STOP:          return KEY_STOPCD;
+        case PRODIKEYS_KEY_MEDIA_PLAY_PAUSE:    return KEY_PLAYPAUSE;
+        case PRODIKEYS_KEY_LAUNCH_MAIL:         return KEY_MAIL;
+        case PRODIKEYS_KEY_LAUNCH_MEDIA_SELECT: return KEY_MEDIA;
+        default:                                return 0;
+    }
+}
+
+struct prodikeys_injector *prodikeys_injector_open(const char *name){
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0){
+        fprintf(stderr, "prodikeysd: couldn't open /dev/uinput (%s), media keys won't be forwarded\n", strerror(errno));
+        return NULL;
+    }
+
+    bool ok = ioctl(fd, UI_SET_EVBIT, EV_KEY) == 0 && ioctl(fd, UI_SET_EVBIT, EV_SYN) == 0;
+    for (int key = 0; key < 256 && ok; key++){
+        unsigned short code = prodikeys_uinput_code((uint8_t) key);
+        if (code != 0) ok = ioctl(fd, UI_SET_KEYBIT, code) == 0;
+    }
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_USB;
+    setup.id.vendor = PRODIKEYS_VID;
+    setup.id.product = PRODIKEYS_PID;
+    snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "%s", name);
+    if (ok && ioctl(fd, UI_DEV_SETUP, &setup) != 0){
+        //kernels before 4.5 take the device description as a write
+        struct uinput_user_dev dev;
+        memset(&dev, 0, sizeof(dev));
+        dev.id = setup.id;
+        memcpy(dev.name, setup.name, UINPUT_MAX_NAME_SIZE);
+        ok = write(fd, &dev, sizeof(dev)) == (ssize_t) sizeof(dev);
+    }
+    if (!ok || ioctl(fd, UI_DEV_CREATE) != 0){
+        fprintf(stderr, "prodikeysd: couldn't create the uinput keyboard (%s), media keys won't be forwarded\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct prodikeys_injector *injector = static_cast<prodikeys_injector *>(calloc(1, sizeof(struct prodikeys_injector)));
+    if (injector == NULL){
+        ioctl(fd, UI_DEV_DESTROY);
+        close(fd);
+        return NULL;
+    }
+    injector->fd = fd;
+    return injector;
+}
+
+bool prodikeys_injector_send(struct prodikeys_injector *injector, const uint8_t *keys, const bool *pressed, int count){
+    if (injector == NULL) return false;
+    if (count > PRODIKEYS_INJECT_KEYS) count = PRODIKEYS_INJECT_KEYS;
+
+    //the kernel timestamps the events, they are written zeroed
+    int num_events = 0;
+    memset(injector->events, 0, sizeof(injector->events));
+    for (int i = 0; i < count; i++){
+        unsigned short code = prodikeys_uinput_code(keys[i]);
+        if (code == 0) continue;
+        injector->events[num_events].type = EV_KEY;
+        injector->events[num_events].code = code;
+        injector->events[num_events++].value = pressed[i] ? 1 : 0;
+    }
+    if (num_events == 0) return true;
+    injector->events[num_events].type = EV_SYN;
+    injector->events[num_events++].code = SYN_REPORT;
+
+    ssize_t size = (ssize_t) (num_events * sizeof(struct input_event));
+    return write(injector->fd, injector->events, size) == size;
+}
+
+void prodikeys_injector_close(struct prodikeys_injector *injector){
+    if (injector == NULL) return;
+    ioctl(injector->fd, UI_DEV_DESTROY);
+    close(injector->fd);
+    free(injector);
+}
@@ -0,0 +1,39 @@
+/* Prodikeys MIDI Interface - key injection
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Media and system buttons are forwarded as key events of a virtual keyboard. One implementation is linked in
+ * per platform, so that calls are direct : prodikeys-inject-sendinput.cpp (windows SendInput) or
+ * prodikeys-inject-uinput.cpp (linux uinput device, e.g. for desktops where prodikeysd has detached hid-prodikeys).
+ * The key events of a report are injected as one batch, the system sees them at once.
+ */
+#pragma once
+#include <stdint.h>
+#include "prodikeys-os.h"
+
+#define PRODIKEYS_INJECT_KEYS 32            // key events injected at once at most
+
+//Opaque handle to a virtual keyboard
+struct prodikeys_injector;
+
+/**
+ * Create the virtual keyboard key events are injected through
+ * @param name keyboard name, where the system shows one
+ * @return the injector, or NULL if it couldn't be created (e.g. no access to /dev/uinput)
+ */
+struct prodikeys_injector *prodikeys_injector_open(const char *name);
+
+/**
+ * Inject key presses and releases, in order, as a single batch
+ * @param injector the injector
+ * @param keys prodikeys_key values (other windows virtual-key codes are skipped where they have no equivalent)
+ * @param pressed true for a key press, false for a key release
+ * @param count number of key events (up to PRODIKEYS_INJECT_KEYS)
+ * @return true iff the whole batch was injected
+ */
+bool prodikeys_injector_send(struct prodikeys_injector *injector, const uint8_t *keys, const bool *pressed, int count);
+
+/**
+ * Remove the virtual keyboard
+ * @param injector the injector
+ */
+void prodikeys_injector_close(struct prodikeys_injector *injector);
@@ -0,0 +1,469 @@
+/* Prodikeys MIDI Interface - function button keymap
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "prodikeys-executor.h"
+#include "prodikeys-keymap.h"
+#include "prodikeys-os.h"
+#include "prodikeys-stats.h"
+
+#define PRODIKEYS_KEYMAP_LINE 256
+#define PRODIKEYS_KEYMAP_TOKENS 8
+
+/* Button handlers, called on press */
+static void prodikeys_button_channel_up(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    if (pm->midi_channel<PCMIDI_CHANNEL_MAX) pm->midi_channel++;
+}
+
+static void prodikeys_button_channel_down(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    if (pm->midi_channel>PCMIDI_CHANNEL_MIN) pm->midi_channel--;
+}
+
+static void prodikeys_button_channel_set(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    pm->midi_channel = action->arg[0]; //TODO: remember previous channel to restore?
+}
+
+static void prodikeys_button_pitch_up(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    if (pm->midi_pitch<PCMIDI_PITCH_MAX-1000) {
+        pm->midi_pitch += 1000;
+        pcmidi_send_pitch(pm);
+    }
+}
+
+static void prodikeys_button_pitch_down(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    if (pm->midi_pitch>PCMIDI_PITCH_MIN+1000) {
+        pm->midi_pitch -= 1000;
+        pcmidi_send_pitch(pm);
+    }
+}
+
+static void prodikeys_button_pitch_reset(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    pm->midi_pitch = PCMIDI_PITCH_BASE;
+    pcmidi_send_pitch(pm);
+}
+
+static void prodikeys_button_octave_up(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    if (pm->midi_octave < PCMIDI_OCTAVE_MAX) pm->midi_octave++;
+}
+
+static void prodikeys_button_octave_down(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    if (pm->midi_octave > PCMIDI_OCTAVE_MIN) pm->midi_octave--;
+}
+
+static void prodikeys_button_next_instrument(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    pcmidi_next_instrument(pm);
+}
+
+static void prodikeys_button_prev_instrument(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    pcmidi_prev_instrument(pm);
+}
+
+static void prodikeys_button_program(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    pm->midi_inst = action->arg[0];
+    pcmidi_send_program(pm);
+}
+
+static void prodikeys_button_control(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    pcmidi_send_control(pm, action->arg[0], action->arg[1]);
+}
+
+static void prodikeys_button_sustain(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    prodikeys_sustain_switch(pm);
+}
+
+static void prodikeys_button_fn(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    prodikeys_fn_switch(pm);
+}
+
+static void prodikeys_button_midi(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    uint64_t start = prodikeys_now_ns();
+    pm->midi_mode? prodikeys_disable_midi(pm): prodikeys_enable_midi(pm);
+    prodikeys_stats_stage(PRODIKEYS_STAGE_MIDI_TOGGLE, prodikeys_now_ns() - start);
+}
+
+static void prodikeys_button_launch(struct pcmidi_snd *pm, const struct prodikeys_action *action){
+    prodikeys_executor_launch((enum prodikeys_launch_target) action->arg[0]);
+}
+
+//Shorthands for the built-in keymap
+#define PK_NONE         {0, {0, 0}, NULL}
+#define PK_KEY(k)       {PRODIKEYS_KEY_##k, {0, 0}, NULL}
+#define PK_PRESS(f)     {0, {0, 0}, prodikeys_button_##f}
+#define PK_CHANNEL(c)   {0, {c, 0}, prodikeys_button_channel_set}
+#define PK_LAUNCH(t)    {0, {PRODIKEYS_LAUNCH_##t, 0}, prodikeys_button_launch}
+#define PK_SAME(a)      {{a, a, a, a}}                  // same action in every state
+#define PK_MIDI_FN(a, f) {{a, a, a, f}}                 // action, replaced by a MIDI function in midi+fn state
+
+//cf. appendix of prodikeys-core.h, bits left out do nothing
+static const struct prodikeys_keymap prodikeys_keymap_builtin = {{
+    { //report id 1 buttons (media keys), by bit
+        /* 0x000001 */ PK_MIDI_FN(PK_KEY(MEDIA_PREV_TRACK), PK_PRESS(channel_up)),   //next track
+        /* 0x000002 */ PK_MIDI_FN(PK_KEY(MEDIA_PREV_TRACK), PK_PRESS(channel_down)), //previous track
+        /* 0x000004 */ PK_MIDI_FN(PK_KEY(MEDIA_STOP), PK_CHANNEL(0)),
+        /* 0x000008 */ PK_SAME(PK_KEY(MEDIA_PLAY_PAUSE)),
+        /* 0x000010 */ PK_MIDI_FN(PK_KEY(VOLUME_MUTE), PK_PRESS(pitch_reset)),
+        /* 0x000020 */ PK_SAME(PK_NONE),
+        /* 0x000040 */ PK_SAME(PK_NONE),
+        /* 0x000080 */ PK_MIDI_FN(PK_KEY(VOLUME_UP), PK_PRESS(pitch_up)),
+        /* 0x000100 */ PK_MIDI_FN(PK_KEY(VOLUME_DOWN), PK_PRESS(pitch_down)),
+        /* 0x000200 */ PK_SAME(PK_NONE),
+        /* 0x000400 */ PK_SAME(PK_NONE),
+        /* 0x000800 */ PK_SAME(PK_NONE),
+        /* 0x001000 */ PK_SAME(PK_NONE),
+        /* 0x002000 */ PK_MIDI_FN(PK_KEY(LAUNCH_MEDIA_SELECT), PK_CHANNEL(9)), //eject CD, TODO: implement CD drive eject?
+        /* 0x004000 */ {{PK_KEY(LAUNCH_MAIL), PK_KEY(LAUNCH_MAIL), PK_PRESS(octave_down), PK_PRESS(prev_instrument)}},
+        /* 0x008000 */ PK_SAME(PK_LAUNCH(CALCULATOR)),
+        /* 0x010000 */ PK_SAME(PK_NONE),
+        /* 0x020000 */ PK_SAME(PK_NONE),
+        /* 0x040000 */ {{PK_KEY(BROWSER_HOME), PK_KEY(BROWSER_HOME), PK_PRESS(sustain), PK_PRESS(sustain)}}, //sostenuto in midi+fn
+    },
+    { //report id 2 buttons (system keys), by bit
+        /* 0x01 */ PK_SAME(PK_NONE),
+        /* 0x02 */ PK_SAME(PK_KEY(SLEEP)),
+    },
+    { //report id 4 buttons (extra keys), by bit
+        /* 0x000001 */ PK_SAME(PK_NONE),                //TODO: implement session lock?
+        /* 0x000002 */ PK_SAME(PK_PRESS(midi)),         //piano key
+        /* 0x000004 */ PK_SAME(PK_LAUNCH(DOCUMENTS)),
+        /* 0x000008 */ PK_SAME(PK_NONE),                //TODO: implement address book
+        /* 0x000010 */ {{PK_NONE, PK_NONE, PK_PRESS(octave_up), PK_PRESS(next_instrument)}}, //instant messaging
+        /* 0x000020 */ PK_SAME(PK_LAUNCH(MUSIC)),
+        /* 0x000040 */ PK_SAME(PK_NONE),                //TODO: implement calendar
+        /* 0x000080 */ PK_SAME(PK_LAUNCH(PICTURES)),
+        /* 0x000100 */ PK_SAME(PK_NONE),
+        /* 0x000200 */ PK_SAME(PK_NONE),
+        /* 0x000400 */ PK_SAME(PK_NONE),
+        /* 0x000800 */ PK_SAME(PK_NONE),
+        /* 0x001000 */ PK_SAME(PK_NONE),
+        /* 0x002000 */ PK_SAME(PK_NONE),
+        /* 0x004000 */ PK_SAME(PK_NONE),
+        /* 0x008000 */ PK_SAME(PK_NONE),
+        /* 0x010000 */ PK_SAME(PK_NONE),
+        /* 0x020000 */ PK_SAME(PK_NONE),
+        /* 0x040000 */ PK_SAME(PK_NONE),
+        /* 0x080000 */ PK_SAME(PK_NONE),
+        /* 0x100000 */ PK_SAME(PK_PRESS(fn)),           //fn lock
+    },
+}};
+
+#undef PK_NONE
+#undef PK_KEY
+#undef PK_PRESS
+#undef PK_CHANNEL
+#undef PK_LAUNCH
+#undef PK_SAME
+#undef PK_MIDI_FN
+
+std::atomic<const struct prodikeys_keymap *> prodikeys_keymap_current(&prodikeys_keymap_builtin);
+std::atomic<unsigned> prodikeys_keymap_epoch(0);
+std::atomic<int> prodikeys_keymap_readers[2];
+
+//Names of a keymap file
+static const struct {
+    const char      *name;
+    uint8_t         key;
+} prodikeys_keymap_keys[] = {
+    {"sleep",           PRODIKEYS_KEY_SLEEP},
+    {"home",            PRODIKEYS_KEY_BROWSER_HOME},
+    {"mute",            PRODIKEYS_KEY_VOLUME_MUTE},
+    {"volume-down",     PRODIKEYS_KEY_VOLUME_DOWN},
+    {"volume-up",       PRODIKEYS_KEY_VOLUME_UP},
+    {"next-track",      PRODIKEYS_KEY_MEDIA_NEXT_TRACK},
+    {"prev-track",      PRODIKEYS_KEY_MEDIA_PREV_TRACK},
+    {"stop",            PRODIKEYS_KEY_MEDIA_STOP},
+    {"play-pause",      PRODIKEYS_KEY_MEDIA_PLAY_PAUSE},
+    {"mail",            PRODIKEYS_KEY_LAUNCH_MAIL},
+    {"media-select",    PRODIKEYS_KEY_LAUNCH_MEDIA_SELECT},
+};
+
+static const struct {
+    const char          *name;
+    prodikeys_action_fn press;
+} prodikeys_keymap_functions[] = {
+    {"octave-up",       prodikeys_button_octave_up},
+    {"octave-down",     prodikeys_button_octave_down},
+    {"pitch-up",        prodikeys_button_pitch_up},
+    {"pitch-down",      prodikeys_button_pitch_down},
+    {"pitch-reset",     prodikeys_button_pitch_reset},
+    {"next-instrument", prodikeys_button_next_instrument},
+    {"prev-instrument", prodikeys_button_prev_instrument},
+    {"sustain",         prodikeys_button_sustain},
+    {"fn",              prodikeys_button_fn},
+    {"midi",            prodikeys_button_midi},
+};
+
+static const char *prodikeys_keymap_launches[] = {"calculator", "documents", "music", "pictures"};
+static const char *prodikeys_keymap_states[] = {"neutral", "fn", "midi", "midi+fn"};
+
+#define PRODIKEYS_KEYMAP_NAMES(table) ((int) (sizeof(table) / sizeof(table[0])))
+
+/* Split a line on blanks in place, up to the first comment */
+static int prodikeys_keymap_tokens(char *line, char **tokens, int max){
+    int count = 0;
+    char *hash = strchr(line, '#');
+    if (hash != NULL) *hash = '\0';
+    while (*line != '\0'){
+        while (*line == ' ' || *line == '\t' || *line == '\r' || *line == '\n') *line++ = '\0';
+        if (*line == '\0') break;
+        if (count == max) return max + 1; //trailing garbage
+        tokens[count++] = line;
+        while (*line != '\0' && *line != ' ' && *line != '\t' && *line != '\r' && *line != '\n') line++;
+    }
+    return count;
+}
+
+/* Parse a number between min and max, decimal or 0x prefixed */
+static bool prodikeys_keymap_number(const char *token, long min, long max, long *value){
+    char *end;
+    *value = strtol(token, &end, 0);
+    return end != token && *end == '\0' && *value >= min && *value <= max;
+}
+
+/* Parse the states field into a mask of (1 << prodikeys_state) */
+static bool prodikeys_keymap_parse_states(char *token, unsigned *mask){
+    *mask = 0;
+    if (strcmp(token, "all") == 0){
+        *mask = (1u << PRODIKEYS_STATES) - 1;
+        return true;
+    }
+    char *name = token;
+    while (name != NULL){
+        char *comma = strchr(name, ',');
+        if (comma != NULL) *comma = '\0';
+        int state = 0;
+        while (state < PRODIKEYS_STATES && strcmp(name, prodikeys_keymap_states[state]) != 0) state++;
+        if (state == PRODIKEYS_STATES) return false;
+        *mask |= 1u << state;
+        name = comma != NULL ? comma + 1 : NULL;
+    }
+    return true;
+}
+
+/* Parse the action and its arguments, NULL on success or what is wrong */
+static const char *prodikeys_keymap_parse_action(char **tokens, int count, struct prodikeys_action *action){
+    long value, value2;
+    memset(action, 0, sizeof(*action));
+    const char *name = tokens[0];
+
+    if (strcmp(name, "none") == 0){
+        if (count != 1) return "none takes no argument";
+    } else if (strcmp(name, "key") == 0){
+        if (count != 2) return "key takes a key name or code";
+        for (int i = 0; i < PRODIKEYS_KEYMAP_NAMES(prodikeys_keymap_keys) && action->key == 0; i++)
+            if (strcmp(tokens[1], prodikeys_keymap_keys[i].name) == 0) action->key = prodikeys_keymap_keys[i].key;
+        if (action->key == 0){
+            if (!prodikeys_keymap_number(tokens[1], 1, 0xFE, &value)) return "unknown key";
+            action->key = (uint8_t) value;
+        }
+    } else if (strcmp(name, "cc") == 0){
+        if (count != 3 || !prodikeys_keymap_number(tokens[1], 0, 127, &value)
+            || !prodikeys_keymap_number(tokens[2], 0, 127, &value2))
+            return "cc takes a control number and a value (0 to 127)";
+        action->arg[0] = (uint8_t) value;
+        action->arg[1] = (uint8_t) value2;
+        action->press = prodikeys_button_control;
+    } else if (strcmp(name, "program") == 0){
+        if (count != 2 || !prodikeys_keymap_number(tokens[1], PCMIDI_INST_MIN, PCMIDI_INST_MAX, &value))
+            return "program takes an instrument number (0 to 127)";
+        action->arg[0] = (uint8_t) value;
+        action->press = prodikeys_button_program;
+    } else if (strcmp(name, "channel") == 0){
+        if (count != 2) return "channel takes 1 to 16, up or down";
+        if (strcmp(tokens[1], "up") == 0) action->press = prodikeys_button_channel_up;
+        else if (strcmp(tokens[1], "down") == 0) action->press = prodikeys_button_channel_down;
+        else if (prodikeys_keymap_number(tokens[1], PCMIDI_CHANNEL_MIN + 1, PCMIDI_CHANNEL_MAX + 1, &value)){
+            action->arg[0] = (uint8_t) (value - 1);
+            action->press = prodikeys_button_channel_set;
+        } else return "channel takes 1 to 16, up or down";
+    } else if (strcmp(name, "launch") == 0){
+        if (count != 2) return "launch takes calculator, documents, music or pictures";
+        for (int i = 0; i < PRODIKEYS_KEYMAP_NAMES(prodikeys_keymap_launches) && action->press == NULL; i++)
+            if (strcmp(tokens[1], prodikeys_keymap_launches[i]) == 0){
+                action->arg[0] = (uint8_t) i;
+                action->press = prodikeys_button_launch;
+            }
+        if (action->press == NULL) return "launch takes calculator, documents, music or pictures";
+    } else {
+        for (int i = 0; i < PRODIKEYS_KEYMAP_NAMES(prodikeys_keymap_functions) && action->press == NULL; i++)
+            if (strcmp(name, prodikeys_keymap_functions[i].name) == 0) action->press = prodikeys_keymap_functions[i].press;
+        if (action->press == NULL) return "unknown action";
+        if (count != 1) return "this action takes no argument";
+    }
+    return NULL;
+}
+
+void prodikeys_keymap_default(struct prodikeys_keymap *map){
+    *map = prodikeys_keymap_builtin;
+}
+
+bool prodikeys_keymap_load(const char *path, struct prodikeys_keymap *map, char *error, size_t size){
+    FILE *file = fopen(path, "r");
+    if (file == NULL){
+        snprintf(error, size, "%s: cannot open", path);
+        return false;
+    }
+    prodikeys_keymap_default(map);
+
+    char line[PRODIKEYS_KEYMAP_LINE];
+    int number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != NULL){
+        number++;
+        char *tokens[PRODIKEYS_KEYMAP_TOKENS];
+        int count = prodikeys_keymap_tokens(line, tokens, PRODIKEYS_KEYMAP_TOKENS);
+        if (count == 0) continue;
+
+        const char *problem = NULL;
+        long report, bit;
+        unsigned states;
+        struct prodikeys_action action;
+        if (count < 4 || count > PRODIKEYS_KEYMAP_TOKENS)
+            problem = "expected <report> <bit> <states> <action> [arguments]";
+        else if (!prodikeys_keymap_number(tokens[0], 1, 4, &report) || prodikeys_keymap_report((uint8_t) report) < 0)
+            problem = "report must be 1, 2 or 4";
+        else if (!prodikeys_keymap_number(tokens[1], 1, report == 2 ? 0xFF : 0x7FFFFFFF, &bit) || (bit & (bit - 1)) != 0)
+            problem = "bit must be a single bit of the report";
+        else if (!prodikeys_keymap_parse_states(tokens[2], &states))
+            problem = "states must be neutral, fn, midi, midi+fn (comma separated) or all";
+        else
+            problem = prodikeys_keymap_parse_action(tokens + 3, count - 3, &action);
+
+        if (problem != NULL){
+            snprintf(error, size, "%s:%d: %s", path, number, problem);
+            ok = false;
+            break;
+        }
+        struct prodikeys_button *button = &map->buttons[prodikeys_keymap_report((uint8_t) report)][prodikeys_ctz((uint32_t) bit)];
+        for (int state = 0; state < PRODIKEYS_STATES; state++)
+            if (states & (1u << state)) button->state[state] = action;
+    }
+    if (ok && ferror(file)){
+        snprintf(error, size, "%s: read error", path);
+        ok = false;
+    }
+    fclose(file);
+    return ok;
+}
+
+static struct {
+    std::mutex                                  mutex;
+    std::condition_variable                     wake;
+    std::thread                                 thread;
+    bool                                        running;
+    std::string                                 path;
+    struct prodikeys_file_watch                 *file;      // change notifications of the file, NULL to check it every second
+    std::mutex                                  install;    // one keymap replaced at a time
+} prodikeys_keymap_watcher;
+
+/* Replace the active keymap, then free the previous one once no reading thread holds it.
+ * Readers which could have taken it counted themselves on the parity of the epoch before it moves on, those coming
+ * after count on the other one and get the new keymap : only the former are waited for, so the wait always ends */
+static void prodikeys_keymap_replace(const struct prodikeys_keymap *map){
+    std::lock_guard<std::mutex> lock(prodikeys_keymap_watcher.install);
+    const struct prodikeys_keymap *previous = prodikeys_keymap_current.exchange(map);
+    unsigned parity = prodikeys_keymap_epoch.fetch_add(1) & 1;
+    while (prodikeys_keymap_readers[parity].load(std::memory_order_acquire) != 0)
+        std::this_thread::yield();
+    if (previous != &prodikeys_keymap_builtin) delete previous;
+}
+
+void prodikeys_keymap_install(struct prodikeys_keymap *map){
+    prodikeys_keymap_replace(map);
+}
+
+/* Load and install the keymap file, false (and the active keymap kept) on error */
+static bool prodikeys_keymap_reload(const char *path){
+    struct prodikeys_keymap *map = new struct prodikeys_keymap;
+    char error[PRODIKEYS_KEYMAP_LINE];
+    if (!prodikeys_keymap_load(path, map, error, sizeof(error))){
+        fprintf(stderr, "keymap not loaded, %s\n", error);
+        delete map;
+        return false;
+    }
+    prodikeys_keymap_install(map);
+    return true;
+}
+
+/* Whether a file changed between two stat() calls, to the nanosecond on linux (windows only keeps seconds there) */
+static bool prodikeys_keymap_changed(const struct stat *st, const struct stat *last){
+    if (st->st_ino != last->st_ino || st->st_size != last->st_size || st->st_mtime != last->st_mtime) return true;
+#ifdef _WIN32
+    return false;
+#else
+    return st->st_mtim.tv_nsec != last->st_mtim.tv_nsec;
+#endif
+}
+
+static void prodikeys_keymap_watch_run(){
+    struct stat last;
+    bool known = stat(prodikeys_keymap_watcher.path.c_str(), &last) == 0;
+    std::unique_lock<std::mutex> lock(prodikeys_keymap_watcher.mutex);
+    while (prodikeys_keymap_watcher.running){
+        struct prodikeys_file_watch *file = prodikeys_keymap_watcher.file;
+        if (file != NULL){
+            //woken as soon as the file is written or replaced
+            lock.unlock();
+            bool changed = prodikeys_file_watch_wait(file);
+            lock.lock();
+            if (!prodikeys_keymap_watcher.running) break;
+            if (!changed){
+                //no more notifications (its directory was removed), checked every second from now on
+                prodikeys_file_watch_close(file);
+                prodikeys_keymap_watcher.file = NULL;
+                continue;
+            }
+        } else {
+            prodikeys_keymap_watcher.wake.wait_for(lock, std::chrono::seconds(1));
+            if (!prodikeys_keymap_watcher.running) break;
+        }
+        struct stat st;
+        if (stat(prodikeys_keymap_watcher.path.c_str(), &st) != 0) continue; //being replaced, or gone : keep the active keymap
+        if (file == NULL && known && !prodikeys_keymap_changed(&st, &last)) continue;
+        last = st;
+        known = true;
+        lock.unlock();
+        if (prodikeys_keymap_reload(prodikeys_keymap_watcher.path.c_str()))
+            fprintf(stderr, "keymap %s reloaded\n", prodikeys_keymap_watcher.path.c_str());
+        lock.lock();
+    }
+}
+
+bool prodikeys_keymap_watch(const char *path){
+    prodikeys_keymap_unwatch();
+    bool loaded = prodikeys_keymap_reload(path);
+    prodikeys_keymap_watcher.path = path;
+    prodikeys_keymap_watcher.file = prodikeys_file_watch_open(path);
+    prodikeys_keymap_watcher.running = true;
+    try {
+        prodikeys_keymap_watcher.thread = std::thread(prodikeys_keymap_watch_run);
+    } catch (const std::system_error &) {
+        prodikeys_keymap_watcher.running = false; //the keymap just loaded stays, without reloads
+    }
+    return loaded;
+}
+
+void prodikeys_keymap_unwatch(){
+    if (prodikeys_keymap_watcher.thread.joinable()){
+        {
+            std::lock_guard<std::mutex> lock(prodikeys_keymap_watcher.mutex);
+            prodikeys_keymap_watcher.running = false;
+            if (prodikeys_keymap_watcher.file != NULL) prodikeys_file_watch_cancel(prodikeys_keymap_watcher.file);
+        }
+        prodikeys_keymap_watcher.wake.notify_one();
+        prodikeys_keymap_watcher.thread.join();
+    }
+    prodikeys_file_watch_close(prodikeys_keymap_watcher.file);
+    prodikeys_keymap_watcher.file = NULL;
+    prodikeys_keymap_replace(&prodikeys_keymap_builtin);
+}
@@ -0,0 +1,130 @@
+/* Prodikeys MIDI Interface - function button keymap
+ * Copyright 2020, CrazyRedMachine
+ *
+ * What every button of reports 1, 2 and 4 does in each prodikeys_state, as a flat table indexed by report and bit.
+ * The built-in keymap is the one described in the appendix of prodikeys-core.h. A keymap file can rebind any
+ * button; it is parsed into a new table which replaces the active one with a single atomic store, so reading
+ * threads never wait for a reload (they pick the new table up on their next report). The table replaced is freed
+ * by the reload once no reading thread dispatches a report with it any more : readers are counted per epoch parity
+ * while they hold a table, and a reload moves to the next epoch then waits for the readers of the previous one.
+ *
+ * Keymap file : one binding per line, '#' starts a comment
+ *   <report> <bit> <states> <action> [arguments]
+ *   report      1, 2 or 4
+ *   bit         the button bit, as the little endian report word (e.g. 0x040000 for report 1 "00 00 04")
+ *   states      comma separated list of neutral, fn, midi, midi+fn, or all
+ *   action      none
+ *               key NAME|0xNN           forward a key (sleep, home, mute, volume-down, volume-up, next-track,
+ *                                       prev-track, stop, play-pause, mail, media-select, or a windows virtual-key code)
+ *               cc NUMBER VALUE         send a control change on the current channel
+ *               program NUMBER          select an instrument (0 to 127)
+ *               channel 1-16|up|down    select a MIDI channel (10 for drums)
+ *               launch calculator|documents|music|pictures
+ *               octave-up, octave-down, pitch-up, pitch-down, pitch-reset, next-instrument, prev-instrument,
+ *               sustain, fn, midi       the built-in functions
+ * Buttons a file doesn't mention keep their built-in actions. cc, program and the pitch and instrument functions only
+ * send while piano keys are enabled.
+ */
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "prodikeys-core.h"
+
+#define PRODIKEYS_KEYMAP_REPORTS 3      // reports 1, 2 and 4
+#define PRODIKEYS_KEYMAP_BITS 32
+
+struct prodikeys_action;
+typedef void (*prodikeys_action_fn)(struct pcmidi_snd *pm, const struct prodikeys_action *action);
+
+//What a button does when pressed in a given state
+struct prodikeys_action {
+    uint8_t             key;                // prodikeys_key forwarded on press and release, 0 for none
+    uint8_t             arg[2];             // arguments of press (control number and value, program, channel, launch target)
+    prodikeys_action_fn press;              // called on press, NULL for none
+};
+
+//A report 1/2/4 button, its action in each prodikeys_state
+struct prodikeys_button {
+    struct prodikeys_action state[PRODIKEYS_STATES];
+};
+
+struct prodikeys_keymap {
+    struct prodikeys_button buttons[PRODIKEYS_KEYMAP_REPORTS][PRODIKEYS_KEYMAP_BITS];
+};
+
+extern std::atomic<const struct prodikeys_keymap *> prodikeys_keymap_current;
+extern std::atomic<unsigned> prodikeys_keymap_epoch;         // bumped by every reload
+extern std::atomic<int> prodikeys_keymap_readers[2];         // reading threads holding a keymap, by epoch parity
+
+/**
+ * Keymap the reading threads dispatch buttons with, held until prodikeys_keymap_release so that a reload doesn't
+ * free it meanwhile. Never waits (it only tries again if a reload moved to the next epoch right then).
+ * @param hold receives what prodikeys_keymap_release needs
+ * @return the active keymap (the built-in one until a file is installed)
+ */
+static inline const struct prodikeys_keymap *prodikeys_keymap_hold(unsigned *hold){
+    for (;;){
+        unsigned epoch = prodikeys_keymap_epoch.load();
+        prodikeys_keymap_readers[epoch & 1].fetch_add(1);
+        if (prodikeys_keymap_epoch.load() == epoch){
+            *hold = epoch & 1;
+            return prodikeys_keymap_current.load();
+        }
+        prodikeys_keymap_readers[epoch & 1].fetch_sub(1);
+    }
+}
+
+/**
+ * Let go of a keymap taken with prodikeys_keymap_hold, it must not be used any more
+ * @param hold as set by prodikeys_keymap_hold
+ */
+static inline void prodikeys_keymap_release(unsigned hold){
+    prodikeys_keymap_readers[hold].fetch_sub(1, std::memory_order_release);
+}
+
+/**
+ * Table index of a report id
+ * @param report_id 1, 2 or 4
+ * @return index in prodikeys_keymap buttons, -1 for other reports
+ */
+static inline int prodikeys_keymap_report(uint8_t report_id){
+    return report_id == 1 ? 0 : report_id == 2 ? 1 : report_id == 4 ? 2 : -1;
+}
+
+/**
+ * Copy the built-in keymap
+ * @param map receives the built-in keymap
+ */
+void prodikeys_keymap_default(struct prodikeys_keymap *map);
+
+/**
+ * Parse a keymap file over the built-in keymap
+ * @param path keymap file
+ * @param map receives the keymap
+ * @param error receives a message naming the offending line on failure
+ * @param size error buffer size
+ * @return true iff the whole file could be read and parsed
+ */
+bool prodikeys_keymap_load(const char *path, struct prodikeys_keymap *map, char *error, size_t size);
+
+/**
+ * Make a keymap the active one. The previous one is freed once the reading threads which may still be dispatching
+ * a report with it are done, which this waits for (a report, never an idle keyboard : they hold it for a dispatch only).
+ * @param map keymap allocated with new
+ */
+void prodikeys_keymap_install(struct prodikeys_keymap *map);
+
+/**
+ * Load a keymap file, install it, and reload it as soon as the file is written or replaced
+ * (change notifications of its directory, or checked every second where there are none).
+ * Load errors are written to stderr, the active keymap is then kept.
+ * @param path keymap file
+ * @return true iff the file could be loaded now
+ */
+bool prodikeys_keymap_watch(const char *path);
+
+/**
+ * Stop watching the keymap file, go back to the built-in keymap and free the loaded one
+ */
+void prodikeys_keymap_unwatch();
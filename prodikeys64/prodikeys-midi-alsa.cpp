@@ -0,0 +1,63 @@
+/* Prodikeys MIDI Interface - virtual MIDI port, ALSA sequencer implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdlib.h>
+#include <alsa/asoundlib.h>
+#include "prodikeys-midi.h"
+
+struct pcmidi_port {
+    snd_seq_t           *seq;               // sequencer client, one per port
+    int                 port;               // readable port other clients subscribe to
+    snd_midi_event_t    *encoder;           // raw MIDI bytes to sequencer events
+};
+
+struct pcmidi_port *pcmidi_port_open(const char *name){
+    snd_seq_t *seq;
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0) < 0)
+        return NULL;
+    snd_seq_set_client_name(seq, name);
+
+    int port_id = snd_seq_create_simple_port(seq, name,
+                                             SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                             SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_HARDWARE);
+    snd_midi_event_t *encoder;
+    if (port_id < 0 || snd_midi_event_new(256, &encoder) < 0){
+        snd_seq_close(seq);
+        return NULL;
+    }
+
+    struct pcmidi_port *port = static_cast<pcmidi_port *>(malloc(sizeof(struct pcmidi_port)));
+    port->seq = seq;
+    port->port = port_id;
+    port->encoder = encoder;
+    return port;
+}
+
+bool pcmidi_port_send(struct pcmidi_port *port, const uint8_t *data, int length){
+    if (port == NULL) return false;
+
+    bool ret = true;
+    for (int i = 0; i < length; i++){
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        //the encoder keeps running status, an event is complete once all its data bytes went in
+        if (snd_midi_event_encode_byte(port->encoder, data[i], &ev) != 1)
+            continue;
+        snd_seq_ev_set_source(&ev, port->port);
+        snd_seq_ev_set_subs(&ev);
+        snd_seq_ev_set_direct(&ev);
+        if (snd_seq_event_output_buffer(port->seq, &ev) < 0)
+            ret = false;
+    }
+    //every event of the buffer is written to the sequencer at once
+    if (snd_seq_drain_output(port->seq) < 0)
+        ret = false;
+    return ret;
+}
+
+void pcmidi_port_close(struct pcmidi_port *port){
+    snd_midi_event_free(port->encoder);
+    snd_seq_close(port->seq);
+    free(port);
+}
@@ -0,0 +1,46 @@
+/* Prodikeys MIDI Interface - virtual MIDI port, raw file implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Appends the raw MIDI byte stream of a port to a file : PRODIKEYS_MIDI_FILE if set, the port name with
+ * ".midi" appended otherwise. Keeps the decoder measurable without any MIDI driver, and the output diffable.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prodikeys-midi.h"
+
+#define PCMIDI_FILE_BUFFER 65536
+
+struct pcmidi_port {
+    FILE    *file;
+    char    buffer[PCMIDI_FILE_BUFFER];     // stdio buffer, the note path doesn't hit the disk on every send
+};
+
+struct pcmidi_port *pcmidi_port_open(const char *name){
+    char path[256];
+    const char *env = getenv("PRODIKEYS_MIDI_FILE");
+    if (env != NULL)
+        snprintf(path, sizeof(path), "%s", env);
+    else
+        snprintf(path, sizeof(path), "%s.midi", name);
+
+    struct pcmidi_port *port = static_cast<pcmidi_port *>(malloc(sizeof(struct pcmidi_port)));
+    if (port == NULL) return NULL;
+    port->file = fopen(path, "ab");
+    if (port->file == NULL){
+        free(port);
+        return NULL;
+    }
+    setvbuf(port->file, port->buffer, _IOFBF, PCMIDI_FILE_BUFFER);
+    return port;
+}
+
+bool pcmidi_port_send(struct pcmidi_port *port, const uint8_t *data, int length){
+    if (port == NULL) return false;
+    return fwrite(data, 1, length, port->file) == (size_t) length;
+}
+
+void pcmidi_port_close(struct pcmidi_port *port){
+    fclose(port->file);
+    free(port);
+}
@@ -0,0 +1,91 @@
+/* Prodikeys MIDI Interface - virtual MIDI port, JACK implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ * One JACK client with a MIDI output port per virtual port. Sends are queued in a lock-free ringbuffer
+ * and written out by the JACK process callback at the start of the next period (single producer : keyboards
+ * sharing a port never send concurrently, libusb runs their callbacks one at a time).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <jack/ringbuffer.h>
+#include "prodikeys-midi.h"
+
+#define PCMIDI_JACK_RINGBUFFER 4096
+#define PCMIDI_JACK_MAX_EVENT 256           // longest buffer handed to pcmidi_port_send
+
+struct pcmidi_port {
+    jack_client_t       *client;
+    jack_port_t         *port;              // MIDI output port other clients connect to
+    jack_ringbuffer_t   *queue;             // length byte followed by raw MIDI data, one entry per send
+};
+
+/* Split a queued buffer in MIDI channel messages, JACK events carry a single message each */
+static void pcmidi_jack_write(void *midi, const uint8_t *data, int length){
+    uint8_t status = 0;
+    int i = 0;
+    while (i < length){
+        uint8_t message[3];
+        int size = 0;
+        if (data[i] & 0x80) status = data[i++];
+        if (status == 0) return; //data without any status byte
+        message[size++] = status;
+        int data_bytes = (status & 0xE0) == 0xC0 ? 1 : 2; //program change and channel pressure have one data byte
+        for (int j = 0; j < data_bytes && i < length; j++)
+            message[size++] = data[i++];
+        jack_midi_event_write(midi, 0, message, size);
+    }
+}
+
+static int pcmidi_jack_process(jack_nframes_t nframes, void *arg){
+    struct pcmidi_port *port = static_cast<pcmidi_port *>(arg);
+    void *midi = jack_port_get_buffer(port->port, nframes);
+    jack_midi_clear_buffer(midi);
+
+    uint8_t data[PCMIDI_JACK_MAX_EVENT];
+    uint8_t length;
+    while (jack_ringbuffer_peek(port->queue, (char *) &length, 1) == 1
+           && jack_ringbuffer_read_space(port->queue) >= (size_t) length + 1){
+        jack_ringbuffer_read_advance(port->queue, 1);
+        jack_ringbuffer_read(port->queue, (char *) data, length);
+        pcmidi_jack_write(midi, data, length);
+    }
+    return 0;
+}
+
+struct pcmidi_port *pcmidi_port_open(const char *name){
+    jack_client_t *client = jack_client_open(name, JackNoStartServer, NULL);
+    if (client == NULL) return NULL;
+
+    struct pcmidi_port *port = static_cast<pcmidi_port *>(malloc(sizeof(struct pcmidi_port)));
+    port->client = client;
+    port->port = jack_port_register(client, "midi_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput | JackPortIsPhysical | JackPortIsTerminal, 0);
+    port->queue = jack_ringbuffer_create(PCMIDI_JACK_RINGBUFFER);
+    if (port->port == NULL || port->queue == NULL
+        || jack_set_process_callback(client, pcmidi_jack_process, port) != 0
+        || jack_activate(client) != 0){
+        jack_client_close(client);
+        if (port->queue != NULL) jack_ringbuffer_free(port->queue);
+        free(port);
+        return NULL;
+    }
+    jack_ringbuffer_mlock(port->queue);
+    return port;
+}
+
+bool pcmidi_port_send(struct pcmidi_port *port, const uint8_t *data, int length){
+    if (port == NULL || length <= 0 || length > PCMIDI_JACK_MAX_EVENT - 1) return false;
+    if (jack_ringbuffer_write_space(port->queue) < (size_t) length + 1)
+        return false; //JACK isn't keeping up, drop rather than wait
+    uint8_t size = (uint8_t) length;
+    jack_ringbuffer_write(port->queue, (const char *) &size, 1);
+    jack_ringbuffer_write(port->queue, (const char *) data, length);
+    return true;
+}
+
+void pcmidi_port_close(struct pcmidi_port *port){
+    jack_client_close(port->client);
+    jack_ringbuffer_free(port->queue);
+    free(port);
+}
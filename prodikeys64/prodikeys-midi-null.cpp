@@ -0,0 +1,25 @@
+/* Prodikeys MIDI Interface - virtual MIDI port, null implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Accepts and drops everything, so that decoding throughput can be measured on its own.
+ */
+#include <stdlib.h>
+#include "prodikeys-midi.h"
+
+struct pcmidi_port {
+    unsigned long       bytes;              // bytes accepted, so the sends aren't optimized away
+};
+
+struct pcmidi_port *pcmidi_port_open(const char *name){
+    return static_cast<pcmidi_port *>(calloc(1, sizeof(struct pcmidi_port)));
+}
+
+bool pcmidi_port_send(struct pcmidi_port *port, const uint8_t *data, int length){
+    if (port == NULL) return false;
+    port->bytes += length;
+    return true;
+}
+
+void pcmidi_port_close(struct pcmidi_port *port){
+    free(port);
+}
@@ -0,0 +1,42 @@
+/* Prodikeys MIDI Interface - virtual MIDI port, teVirtualMIDI implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Based on Virtual MIDI SDK
+ * Copyright 2009-2019, Tobias Erichsen
+ *
+ */
+#include <stdlib.h>
+#include "teVirtualMIDI.h"
+#include "prodikeys-midi.h"
+
+#define MAX_SYSEX_BUFFER	65535
+
+struct pcmidi_port {
+    LPVM_MIDI_PORT port;                    // teVirtualMIDI handle
+};
+
+struct pcmidi_port *pcmidi_port_open(const char *name){
+    wchar_t wname[64];
+    if (MultiByteToWideChar(CP_UTF8, 0, name, -1, wname, 64) == 0)
+        return NULL;
+
+    //PARSE_TX : the driver splits what we send into MIDI commands, so a whole report goes in one virtualMIDISendData call
+    LPVM_MIDI_PORT vm_port = virtualMIDICreatePortEx2( wname, NULL, 0, MAX_SYSEX_BUFFER, TE_VM_FLAGS_PARSE_RX | TE_VM_FLAGS_PARSE_TX );
+    if ( !vm_port ) {
+        //printf( "could not create port: %d\n", GetLastError() );
+        return NULL;
+    }
+    struct pcmidi_port *port = static_cast<pcmidi_port *>(malloc(sizeof(struct pcmidi_port)));
+    port->port = vm_port;
+    return port;
+}
+
+bool pcmidi_port_send(struct pcmidi_port *port, const uint8_t *data, int length){
+    if (port == NULL) return false;
+    return virtualMIDISendData(port->port, const_cast<LPBYTE>(data), length) != FALSE;
+}
+
+void pcmidi_port_close(struct pcmidi_port *port){
+    virtualMIDIClosePort( port->port );
+    free(port);
+}
@@ -0,0 +1,35 @@
+/* Prodikeys MIDI Interface - virtual MIDI port
+ * Copyright 2020, CrazyRedMachine
+ *
+ * One implementation is linked in, chosen with the PRODIKEYS_MIDI_SINK CMake option, so that calls are direct :
+ * prodikeys-midi-tevm.cpp (teVirtualMIDI, windows default), prodikeys-midi-alsa.cpp (ALSA sequencer, linux default),
+ * prodikeys-midi-jack.cpp (JACK), prodikeys-midi-file.cpp (raw MIDI stream to a file)
+ * or prodikeys-midi-null.cpp (drops everything, to measure decoding on its own)
+ */
+#pragma once
+#include <stdint.h>
+
+//Opaque handle to a virtual MIDI output port
+struct pcmidi_port;
+
+/**
+ * Create a virtual MIDI port other applications can read from
+ * @param name port name (UTF-8)
+ * @return the port, or NULL if it couldn't be created
+ */
+struct pcmidi_port *pcmidi_port_open(const char *name);
+
+/**
+ * Send MIDI data through a virtual port
+ * @param port the port
+ * @param data one or more complete MIDI messages, running status allowed within the buffer (it must start with a status byte)
+ * @param length data size
+ * @return true iff the data was accepted by the driver
+ */
+bool pcmidi_port_send(struct pcmidi_port *port, const uint8_t *data, int length);
+
+/**
+ * Close a virtual MIDI port
+ * @param port the port
+ */
+void pcmidi_port_close(struct pcmidi_port *port);
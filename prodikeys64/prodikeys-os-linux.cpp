@@ -0,0 +1,179 @@
+/* Prodikeys MIDI Interface - operating system services, linux implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "prodikeys-os.h"
+
+void prodikeys_launch(enum prodikeys_launch_target target){
+    const char *home = getenv("HOME");
+    char command[512];
+
+    //nothing to open things on without a desktop session
+    if (home == NULL || (getenv("DISPLAY") == NULL && getenv("WAYLAND_DISPLAY") == NULL))
+        return;
+
+    switch (target){
+        case PRODIKEYS_LAUNCH_CALCULATOR:
+            snprintf(command, sizeof(command), "gnome-calculator");
+            break;
+        case PRODIKEYS_LAUNCH_DOCUMENTS:
+            snprintf(command, sizeof(command), "xdg-open \"%s/Documents\"", home);
+            break;
+        case PRODIKEYS_LAUNCH_MUSIC:
+            snprintf(command, sizeof(command), "xdg-open \"%s/Music\"", home);
+            break;
+        case PRODIKEYS_LAUNCH_PICTURES:
+            snprintf(command, sizeof(command), "xdg-open \"%s/Pictures\"", home);
+            break;
+        default:
+            return;
+    }
+
+    //never waited for (SIGCHLD is ignored), the executor thread is free again as soon as it forked
+    if (fork() == 0){
+        execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+        _exit(127);
+    }
+}
+
+#define PRODIKEYS_STACK_PREFAULT (64 * 1024)
+
+/* Touch the stack pages the note path may use, so they are resident before the first report */
+static void prodikeys_prefault_stack(){
+    volatile uint8_t stack[PRODIKEYS_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+bool prodikeys_thread_realtime(const struct prodikeys_rt_config *config){
+    bool ok = true;
+
+    if (config->policy != PRODIKEYS_SCHED_DEFAULT){
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        int policy = config->policy == PRODIKEYS_SCHED_RR ? SCHED_RR : SCHED_FIFO;
+        //applies to the calling thread only, launched applications (fork) get the default scheduling back
+        if (sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &param) != 0){
+            //needs CAP_SYS_NICE or an rtprio limit (e.g. /etc/security/limits.d, member of the audio group)
+            fprintf(stderr, "prodikeysd: couldn't switch to real-time scheduling (%s)\n", strerror(errno));
+            ok = false;
+        }
+    }
+
+    if (config->cpu >= 0){
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(config->cpu, &cpus);
+        int res = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (res != 0){
+            fprintf(stderr, "prodikeysd: couldn't pin thread to cpu %d (%s)\n", config->cpu, strerror(res));
+            ok = false;
+        }
+    }
+
+    prodikeys_prefault_stack();
+    return ok;
+}
+
+void prodikeys_thread_default(){
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    sched_setscheduler(0, SCHED_OTHER, &param);
+}
+
+bool prodikeys_lock_process(){
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+        fprintf(stderr, "prodikeysd: couldn't lock memory (%s)\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool prodikeys_lock_memory(void *address, size_t size){
+    //prefault first : mlock makes the pages resident, writing to them also breaks copy-on-write sharing
+    volatile uint8_t *bytes = static_cast<volatile uint8_t *>(address);
+    for (size_t i = 0; i < size; i += 4096)
+        bytes[i] = bytes[i];
+    if (size > 0) bytes[size - 1] = bytes[size - 1];
+    return mlock(address, size) == 0;
+}
+
+struct prodikeys_file_watch {
+    int         inotify;            // watching the directory of the file
+    int         cancel;             // eventfd written by prodikeys_file_watch_cancel
+    char        name[NAME_MAX + 1]; // file name in that directory
+};
+
+struct prodikeys_file_watch *prodikeys_file_watch_open(const char *path){
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    const char *name = slash != NULL ? slash + 1 : path;
+    size_t length = slash != NULL ? (size_t) (slash - path) : 0;
+    if (name[0] == '\0' || strlen(name) > NAME_MAX || length >= sizeof(dir)) return NULL;
+    if (slash == NULL) strcpy(dir, ".");
+    else if (length == 0) strcpy(dir, "/");
+    else {
+        memcpy(dir, path, length);
+        dir[length] = '\0';
+    }
+
+    struct prodikeys_file_watch *watch = static_cast<struct prodikeys_file_watch *>(malloc(sizeof(struct prodikeys_file_watch)));
+    if (watch == NULL) return NULL;
+    strcpy(watch->name, name);
+    watch->inotify = inotify_init1(IN_CLOEXEC);
+    watch->cancel = eventfd(0, EFD_CLOEXEC);
+    //written and closed, or moved there (editors saving to a temporary file first) : never half written
+    if (watch->inotify < 0 || watch->cancel < 0 || inotify_add_watch(watch->inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+        prodikeys_file_watch_close(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+bool prodikeys_file_watch_wait(struct prodikeys_file_watch *watch){
+    alignas(struct inotify_event) char events[4096];
+    struct pollfd fds[2] = {{watch->inotify, POLLIN, 0}, {watch->cancel, POLLIN, 0}};
+    for (;;){
+        if (poll(fds, 2, -1) < 0){
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (fds[1].revents != 0) return false;
+        ssize_t length = read(watch->inotify, events, sizeof(events));
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) return false;
+        //events about the other files of the directory are skipped
+        for (char *p = events; p < events + length; ){
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+            if (event->mask & IN_IGNORED) return false; //the directory is gone
+            if (event->len > 0 && strcmp(event->name, watch->name) == 0) return true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+void prodikeys_file_watch_cancel(struct prodikeys_file_watch *watch){
+    uint64_t one = 1;
+    if (write(watch->cancel, &one, sizeof(one)) < 0)
+        fprintf(stderr, "prodikeysd: couldn't cancel file watch (%s)\n", strerror(errno));
+}
+
+void prodikeys_file_watch_close(struct prodikeys_file_watch *watch){
+    if (watch == NULL) return;
+    if (watch->inotify >= 0) close(watch->inotify);
+    if (watch->cancel >= 0) close(watch->cancel);
+    free(watch);
+}
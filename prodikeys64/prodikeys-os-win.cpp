@@ -0,0 +1,151 @@
+/* Prodikeys MIDI Interface - operating system services, windows implementation
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdlib.h>
+#include <windows.h>
+#include <shellapi.h>
+#include <avrt.h>
+#include "prodikeys-os.h"
+
+void prodikeys_launch(enum prodikeys_launch_target target){
+    //ShellExecute may go through COM shell extensions, initialized once per launching thread
+    static thread_local HRESULT com = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+    switch (target){
+        case PRODIKEYS_LAUNCH_CALCULATOR:
+            ShellExecute(NULL, "open", "calc.exe", NULL, NULL, SW_SHOWDEFAULT); //system("calc.exe");
+            break;
+        case PRODIKEYS_LAUNCH_DOCUMENTS:
+            system("explorer.exe \"%userprofile%\\Documents\"");
+            break;
+        case PRODIKEYS_LAUNCH_MUSIC:
+            system("explorer.exe \"%userprofile%\\Music\"");
+            break;
+        case PRODIKEYS_LAUNCH_PICTURES:
+            system("explorer.exe \"%userprofile%\\Pictures\"");
+            break;
+    }
+}
+
+#define PRODIKEYS_STACK_PREFAULT (64 * 1024)
+#define PRODIKEYS_WORKING_SET_MIN (16 * 1024 * 1024)
+#define PRODIKEYS_WORKING_SET_MAX (64 * 1024 * 1024)
+
+static thread_local HANDLE prodikeys_mmcss_task = NULL;   // MMCSS registration of the calling thread
+
+/* Touch the stack pages the note path may use, so they are resident before the first report */
+static void prodikeys_prefault_stack(){
+    volatile uint8_t stack[PRODIKEYS_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+bool prodikeys_thread_realtime(const struct prodikeys_rt_config *config){
+    bool ok = true;
+
+    if (config->policy != PRODIKEYS_SCHED_DEFAULT){
+        //MMCSS boosts the thread into the real-time priority range while leaving some cpu to the rest of the system
+        DWORD taskIndex = 0;
+        if (prodikeys_mmcss_task == NULL)
+            prodikeys_mmcss_task = AvSetMmThreadCharacteristicsW(L"Pro Audio", &taskIndex);
+        if (prodikeys_mmcss_task != NULL)
+            AvSetMmThreadPriority(prodikeys_mmcss_task, AVRT_PRIORITY_CRITICAL);
+        else if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+            ok = false;
+    }
+
+    if (config->cpu >= 0 && config->cpu < (int) (8 * sizeof(DWORD_PTR))){
+        if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << config->cpu) == 0)
+            ok = false;
+    }
+
+    prodikeys_prefault_stack();
+    return ok;
+}
+
+void prodikeys_thread_default(){
+    if (prodikeys_mmcss_task != NULL){
+        AvRevertMmThreadCharacteristics(prodikeys_mmcss_task);
+        prodikeys_mmcss_task = NULL;
+    }
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+}
+
+bool prodikeys_lock_process(){
+    //VirtualLock is limited by the minimum working set size
+    return SetProcessWorkingSetSize(GetCurrentProcess(), PRODIKEYS_WORKING_SET_MIN, PRODIKEYS_WORKING_SET_MAX) != 0;
+}
+
+bool prodikeys_lock_memory(void *address, size_t size){
+    volatile uint8_t *bytes = static_cast<volatile uint8_t *>(address);
+    for (size_t i = 0; i < size; i += 4096)
+        bytes[i] = bytes[i];
+    if (size > 0) bytes[size - 1] = bytes[size - 1];
+    return VirtualLock(address, size) != 0;
+}
+
+struct prodikeys_file_watch {
+    HANDLE                      change;     // FindFirstChangeNotification on the directory of the file
+    HANDLE                      cancel;     // manual reset event set by prodikeys_file_watch_cancel
+    char                        path[MAX_PATH];
+    WIN32_FILE_ATTRIBUTE_DATA   last;       // last write time (100 ns) and size the file was last seen with
+    bool                        known;      // whether last is set, the file existed
+};
+
+struct prodikeys_file_watch *prodikeys_file_watch_open(const char *path){
+    char dir[MAX_PATH];
+    const char *slash = strrchr(path, '\\');
+    const char *other = strrchr(path, '/');
+    if (other != NULL && (slash == NULL || other > slash)) slash = other;
+    size_t length = slash != NULL ? (size_t) (slash - path) : 0;
+    if (strlen(path) >= MAX_PATH) return NULL;
+    if (slash == NULL) strcpy_s(dir, MAX_PATH, ".");
+    else if (length == 0 || (length == 2 && path[1] == ':')) { //root of the drive, keep its separator
+        memcpy(dir, path, length + 1);
+        dir[length + 1] = '\0';
+    } else {
+        memcpy(dir, path, length);
+        dir[length] = '\0';
+    }
+
+    struct prodikeys_file_watch *watch = static_cast<struct prodikeys_file_watch *>(malloc(sizeof(struct prodikeys_file_watch)));
+    if (watch == NULL) return NULL;
+    strcpy_s(watch->path, MAX_PATH, path);
+    watch->known = GetFileAttributesExA(path, GetFileExInfoStandard, &watch->last) != 0;
+    watch->change = FindFirstChangeNotificationA(dir, FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE
+                                                             | FILE_NOTIFY_CHANGE_SIZE);
+    watch->cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (watch->change == INVALID_HANDLE_VALUE || watch->cancel == NULL){
+        prodikeys_file_watch_close(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+bool prodikeys_file_watch_wait(struct prodikeys_file_watch *watch){
+    HANDLE handles[2] = {watch->cancel, watch->change};
+    for (;;){
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) return false;
+        if (!FindNextChangeNotification(watch->change)) return false;
+        //notifications cover the whole directory, the file itself changed if its write time or size did
+        WIN32_FILE_ATTRIBUTE_DATA now;
+        if (!GetFileAttributesExA(watch->path, GetFileExInfoStandard, &now)) continue; //being replaced, or gone
+        if (watch->known && CompareFileTime(&now.ftLastWriteTime, &watch->last.ftLastWriteTime) == 0
+            && now.nFileSizeLow == watch->last.nFileSizeLow && now.nFileSizeHigh == watch->last.nFileSizeHigh)
+            continue;
+        watch->last = now;
+        watch->known = true;
+        return true;
+    }
+}
+
+void prodikeys_file_watch_cancel(struct prodikeys_file_watch *watch){
+    SetEvent(watch->cancel);
+}
+
+void prodikeys_file_watch_close(struct prodikeys_file_watch *watch){
+    if (watch == NULL) return;
+    if (watch->change != INVALID_HANDLE_VALUE) FindCloseChangeNotification(watch->change);
+    if (watch->cancel != NULL) CloseHandle(watch->cancel);
+    free(watch);
+}
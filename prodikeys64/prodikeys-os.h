@@ -0,0 +1,143 @@
+/* Prodikeys MIDI Interface - operating system services
+ * Copyright 2020, CrazyRedMachine
+ *
+ * One implementation is linked per platform :
+ * prodikeys-os-win.cpp (windows) or prodikeys-os-linux.cpp (linux)
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//Keys the Prodikeys media and system buttons are forwarded as (values are the windows virtual-key codes)
+enum prodikeys_key {
+    PRODIKEYS_KEY_SLEEP                 = 0x5F,
+    PRODIKEYS_KEY_BROWSER_HOME          = 0xAC,
+    PRODIKEYS_KEY_VOLUME_MUTE           = 0xAD,
+    PRODIKEYS_KEY_VOLUME_DOWN           = 0xAE,
+    PRODIKEYS_KEY_VOLUME_UP             = 0xAF,
+    PRODIKEYS_KEY_MEDIA_NEXT_TRACK      = 0xB0,
+    PRODIKEYS_KEY_MEDIA_PREV_TRACK      = 0xB1,
+    PRODIKEYS_KEY_MEDIA_STOP            = 0xB2,
+    PRODIKEYS_KEY_MEDIA_PLAY_PAUSE      = 0xB3,
+    PRODIKEYS_KEY_LAUNCH_MAIL           = 0xB4,
+    PRODIKEYS_KEY_LAUNCH_MEDIA_SELECT   = 0xB5,
+};
+
+//Applications and folders opened by the Prodikeys shortcut buttons
+enum prodikeys_launch_target {
+    PRODIKEYS_LAUNCH_CALCULATOR,
+    PRODIKEYS_LAUNCH_DOCUMENTS,
+    PRODIKEYS_LAUNCH_MUSIC,
+    PRODIKEYS_LAUNCH_PICTURES,
+};
+
+//Scheduling classes for the threads on the note path
+enum prodikeys_sched_policy {
+    PRODIKEYS_SCHED_DEFAULT,            // left to the operating system
+    PRODIKEYS_SCHED_FIFO,               // linux SCHED_FIFO, windows MMCSS "Pro Audio" task
+    PRODIKEYS_SCHED_RR,                 // linux SCHED_RR, windows MMCSS "Pro Audio" task
+};
+
+//Real-time configuration of a thread
+struct prodikeys_rt_config {
+    enum prodikeys_sched_policy policy;
+    int                         priority;   // linux real-time priority (1 to 99), ignored on windows
+    int                         cpu;        // cpu the thread is pinned to, -1 for any
+};
+
+#define PRODIKEYS_RT_PRIORITY_DEFAULT 70    // above most audio servers' clients, below the kernel's irq threads
+
+/**
+ * Apply a real-time configuration to the calling thread, and prefault its stack
+ * @param config scheduling class, priority and cpu
+ * @return true iff everything asked for could be applied (the thread runs with what could be)
+ */
+bool prodikeys_thread_realtime(const struct prodikeys_rt_config *config);
+
+/**
+ * Give the calling thread its default scheduling back (before it exits, or leaves the note path)
+ */
+void prodikeys_thread_default();
+
+/**
+ * Keep the whole process resident : current and future pages on linux (mlockall),
+ * a working set large enough for the buffers locked with prodikeys_lock_memory on windows
+ * @return true iff memory could be locked
+ */
+bool prodikeys_lock_process();
+
+/**
+ * Prefault a buffer and lock it in physical memory, so the note path never takes a page fault on it
+ * @param address start of the buffer
+ * @param size buffer size in bytes
+ * @return true iff the buffer could be locked
+ */
+bool prodikeys_lock_memory(void *address, size_t size);
+
+/**
+ * Parse a scheduling policy name
+ * @param name "fifo", "rr", or "default"/"other"
+ * @param policy receives the policy
+ * @return true iff the name is known
+ */
+static inline bool prodikeys_sched_policy_parse(const char *name, enum prodikeys_sched_policy *policy){
+    if (strcmp(name, "fifo") == 0) *policy = PRODIKEYS_SCHED_FIFO;
+    else if (strcmp(name, "rr") == 0) *policy = PRODIKEYS_SCHED_RR;
+    else if (strcmp(name, "default") == 0 || strcmp(name, "other") == 0) *policy = PRODIKEYS_SCHED_DEFAULT;
+    else return false;
+    return true;
+}
+
+/**
+ * Position of the lowest bit set
+ * @param v value, must not be 0
+ * @return bit index (0 to 31)
+ */
+static inline int prodikeys_ctz(uint32_t v){
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, v);
+    return (int) index;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
+/**
+ * Open an application or a user folder
+ * @param target what to open
+ */
+void prodikeys_launch(enum prodikeys_launch_target target);
+
+//Change notifications of a file, through the directory holding it (inotify on linux, FindFirstChangeNotification on windows)
+struct prodikeys_file_watch;
+
+/**
+ * Start watching a file, which may not exist yet
+ * @param path file to watch
+ * @return the watch, or NULL if its directory can't be watched (the file then has to be polled)
+ */
+struct prodikeys_file_watch *prodikeys_file_watch_open(const char *path);
+
+/**
+ * Wait until the file has been written and closed, or replaced (renamed over, or created)
+ * @param watch file watch
+ * @return true once it changed, false if the watch was cancelled or stopped working (directory removed)
+ */
+bool prodikeys_file_watch_wait(struct prodikeys_file_watch *watch);
+
+/**
+ * Make prodikeys_file_watch_wait return false, now or on its next call. Can be called from any thread.
+ * @param watch file watch
+ */
+void prodikeys_file_watch_cancel(struct prodikeys_file_watch *watch);
+
+/**
+ * Stop watching and free the watch (no thread may be waiting on it)
+ * @param watch file watch, or NULL
+ */
+void prodikeys_file_watch_close(struct prodikeys_file_watch *watch);
@@ -0,0 +1,259 @@
+/* Prodikeys MIDI Interface - MIDI output thread
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "prodikeys-core.h"
+#include "prodikeys-output.h"
+#include "prodikeys-stats.h"
+
+#define PRODIKEYS_RING_MASK (PRODIKEYS_RING_SIZE - 1)
+#define PRODIKEYS_OUTPUT_BATCH 96           // bytes written to a port at once
+
+static struct {
+    struct prodikeys_ring           rings[PRODIKEYS_MAX_DEVICES];
+    enum prodikeys_overflow_policy  policy;
+    struct prodikeys_rt_config      rt;
+    std::thread                     thread;
+    std::mutex                      mutex;          // only taken to sleep and to wake the output thread up
+    std::condition_variable         wake;
+    std::atomic<bool>               sleeping;       // output thread is about to wait or waiting on wake
+                                                    // (stored and loaded seq_cst, see prodikeys_ring_pending)
+    std::atomic<bool>               running;
+} prodikeys_output;
+
+/* Whether a ring has something to write. Every load is sequentially consistent, as are the producer stores of head
+ * and pitch : with the output thread storing sleeping before checking and producers loading sleeping after pushing,
+ * either the output thread sees the push or the producer sees it sleeping and wakes it, so it can wait with no timeout */
+static inline bool prodikeys_ring_pending(struct prodikeys_ring *ring){
+    if (ring->tail.load() != ring->head.load()) return true;
+    for (int channel = 0; channel < 16; channel++)
+        if (ring->pitch[channel].load() != 0) return true;
+    return false;
+}
+
+/* Take the oldest entry, false if the ring is empty */
+static bool prodikeys_ring_pop(struct prodikeys_ring *ring, uint64_t *entry){
+    uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    while (tail != ring->head.load(std::memory_order_acquire)){
+        *entry = ring->entries[tail & PRODIKEYS_RING_MASK].load(std::memory_order_relaxed);
+        //fails if the producer dropped this entry meanwhile (drop oldest policy), tail then holds the next one
+        if (ring->tail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel))
+            return true;
+    }
+    return false;
+}
+
+/* Append a message to a batch with running status, writing the batch out first if it is full */
+static void prodikeys_output_append(struct pcmidi_port *port, uint8_t *buffer, int *length, uint8_t *running_status,
+                                    uint8_t status, uint8_t data1, uint8_t data2, int size){
+    if (*length + 3 > PRODIKEYS_OUTPUT_BATCH){
+        uint64_t start = prodikeys_now_ns();
+        if (!pcmidi_port_send(port, buffer, *length))
+            prodikeys_stats.sink_errors.fetch_add(1, std::memory_order_relaxed);
+        prodikeys_stats.sink_calls.fetch_add(1, std::memory_order_relaxed);
+        prodikeys_stats_stage(PRODIKEYS_STAGE_SINK, prodikeys_now_ns() - start);
+        *length = 0;
+        *running_status = 0;
+    }
+    if (status != *running_status){
+        buffer[(*length)++] = status;
+        *running_status = status;
+    }
+    if (size > 1) buffer[(*length)++] = data1;
+    if (size > 2) buffer[(*length)++] = data2;
+}
+
+/* Write everything queued on a ring to its port, in as few sends as possible */
+static void prodikeys_output_drain(struct prodikeys_ring *ring, struct pcmidi_port *port){
+    uint8_t buffer[PRODIKEYS_OUTPUT_BATCH];
+    int length = 0;
+    uint8_t running_status = 0;
+    uint64_t entry;
+    bool first = true;
+    uint32_t first_ts = 0;
+
+    while (prodikeys_ring_pop(ring, &entry)){
+        if (port == NULL) continue; //queued while the ring was being unbound
+        if (first){
+            first_ts = (uint32_t) (entry >> 32);
+            first = false;
+        }
+        prodikeys_output_append(port, buffer, &length, &running_status,
+                                (uint8_t) entry, (uint8_t) (entry >> 8), (uint8_t) (entry >> 16), (int) ((entry >> 24) & 0xFF));
+    }
+    //coalesced pitch bends are newer than anything still in the ring when they were stored
+    for (int channel = 0; channel < 16; channel++){
+        uint32_t pitch = ring->pitch[channel].exchange(0, std::memory_order_relaxed);
+        if (pitch == 0 || port == NULL) continue;
+        prodikeys_output_append(port, buffer, &length, &running_status,
+                                (uint8_t) (0xE0 | channel), (uint8_t) (pitch & 0x7F), (uint8_t) ((pitch >> 7) & 0x7F), 3);
+    }
+    if (length == 0) return;
+
+    uint64_t start = prodikeys_now_ns();
+    if (!pcmidi_port_send(port, buffer, length))
+        prodikeys_stats.sink_errors.fetch_add(1, std::memory_order_relaxed);
+    uint64_t now = prodikeys_now_ns();
+    prodikeys_stats.sink_calls.fetch_add(1, std::memory_order_relaxed);
+    prodikeys_stats_stage(PRODIKEYS_STAGE_SINK, now - start);
+    if (!first)
+        prodikeys_stats_stage(PRODIKEYS_STAGE_OUTPUT, (uint32_t) ((uint32_t) now - first_ts));
+}
+
+static void prodikeys_output_run(){
+    prodikeys_thread_realtime(&prodikeys_output.rt);
+
+    while (true){
+        bool pending = false;
+        for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++){
+            struct prodikeys_ring *ring = &prodikeys_output.rings[slot];
+            if (!prodikeys_ring_pending(ring)) continue;
+            //busy is raised before the port is read, so that unbinding can wait for the port to be left alone
+            ring->busy.store(true);
+            prodikeys_output_drain(ring, ring->port.load());
+            ring->busy.store(false);
+            pending = true;
+        }
+        if (pending) continue;
+
+        std::unique_lock<std::mutex> lock(prodikeys_output.mutex);
+        prodikeys_output.sleeping.store(true);
+        bool empty = true;
+        for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES && empty; slot++)
+            if (prodikeys_ring_pending(&prodikeys_output.rings[slot])) empty = false;
+        if (empty && !prodikeys_output.running.load()) break;
+        if (empty)
+            prodikeys_output.wake.wait(lock); //woken under the mutex, a notify can't slip in before the wait
+        prodikeys_output.sleeping.store(false);
+    }
+    prodikeys_thread_default();
+}
+
+bool prodikeys_output_start(enum prodikeys_overflow_policy policy, const struct prodikeys_rt_config *rt){
+    if (prodikeys_output.running) return true;
+    for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++){
+        struct prodikeys_ring *ring = &prodikeys_output.rings[slot];
+        ring->head = 0;
+        ring->tail = 0;
+        ring->port = NULL;
+        ring->busy = false;
+        for (int channel = 0; channel < 16; channel++)
+            ring->pitch[channel] = 0;
+    }
+    prodikeys_output.policy = policy;
+    prodikeys_output.rt = *rt;
+    prodikeys_output.sleeping = false;
+    prodikeys_output.running = true;
+    try {
+        prodikeys_output.thread = std::thread(prodikeys_output_run);
+    } catch (const std::system_error &) {
+        prodikeys_output.running = false;
+        return false;
+    }
+    return true;
+}
+
+void prodikeys_output_stop(){
+    if (!prodikeys_output.running) return;
+    {
+        std::lock_guard<std::mutex> lock(prodikeys_output.mutex);
+        prodikeys_output.running = false;
+    }
+    prodikeys_output.wake.notify_one();
+    prodikeys_output.thread.join();
+}
+
+struct prodikeys_ring *prodikeys_output_ring(int slot){
+    if (!prodikeys_output.running || slot < 0 || slot >= PRODIKEYS_MAX_DEVICES) return NULL;
+    return &prodikeys_output.rings[slot];
+}
+
+void prodikeys_ring_bind(struct prodikeys_ring *ring, struct pcmidi_port *port){
+    ring->port.store(port);
+}
+
+void prodikeys_ring_unbind(struct prodikeys_ring *ring){
+    if (ring->port.load() == NULL) return;
+    //pending messages (note offs above all) still go out on the port they were queued for
+    while (prodikeys_output.running && prodikeys_ring_pending(ring))
+        std::this_thread::yield();
+    ring->port.store(NULL);
+    while (ring->busy.load())
+        std::this_thread::yield();
+}
+
+/* Queue one entry, applying the overflow policy when the ring is full */
+static bool prodikeys_ring_push_entry(struct prodikeys_ring *ring, uint64_t entry){
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint8_t status = (uint8_t) entry;
+    bool pitch = (status & 0xF0) == 0xE0;
+
+    if (head - ring->tail.load(std::memory_order_acquire) >= PRODIKEYS_RING_SIZE){
+        switch (prodikeys_output.policy){
+            case PRODIKEYS_OVERFLOW_DROP_OLDEST: {
+                uint64_t tail = head - PRODIKEYS_RING_SIZE;
+                //fails only if the output thread just took it, which made room as well
+                if (ring->tail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel))
+                    prodikeys_stats.output_dropped.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            case PRODIKEYS_OVERFLOW_COALESCE_PITCH:
+                if (pitch){
+                    uint32_t value = 0x8000 | (uint32_t) ((entry >> 16) & 0x7F) << 7 | (uint32_t) ((entry >> 8) & 0x7F);
+                    ring->pitch[status & 0x0F].store(value); //sequentially consistent, as head below
+                    prodikeys_stats.output_coalesced.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+                prodikeys_stats.output_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            case PRODIKEYS_OVERFLOW_BLOCK:
+                prodikeys_stats.output_blocked.fetch_add(1, std::memory_order_relaxed);
+                while (head - ring->tail.load(std::memory_order_acquire) >= PRODIKEYS_RING_SIZE){
+                    if (!prodikeys_output.running) return false;
+                    std::this_thread::yield();
+                }
+                break;
+        }
+    }
+    if (pitch && prodikeys_output.policy == PRODIKEYS_OVERFLOW_COALESCE_PITCH)
+        ring->pitch[status & 0x0F].store(0, std::memory_order_relaxed); //this one is newer than the coalesced value
+
+    ring->entries[head & PRODIKEYS_RING_MASK].store(entry, std::memory_order_relaxed);
+    ring->head.store(head + 1); //sequentially consistent, ordered with the sleeping check below
+
+    uint64_t depth = head + 1 - ring->tail.load(std::memory_order_relaxed);
+    uint64_t max = prodikeys_stats.output_max_depth.load(std::memory_order_relaxed);
+    while (depth > max && !prodikeys_stats.output_max_depth.compare_exchange_weak(max, depth, std::memory_order_relaxed));
+    return true;
+}
+
+bool prodikeys_ring_push(struct prodikeys_ring *ring, const uint8_t *data, int length, uint64_t timestamp_ns){
+    uint8_t status = 0;
+    bool ret = true;
+    int i = 0;
+    while (i < length){
+        if (data[i] & 0x80) status = data[i++];
+        if (status == 0) return false; //data without any status byte
+        uint8_t message[2] = {0, 0};
+        int size = (status & 0xE0) == 0xC0 ? 2 : 3; //program change and channel pressure have one data byte
+        for (int j = 1; j < size && i < length; j++)
+            message[j - 1] = data[i++];
+        uint64_t entry = (uint64_t) status | (uint64_t) message[0] << 8 | (uint64_t) message[1] << 16
+                         | (uint64_t) size << 24 | (uint64_t) (uint32_t) timestamp_ns << 32;
+        if (!prodikeys_ring_push_entry(ring, entry)) ret = false;
+    }
+
+    if (prodikeys_output.sleeping.load()){
+        std::lock_guard<std::mutex> lock(prodikeys_output.mutex);
+        prodikeys_output.wake.notify_one();
+    }
+    return ret;
+}
+
+int prodikeys_ring_depth(struct prodikeys_ring *ring){
+    return (int) (ring->head.load() - ring->tail.load());
+}
@@ -0,0 +1,101 @@
+/* Prodikeys MIDI Interface - MIDI output thread
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Decoded MIDI messages are queued by the reading threads in one bounded single-producer single-consumer ring
+ * per keyboard, and written to the MIDI ports by a dedicated output thread. A slow MIDI driver or downstream
+ * application then delays MIDI output only, the interrupt endpoint keeps being read.
+ *
+ * A ring entry is one 64-bit word : status, data 1, data 2, message size, then the low 32 bits of the
+ * completion time of the report the message comes from (prodikeys_now_ns).
+ * Pushing never takes a lock. The output thread sleeps when every ring is empty; a producer then takes a
+ * mutex only to wake it up.
+ */
+#pragma once
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include "prodikeys-midi.h"
+#include "prodikeys-os.h"
+
+#define PRODIKEYS_RING_SIZE 1024            // entries per keyboard, power of 2
+
+//What a producer does when its ring is full
+enum prodikeys_overflow_policy {
+    PRODIKEYS_OVERFLOW_DROP_OLDEST,         // the oldest queued message is dropped to make room
+    PRODIKEYS_OVERFLOW_COALESCE_PITCH,      // pitch bends are merged per channel (latest wins), other messages dropped
+    PRODIKEYS_OVERFLOW_BLOCK,               // the reading thread waits for room
+};
+
+struct prodikeys_ring {
+    alignas(64) std::atomic<uint64_t>           head;       // next entry written, producer only
+    alignas(64) std::atomic<uint64_t>           tail;       // next entry read, consumer (and producer dropping the oldest)
+    alignas(64) std::atomic<struct pcmidi_port *> port;     // port the entries are written to, NULL when unbound
+    std::atomic<bool>                           busy;       // the output thread is writing entries of this ring
+    std::atomic<uint32_t>                       pitch[16];  // coalesced pitch bend per channel (0x8000 | msb << 7 | lsb), 0 if none
+    std::atomic<uint64_t>                       entries[PRODIKEYS_RING_SIZE];
+};
+
+/**
+ * Start the output thread
+ * @param policy overflow policy of every ring
+ * @param rt scheduling of the output thread
+ * @return true iff the thread is running
+ */
+bool prodikeys_output_start(enum prodikeys_overflow_policy policy, const struct prodikeys_rt_config *rt);
+
+/**
+ * Write what is still queued and stop the output thread (rings must be unbound or idle)
+ */
+void prodikeys_output_stop();
+
+/**
+ * Ring of a keyboard slot. Rings are never freed, a slot keeps its ring across keyboards.
+ * @param slot keyboard slot (0 to PRODIKEYS_MAX_DEVICES - 1)
+ * @return the ring, or NULL if the output thread isn't running
+ */
+struct prodikeys_ring *prodikeys_output_ring(int slot);
+
+/**
+ * Start writing a ring to a port
+ * @param ring the ring
+ * @param port the port
+ */
+void prodikeys_ring_bind(struct prodikeys_ring *ring, struct pcmidi_port *port);
+
+/**
+ * Wait until everything queued on a ring has been written, then detach it from its port.
+ * The port can be closed once this returns. Must not be called from the output thread.
+ * @param ring the ring
+ */
+void prodikeys_ring_unbind(struct prodikeys_ring *ring);
+
+/**
+ * Queue MIDI messages (single producer per ring)
+ * @param ring the ring
+ * @param data complete MIDI channel messages, running status allowed
+ * @param length data size
+ * @param timestamp_ns completion time of the report the messages come from
+ * @return true iff every message was queued (or coalesced)
+ */
+bool prodikeys_ring_push(struct prodikeys_ring *ring, const uint8_t *data, int length, uint64_t timestamp_ns);
+
+/**
+ * Number of entries waiting in a ring
+ * @param ring the ring
+ * @return ring depth
+ */
+int prodikeys_ring_depth(struct prodikeys_ring *ring);
+
+/**
+ * Parse an overflow policy name
+ * @param name "drop-oldest", "coalesce" or "block"
+ * @param policy receives the policy
+ * @return true iff the name is known
+ */
+static inline bool prodikeys_overflow_policy_parse(const char *name, enum prodikeys_overflow_policy *policy){
+    if (strcmp(name, "drop-oldest") == 0) *policy = PRODIKEYS_OVERFLOW_DROP_OLDEST;
+    else if (strcmp(name, "coalesce") == 0) *policy = PRODIKEYS_OVERFLOW_COALESCE_PITCH;
+    else if (strcmp(name, "block") == 0) *policy = PRODIKEYS_OVERFLOW_BLOCK;
+    else return false;
+    return true;
+}
@@ -0,0 +1,248 @@
+/* Prodikeys MIDI Interface - simulated keyboard
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include "prodikeys-sim.h"
+#include "prodikeys-stats.h"
+
+#define PRODIKEYS_SIM_MS 1000000ULL
+
+//What the performer does next, in parts of PRODIKEYS_SIM_PHRASES
+enum prodikeys_sim_phrase {
+    PRODIKEYS_SIM_CHORD = 40,       // 3 or 4 keys pressed at once, held, released at once
+    PRODIKEYS_SIM_GLISSANDO = 62,   // a run of 8 to 16 neighbouring keys, each released before the next
+    PRODIKEYS_SIM_WHEEL = 82,       // volume wheel spun up or down (pitch bend with fn lock and piano keys)
+    PRODIKEYS_SIM_FN = 90,          // FN button
+    PRODIKEYS_SIM_OCTAVE = 98,      // octave up or down button (next and previous instrument with fn lock)
+    PRODIKEYS_SIM_SLEEP = 100,      // sleep key
+    PRODIKEYS_SIM_PHRASES = 100
+};
+
+static const uint8_t prodikeys_sim_c3[] = {0x05, 0xC3, 0x0A, 0x00, 0x00, 0x02};
+static const uint8_t prodikeys_sim_c4[] = {0x05, 0xC4, 0x00, 0x00, 0x00, 0x3F};
+
+static uint32_t prodikeys_sim_rand(struct prodikeys_sim *sim){
+    uint32_t x = sim->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return sim->rng = x;
+}
+
+/* Uniform value from low to high included */
+static uint32_t prodikeys_sim_range(struct prodikeys_sim *sim, uint32_t low, uint32_t high){
+    return low + prodikeys_sim_rand(sim) % (high - low + 1);
+}
+
+/* Queue a report of the phrase, reports must be queued in due order */
+static void prodikeys_sim_push(struct prodikeys_sim *sim, uint64_t due_ns, const uint8_t *data, int length){
+    if (sim->tail == PRODIKEYS_SIM_QUEUE) return;
+    struct prodikeys_sim_event *event = &sim->queue[sim->tail++];
+    event->due_ns = due_ns;
+    event->length = (uint8_t) length;
+    memcpy(event->data, data, length);
+    if (due_ns > sim->free_ns) sim->free_ns = due_ns;
+}
+
+/* A button of report 1, 2 or 4 pressed then released */
+static uint64_t prodikeys_sim_button(struct prodikeys_sim *sim, uint64_t t, uint8_t report_id, uint32_t bit, uint64_t hold_ns){
+    uint8_t data[4] = {report_id, (uint8_t) bit, (uint8_t) (bit >> 8), (uint8_t) (bit >> 16)};
+    int length = report_id == 0x02 ? 2 : 4;
+    prodikeys_sim_push(sim, t, data, length);
+    memset(data + 1, 0, 3);
+    prodikeys_sim_push(sim, t + hold_ns, data, length);
+    return t + hold_ns;
+}
+
+/* Make up the next phrase, starting after the previous one is over */
+static void prodikeys_sim_phrase(struct prodikeys_sim *sim){
+    uint8_t data[PRODIKEYS_REPORT_SIZE];
+    uint64_t t = sim->free_ns + prodikeys_sim_range(sim, 40, 300) * PRODIKEYS_SIM_MS;
+    uint32_t phrase = prodikeys_sim_range(sim, 1, PRODIKEYS_SIM_PHRASES);
+    sim->head = sim->tail = 0;
+
+    if (phrase <= PRODIKEYS_SIM_CHORD){
+        //root, third, fifth and maybe the octave, all within the keyboard
+        static const int intervals[] = {0, 3, 7, 12};
+        int num_keys = (int) prodikeys_sim_range(sim, 3, 4);
+        int third = prodikeys_sim_range(sim, 0, 1);
+        int root = (int) prodikeys_sim_range(sim, 0, PRODIKEYS_SIM_KEYS - 1 - 12);
+        uint8_t velocity = (uint8_t) prodikeys_sim_range(sim, 0x30, 0x7F);
+        data[0] = 0x03;
+        for (int i = 0; i < num_keys; i++){
+            data[1 + i * 2] = (uint8_t) (PRODIKEYS_SIM_KEY_LOW + root + intervals[i] + (i == 1 ? third : 0));
+            data[2 + i * 2] = velocity;
+        }
+        prodikeys_sim_push(sim, t, data, 1 + num_keys * 2);
+        for (int i = 0; i < num_keys; i++){
+            data[1 + i * 2] += 0x40;
+            data[2 + i * 2] = 0;
+        }
+        prodikeys_sim_push(sim, t + prodikeys_sim_range(sim, 150, 900) * PRODIKEYS_SIM_MS, data, 1 + num_keys * 2);
+    } else if (phrase <= PRODIKEYS_SIM_GLISSANDO){
+        int num_keys = (int) prodikeys_sim_range(sim, 8, 16);
+        int up = prodikeys_sim_range(sim, 0, 1);
+        int key = up ? (int) prodikeys_sim_range(sim, 0, PRODIKEYS_SIM_KEYS - num_keys)
+                     : (int) prodikeys_sim_range(sim, num_keys - 1, PRODIKEYS_SIM_KEYS - 1);
+        uint64_t step_ns = prodikeys_sim_range(sim, 25, 45) * PRODIKEYS_SIM_MS;
+        uint8_t velocity = (uint8_t) prodikeys_sim_range(sim, 0x30, 0x7F);
+        for (int i = 0; i < num_keys; i++, key += up ? 1 : -1, t += step_ns){
+            data[0] = 0x03;
+            data[1] = (uint8_t) (PRODIKEYS_SIM_KEY_LOW + key);
+            data[2] = velocity;
+            prodikeys_sim_push(sim, t, data, 3);
+            data[1] += 0x40;
+            data[2] = 0;
+            prodikeys_sim_push(sim, t + step_ns - 5 * PRODIKEYS_SIM_MS, data, 3);
+        }
+    } else if (phrase <= PRODIKEYS_SIM_WHEEL){
+        //every notch of the wheel is a volume up (report 1 bit 7) or down (bit 8) press
+        int notches = (int) prodikeys_sim_range(sim, 4, 16);
+        uint32_t bit = prodikeys_sim_range(sim, 0, 1) ? 1u << 7 : 1u << 8;
+        for (int i = 0; i < notches; i++)
+            t = prodikeys_sim_button(sim, t, 0x01, bit, 4 * PRODIKEYS_SIM_MS) + prodikeys_sim_range(sim, 6, 16) * PRODIKEYS_SIM_MS;
+    } else if (phrase <= PRODIKEYS_SIM_FN){
+        prodikeys_sim_button(sim, t, 0x04, 1u << 20, prodikeys_sim_range(sim, 60, 150) * PRODIKEYS_SIM_MS);
+    } else if (phrase <= PRODIKEYS_SIM_OCTAVE){
+        //octave up is report 4 bit 4, octave down report 1 bit 14
+        if (prodikeys_sim_range(sim, 0, 1))
+            prodikeys_sim_button(sim, t, 0x04, 1u << 4, prodikeys_sim_range(sim, 60, 150) * PRODIKEYS_SIM_MS);
+        else
+            prodikeys_sim_button(sim, t, 0x01, 1u << 14, prodikeys_sim_range(sim, 60, 150) * PRODIKEYS_SIM_MS);
+    } else {
+        prodikeys_sim_button(sim, t, 0x02, 1u << 1, prodikeys_sim_range(sim, 60, 150) * PRODIKEYS_SIM_MS);
+    }
+}
+
+void prodikeys_sim_init(struct prodikeys_sim *sim, struct pcmidi_snd *pm, uint32_t seed){
+    memset((void *) sim, 0, sizeof(struct prodikeys_sim));
+    sim->pm = pm;
+    sim->rng = seed != 0 ? seed : 0x2801;
+    pm->sim = sim;
+}
+
+bool prodikeys_sim_command(struct prodikeys_sim *sim, uint8_t byte){
+    if (byte < 0xC1 || byte > 0xC6) return false;
+    if (byte == 0xC3 || byte == 0xC4){
+        if (sim->num_replies == PRODIKEYS_SIM_REPLIES) return false;
+        sim->replies[sim->num_replies++] = byte;
+    }
+    if (byte == 0xC1 || byte == 0xC2) sim->piano_keys = byte == 0xC1;
+    if (byte == 0xC5 || byte == 0xC6) sim->fn_led = byte == 0xC5;
+    sim->commands[byte - 0xC1]++;
+    return true;
+}
+
+void prodikeys_sim_next(struct prodikeys_sim *sim, struct prodikeys_report *report){
+    if (sim->head == sim->tail)
+        prodikeys_sim_phrase(sim);
+
+    //a query is answered on the next interrupt IN poll, ahead of anything played later than that
+    if (sim->num_replies > 0 && sim->queue[sim->head].due_ns >= sim->now_ns + PRODIKEYS_SIM_MS){
+        const uint8_t *reply = sim->replies[0] == 0xC3 ? prodikeys_sim_c3 : prodikeys_sim_c4;
+        memmove(sim->replies, sim->replies + 1, --sim->num_replies);
+        sim->now_ns += PRODIKEYS_SIM_MS;
+        memcpy(report->data, reply, sizeof(prodikeys_sim_c3));
+        report->length = sizeof(prodikeys_sim_c3);
+    } else {
+        struct prodikeys_sim_event *event = &sim->queue[sim->head++];
+        sim->now_ns = event->due_ns;
+        memcpy(report->data, event->data, event->length);
+        report->length = event->length;
+    }
+    report->timestamp_ns = sim->now_ns;
+}
+
+void prodikeys_sim_release(struct prodikeys_sim *sim, struct prodikeys_report *report){
+    memset(report->data, 0, PRODIKEYS_REPORT_SIZE);
+    report->data[0] = 0x03;
+    report->length = 1;
+    report->timestamp_ns = sim->now_ns;
+    for (unsigned physical = 0; physical < PCMIDI_PHYSICAL_KEYS && report->length + 2 <= PRODIKEYS_REPORT_SIZE; physical++){
+        if (!(sim->held[physical >> 5] & (1u << (physical & 31)))) continue;
+        report->data[report->length++] = (uint8_t) (physical + 0x40);
+        report->data[report->length++] = 0;
+    }
+    if (report->length == 1)
+        report->length = 0;
+}
+
+/* Keys count as held once their report is handed over, not when it is made up : a release due after the end was never played */
+void prodikeys_sim_played(struct prodikeys_sim *sim, const struct prodikeys_report *report){
+    if (report->data[0] < PRODIKEYS_SIM_REPORT_IDS)
+        sim->reports[report->data[0]]++;
+    if (report->data[0] == 0x03){
+        for (int i = 1; i + 1 < report->length; i += 2){
+            uint8_t key = report->data[i];
+            unsigned physical = key < 0x81 ? key : key - 0x40u;
+            if (key < 0x81) sim->held[physical >> 5] |= 1u << (physical & 31);
+            else sim->held[physical >> 5] &= ~(1u << (physical & 31));
+            sim->notes++;
+        }
+    }
+}
+
+/* Hand a report to the decoder of its device, as prodikeys_trace_replay does */
+static void prodikeys_sim_dispatch(struct prodikeys_sim *sim, uint8_t device, struct prodikeys_report *report,
+                                   struct prodikeys_trace *capture, struct prodikeys_replay_stats *stats){
+    prodikeys_sim_played(sim, report);
+    prodikeys_trace_write(capture, device, report);
+    report->timestamp_ns = prodikeys_now_ns();
+    pcmidi_handle_report(sim->pm, report);
+    uint64_t latency = prodikeys_now_ns() - report->timestamp_ns;
+    prodikeys_stats_stage(PRODIKEYS_STAGE_TOTAL, latency);
+    prodikeys_hist_record(&sim->latency, latency);
+    stats->latency_total_ns += latency;
+    if (latency > stats->latency_max_ns) stats->latency_max_ns = latency;
+    stats->reports++;
+}
+
+void prodikeys_sim_run(struct prodikeys_sim *sims, int num_sims, uint64_t duration_ns, struct prodikeys_trace *capture,
+                       const volatile bool *running, struct prodikeys_replay_stats *stats, struct prodikeys_sim_stats *sim_stats){
+    static struct prodikeys_report next[PRODIKEYS_MAX_DEVICES];
+    uint64_t start_ns = prodikeys_now_ns();
+    uint64_t played_ns = 0;
+
+    memset(stats, 0, sizeof(struct prodikeys_replay_stats));
+    memset(sim_stats, 0, sizeof(struct prodikeys_sim_stats));
+    if (num_sims > PRODIKEYS_MAX_DEVICES) num_sims = PRODIKEYS_MAX_DEVICES;
+    for (int i = 0; i < num_sims; i++)
+        prodikeys_sim_next(&sims[i], &next[i]);
+
+    //keyboards are played together, their reports merged in virtual time order
+    while (*running){
+        int first = -1;
+        for (int i = 0; i < num_sims; i++)
+            if (first < 0 || next[i].timestamp_ns < next[first].timestamp_ns) first = i;
+        if (first < 0 || next[first].timestamp_ns > duration_ns) break;
+        played_ns = next[first].timestamp_ns;
+        prodikeys_sim_dispatch(&sims[first], (uint8_t) first, &next[first], capture, stats);
+        prodikeys_sim_next(&sims[first], &next[first]);
+    }
+
+    //hands lifted at the end of the performance
+    if (*running) played_ns = duration_ns;
+    sim_stats->played_ns = played_ns;
+    for (int i = 0; i < num_sims; i++){
+        struct prodikeys_sim *sim = &sims[i];
+        struct prodikeys_report release;
+        prodikeys_sim_release(sim, &release);
+        release.timestamp_ns = played_ns;
+        if (release.length > 0)
+            prodikeys_sim_dispatch(sim, (uint8_t) i, &release, capture, stats);
+
+        bool held = false;
+        for (int word = 0; word < PCMIDI_PHYSICAL_KEYS / 32; word++)
+            if (sim->pm->held[word] != 0) held = true;
+        if (held || sim->fn_led != sim->pm->fn_state || sim->piano_keys != sim->pm->midi_mode)
+            sim_stats->mismatches++;
+        for (int id = 0; id < PRODIKEYS_SIM_REPORT_IDS; id++)
+            sim_stats->reports[id] += sim->reports[id];
+        for (int command = 0; command < 6; command++)
+            sim_stats->commands[command] += sim->commands[command];
+        sim_stats->notes += sim->notes;
+    }
+    stats->elapsed_ns = prodikeys_now_ns() - start_ns;
+}
@@ -0,0 +1,114 @@
+/* Prodikeys MIDI Interface - simulated keyboard
+ * Copyright 2020, CrazyRedMachine
+ *
+ * A Prodikeys played by a pseudo random performer, for testing and benchmarking without a keyboard.
+ * It produces the reports a keyboard would on its interrupt IN endpoint : chords and glissandi (report 3),
+ * volume wheel spins and the octave down button (report 1), the sleep key (report 2), FN and octave up buttons
+ * (report 4). It answers the report id 6 commands of its device (prodikeys_send_hid_data) : C1/C2 turn its
+ * piano keys on and off, C5/C6 its FN led, and C3/C4 get their report id 5 reply with the next report.
+ *
+ * The performance runs on a virtual clock : report timestamps are those the keyboard would have given, but
+ * reports are handed to the decoder as fast as it takes them, so a minute of playing goes through in milliseconds.
+ * The same seed always plays the same performance. Buttons launching applications are never pressed.
+ */
+#pragma once
+#include <stdint.h>
+#include "prodikeys-core.h"
+#include "prodikeys-stats.h"
+#include "prodikeys-trace.h"
+
+#define PRODIKEYS_SIM_QUEUE 64          // reports of the phrase being played, a glissando is the longest
+#define PRODIKEYS_SIM_REPLIES 4         // report 5 replies owed at most, more C3/C4 are dropped
+#define PRODIKEYS_SIM_KEY_LOW 0x48      // note on code of the lowest key (C3 at octave 0)
+#define PRODIKEYS_SIM_KEYS 37           // keys up to C6
+#define PRODIKEYS_SIM_REPORT_IDS 6      // report ids 1 to 5 are produced
+
+//A report due at a given virtual time
+struct prodikeys_sim_event {
+    uint64_t            due_ns;
+    uint8_t             length;
+    uint8_t             data[PRODIKEYS_REPORT_SIZE];
+};
+
+//A simulated keyboard
+struct prodikeys_sim {
+    struct pcmidi_snd   *pm;                // device the keyboard is attached to
+    uint32_t            rng;                // xorshift state
+    uint64_t            now_ns;             // virtual clock, due time of the last report taken
+    uint64_t            free_ns;            // when the phrase being played is over
+    uint64_t            unplug_ns;          // virtual time the keyboard is unplugged at when read through a read ring, 0 for never
+    struct prodikeys_sim_event queue[PRODIKEYS_SIM_QUEUE];  // phrase being played, in due order
+    int                 head;               // next report of the phrase
+    int                 tail;               // reports of the phrase
+    uint8_t             replies[PRODIKEYS_SIM_REPLIES];     // C3/C4 commands waiting for their report 5
+    int                 num_replies;
+    uint32_t            held[PCMIDI_PHYSICAL_KEYS / 32];    // keys whose press was played and not their release yet
+    bool                piano_keys;         // last C1 (true) or C2 (false) received
+    bool                fn_led;             // last C5 (true) or C6 (false) received
+    unsigned long       reports[PRODIKEYS_SIM_REPORT_IDS];  // reports played, by report id
+    unsigned long       commands[6];        // C1 to C6 received
+    unsigned long       notes;              // key presses and releases played
+    struct prodikeys_histogram latency;     // report handed to the decoder to handled, for this keyboard alone
+};
+
+//Outcome of a simulation, on top of the prodikeys_replay_stats of the decoder
+struct prodikeys_sim_stats {
+    uint64_t            played_ns;          // virtual time played
+    unsigned long       reports[PRODIKEYS_SIM_REPORT_IDS];  // reports played by every keyboard, by report id
+    unsigned long       commands[6];        // C1 to C6 received by every keyboard
+    unsigned long       notes;              // key presses and releases
+    unsigned long       mismatches;         // keyboards whose FN led or piano keys disagree with their device at the end,
+                                            // or with notes still held
+};
+
+/**
+ * Plug a simulated keyboard into a device : the device commands go to the keyboard from now on (pm->offline must be set)
+ * @param sim the keyboard
+ * @param pm the device
+ * @param seed performance seed, any value
+ */
+void prodikeys_sim_init(struct prodikeys_sim *sim, struct pcmidi_snd *pm, uint32_t seed);
+
+/**
+ * A command written to report id 6 of a simulated keyboard
+ * @param sim the keyboard
+ * @param byte the command byte (C1 to C6)
+ * @return true iff the keyboard took it
+ */
+bool prodikeys_sim_command(struct prodikeys_sim *sim, uint8_t byte);
+
+/**
+ * Next report of a simulated keyboard, made up as the performance goes. Advances its virtual clock.
+ * Only the report length is written, as by a transfer : the rest of the report slot is left as it was.
+ * @param sim the keyboard
+ * @param report receives the report, timestamp_ns being its virtual due time
+ */
+void prodikeys_sim_next(struct prodikeys_sim *sim, struct prodikeys_report *report);
+
+/**
+ * Account for a report of a simulated keyboard handed to its decoder (report counts, keys held)
+ * @param sim the keyboard
+ * @param report a report from prodikeys_sim_next or prodikeys_sim_release
+ */
+void prodikeys_sim_played(struct prodikeys_sim *sim, const struct prodikeys_report *report);
+
+/**
+ * Report releasing every key still held, as the performer lifting their hands at the end
+ * @param sim the keyboard
+ * @param report receives the release report (length 0 if no key was held)
+ */
+void prodikeys_sim_release(struct prodikeys_sim *sim, struct prodikeys_report *report);
+
+/**
+ * Play simulated keyboards for a virtual duration, every report going to pcmidi_handle_report() of its device
+ * from the calling thread, in virtual time order and as fast as possible.
+ * @param sims the keyboards (initialized), keyboard n being trace device n
+ * @param num_sims number of keyboards
+ * @param duration_ns virtual time to play
+ * @param capture trace every report is appended to with its virtual timestamp, or NULL
+ * @param running simulation stops as soon as it becomes false
+ * @param stats decoder outcome, as for a trace replay
+ * @param sim_stats keyboards outcome
+ */
+void prodikeys_sim_run(struct prodikeys_sim *sims, int num_sims, uint64_t duration_ns, struct prodikeys_trace *capture,
+                       const volatile bool *running, struct prodikeys_replay_stats *stats, struct prodikeys_sim_stats *sim_stats);
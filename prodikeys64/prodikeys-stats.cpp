@@ -0,0 +1,200 @@
+/* Prodikeys MIDI Interface - pipeline statistics
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "prodikeys-core.h"
+#include "prodikeys-stats.h"
+
+struct prodikeys_stats prodikeys_stats;
+
+static const char *prodikeys_stage_names[PRODIKEYS_STAGES] = {"decode", "sink", "total", "command", "lateness", "output", "midi_toggle", "buttons", "action", "replug"};
+static const char *prodikeys_transfer_names[LIBUSB_TRANSFER_OVERFLOW + 1] = {
+        "completed", "error", "timed_out", "cancelled", "stall", "no_device", "overflow"};
+
+/* Position of the highest bit set, v must not be 0 */
+static inline int prodikeys_msb(uint64_t v){
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, v);
+    return (int) index;
+#else
+    return 63 - __builtin_clzll(v);
+#endif
+}
+
+static inline int prodikeys_hist_bucket(uint64_t v){
+    if (v < (1 << PRODIKEYS_HIST_SUB_BITS)) return (int) v;
+    int msb = prodikeys_msb(v);
+    int sub = (int) (v >> (msb - PRODIKEYS_HIST_SUB_BITS)) & ((1 << PRODIKEYS_HIST_SUB_BITS) - 1);
+    return ((msb - PRODIKEYS_HIST_SUB_BITS + 1) << PRODIKEYS_HIST_SUB_BITS) + sub;
+}
+
+static uint64_t prodikeys_hist_bucket_max(int bucket){
+    if (bucket < (1 << PRODIKEYS_HIST_SUB_BITS)) return (uint64_t) bucket;
+    int msb = (bucket >> PRODIKEYS_HIST_SUB_BITS) + PRODIKEYS_HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t) (bucket & ((1 << PRODIKEYS_HIST_SUB_BITS) - 1));
+    uint64_t width = (uint64_t) 1 << (msb - PRODIKEYS_HIST_SUB_BITS);
+    return (((uint64_t) 1 << PRODIKEYS_HIST_SUB_BITS) + sub) * width + (width - 1);
+}
+
+void prodikeys_hist_record(struct prodikeys_histogram *hist, uint64_t ns){
+    hist->buckets[prodikeys_hist_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    hist->count.fetch_add(1, std::memory_order_relaxed);
+    hist->sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = hist->max_ns.load(std::memory_order_relaxed);
+    while (ns > max && !hist->max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+}
+
+uint64_t prodikeys_hist_percentile(const struct prodikeys_histogram *hist, double fraction){
+    uint64_t count = hist->count.load(std::memory_order_relaxed);
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t) (fraction * (double) count);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < PRODIKEYS_HIST_BUCKETS; bucket++){
+        seen += hist->buckets[bucket].load(std::memory_order_relaxed);
+        if (seen >= rank){
+            //never report more than the actual maximum
+            uint64_t max = hist->max_ns.load(std::memory_order_relaxed);
+            uint64_t value = prodikeys_hist_bucket_max(bucket);
+            return value < max ? value : max;
+        }
+    }
+    return hist->max_ns.load(std::memory_order_relaxed);
+}
+
+void prodikeys_stats_reset(){
+    for (int stage = 0; stage < PRODIKEYS_STAGES; stage++){
+        struct prodikeys_histogram *hist = &prodikeys_stats.stages[stage];
+        for (int bucket = 0; bucket < PRODIKEYS_HIST_BUCKETS; bucket++)
+            hist->buckets[bucket] = 0;
+        hist->count = 0;
+        hist->sum_ns = 0;
+        hist->max_ns = 0;
+    }
+    for (int id = 0; id < PRODIKEYS_STATS_REPORT_IDS; id++)
+        prodikeys_stats.reports[id] = 0;
+    prodikeys_stats.notes = 0;
+    prodikeys_stats.notes_out_of_range = 0;
+    prodikeys_stats.sink_calls = 0;
+    prodikeys_stats.sink_errors = 0;
+    for (int status = 0; status <= LIBUSB_TRANSFER_OVERFLOW; status++)
+        prodikeys_stats.transfers[status] = 0;
+    for (int error = 0; error < PRODIKEYS_STATS_ERRORS; error++)
+        prodikeys_stats.errors[error] = 0;
+    prodikeys_stats.output_dropped = 0;
+    prodikeys_stats.output_coalesced = 0;
+    prodikeys_stats.output_blocked = 0;
+    prodikeys_stats.output_max_depth = 0;
+    prodikeys_stats.actions_dropped = 0;
+    prodikeys_stats.read_backoffs = 0;
+    prodikeys_stats.halts_cleared = 0;
+    prodikeys_stats.reads_lost = 0;
+    prodikeys_stats.ready_ns = 0;
+    prodikeys_stats.started_ns = prodikeys_now_ns();
+}
+
+void prodikeys_stats_ready(){
+    uint64_t expected = 0;
+    uint64_t ready_ns = prodikeys_now_ns() - prodikeys_stats.started_ns;
+    prodikeys_stats.ready_ns.compare_exchange_strong(expected, ready_ns != 0 ? ready_ns : 1, std::memory_order_relaxed);
+}
+
+/* snprintf at the end of what was already written, never past size */
+#define PRODIKEYS_JSON(...) do { \
+        if (len < (int) size) { \
+            int res = snprintf(buffer + len, size - len, __VA_ARGS__); \
+            if (res > 0) len += res; \
+        } \
+    } while (0)
+
+int prodikeys_stats_json(char *buffer, size_t size){
+    static uint64_t prev_ns = 0;
+    static unsigned long prev_reports[PRODIKEYS_STATS_REPORT_IDS];
+    int len = 0;
+    if (size == 0) return 0;
+    buffer[0] = 0;
+
+    uint64_t now = prodikeys_now_ns();
+    if (prev_ns == 0 || prev_ns < prodikeys_stats.started_ns){
+        prev_ns = prodikeys_stats.started_ns;
+        memset(prev_reports, 0, sizeof(prev_reports));
+    }
+    double interval = (double) (now - prev_ns) / 1e9;
+
+    PRODIKEYS_JSON("{\n  \"uptime_s\": %.3f,\n  \"interval_s\": %.3f,\n",
+                   (double) (now - prodikeys_stats.started_ns) / 1e9, interval);
+    //launch to first keyboard ready, null while none is
+    uint64_t ready_ns = prodikeys_stats.ready_ns.load(std::memory_order_relaxed);
+    if (ready_ns != 0)
+        PRODIKEYS_JSON("  \"ready_us\": %.1f,\n", (double) ready_ns / 1000);
+    else
+        PRODIKEYS_JSON("  \"ready_us\": null,\n");
+
+    PRODIKEYS_JSON("  \"reports\": {");
+    for (int id = 0; id < PRODIKEYS_STATS_REPORT_IDS; id++){
+        unsigned long count = prodikeys_stats.reports[id].load(std::memory_order_relaxed);
+        PRODIKEYS_JSON("%s\n    \"%d\": {\"count\": %lu, \"per_second\": %.1f}", id == 0 ? "" : ",", id, count,
+                       interval > 0 ? (double) (count - prev_reports[id]) / interval : 0.0);
+        prev_reports[id] = count;
+    }
+    PRODIKEYS_JSON("\n  },\n");
+
+    PRODIKEYS_JSON("  \"notes\": %lu,\n  \"notes_out_of_range\": %lu,\n  \"sink_calls\": %lu,\n  \"sink_errors\": %lu,\n",
+                   prodikeys_stats.notes.load(std::memory_order_relaxed),
+                   prodikeys_stats.notes_out_of_range.load(std::memory_order_relaxed),
+                   prodikeys_stats.sink_calls.load(std::memory_order_relaxed),
+                   prodikeys_stats.sink_errors.load(std::memory_order_relaxed));
+
+    PRODIKEYS_JSON("  \"output\": {\"dropped\": %lu, \"coalesced\": %lu, \"blocked\": %lu, \"max_depth\": %llu},\n",
+                   prodikeys_stats.output_dropped.load(std::memory_order_relaxed),
+                   prodikeys_stats.output_coalesced.load(std::memory_order_relaxed),
+                   prodikeys_stats.output_blocked.load(std::memory_order_relaxed),
+                   (unsigned long long) prodikeys_stats.output_max_depth.load(std::memory_order_relaxed));
+    PRODIKEYS_JSON("  \"actions_dropped\": %lu,\n", prodikeys_stats.actions_dropped.load(std::memory_order_relaxed));
+    PRODIKEYS_JSON("  \"reads\": {\"backoffs\": %lu, \"halts_cleared\": %lu, \"lost\": %lu},\n",
+                   prodikeys_stats.read_backoffs.load(std::memory_order_relaxed),
+                   prodikeys_stats.halts_cleared.load(std::memory_order_relaxed),
+                   prodikeys_stats.reads_lost.load(std::memory_order_relaxed));
+
+    PRODIKEYS_JSON("  \"latency_us\": {");
+    for (int stage = 0; stage < PRODIKEYS_STAGES; stage++){
+        const struct prodikeys_histogram *hist = &prodikeys_stats.stages[stage];
+        uint64_t count = hist->count.load(std::memory_order_relaxed);
+        PRODIKEYS_JSON("%s\n    \"%s\": {\"count\": %llu, \"avg\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+                       stage == 0 ? "" : ",", prodikeys_stage_names[stage], (unsigned long long) count,
+                       count > 0 ? (double) hist->sum_ns.load(std::memory_order_relaxed) / (double) count / 1000 : 0.0,
+                       (double) prodikeys_hist_percentile(hist, 0.50) / 1000,
+                       (double) prodikeys_hist_percentile(hist, 0.99) / 1000,
+                       (double) hist->max_ns.load(std::memory_order_relaxed) / 1000);
+    }
+    PRODIKEYS_JSON("\n  },\n");
+
+    //timeouts are the timed_out transfers
+    PRODIKEYS_JSON("  \"transfers\": {");
+    for (int status = 0; status <= LIBUSB_TRANSFER_OVERFLOW; status++)
+        PRODIKEYS_JSON("%s\"%s\": %lu", status == 0 ? "" : ", ", prodikeys_transfer_names[status],
+                       prodikeys_stats.transfers[status].load(std::memory_order_relaxed));
+    PRODIKEYS_JSON("},\n");
+
+    PRODIKEYS_JSON("  \"errors\": {");
+    bool first = true;
+    for (int error = 1; error < PRODIKEYS_STATS_ERRORS; error++){
+        unsigned long count = prodikeys_stats.errors[error].load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        PRODIKEYS_JSON("%s\"%s\": %lu", first ? "" : ", ",
+                       error == PRODIKEYS_STATS_ERRORS - 1 ? "LIBUSB_ERROR_OTHER" : libusb_error_name(-error), count);
+        first = false;
+    }
+    PRODIKEYS_JSON("}\n}\n");
+
+    prev_ns = now;
+    return len < (int) size ? len : (int) size - 1;
+}
@@ -0,0 +1,137 @@
+/* Prodikeys MIDI Interface - pipeline statistics
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Process wide latency histograms and counters, updated with relaxed atomics from the reading threads
+ * and readable at any time from another thread. Cheap enough to be always on.
+ *
+ * Stages of a report :
+ *   transfer complete (prodikeys_report.timestamp_ns)
+ *     -> decode done (first MIDI message of the report ready)     PRODIKEYS_STAGE_DECODE
+ *     -> sink accepted (pcmidi_port_send returned, per call)      PRODIKEYS_STAGE_SINK
+ *     -> report handled (last message accepted)                   PRODIKEYS_STAGE_TOTAL
+ *   report 6 command submitted -> acknowledged                    PRODIKEYS_STAGE_COMMAND
+ *   replayed report due -> dispatched (timed trace replay)        PRODIKEYS_STAGE_LATENESS
+ *   transfer complete -> written by the output thread             PRODIKEYS_STAGE_OUTPUT
+ *   piano key handled (MIDI mode enabled or disabled)             PRODIKEYS_STAGE_MIDI_TOGGLE
+ *   report 1/2/4 handled by the reading thread                    PRODIKEYS_STAGE_BUTTONS
+ *   launch or key injection queued -> done by the executor        PRODIKEYS_STAGE_ACTION
+ *   keyboard replugged -> first note accepted by the sink         PRODIKEYS_STAGE_REPLUG
+ */
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "libusb-1.0/libusb.h"
+
+//Log-linear histogram buckets (HDR style) : values below 2^SUB_BITS get their own bucket,
+//above that every power of two is split in 2^SUB_BITS buckets, so any value is known within 12.5%
+#define PRODIKEYS_HIST_SUB_BITS 3
+#define PRODIKEYS_HIST_BUCKETS ((64 - PRODIKEYS_HIST_SUB_BITS + 1) << PRODIKEYS_HIST_SUB_BITS)
+#define PRODIKEYS_STATS_REPORT_IDS 8        // report ids 1 to 6 are used, anything else is counted as 0
+#define PRODIKEYS_STATS_ERRORS 16           // libusb error codes -1 to -12, anything else is counted as 15
+
+enum prodikeys_stage {
+    PRODIKEYS_STAGE_DECODE,     // transfer complete to decode done
+    PRODIKEYS_STAGE_SINK,       // time spent in one MIDI port send
+    PRODIKEYS_STAGE_TOTAL,      // transfer complete to report handled
+    PRODIKEYS_STAGE_COMMAND,    // report 6 command write
+    PRODIKEYS_STAGE_LATENESS,   // scheduling delay of a timed replay, i.e. wakeup jitter of the decoding thread
+    PRODIKEYS_STAGE_OUTPUT,     // transfer complete to batch accepted by the port, through the output thread ring
+    PRODIKEYS_STAGE_MIDI_TOGGLE,    // time taken to enable or disable MIDI mode, the note path is held up meanwhile
+    PRODIKEYS_STAGE_BUTTONS,    // function button report handling, i.e. how long buttons stall the reading thread
+    PRODIKEYS_STAGE_ACTION,     // slow button action queued to done, on the executor thread
+    PRODIKEYS_STAGE_REPLUG,     // replugged keyboard attached up to its first note handed to the port (replug benchmark)
+    PRODIKEYS_STAGES
+};
+
+struct prodikeys_histogram {
+    std::atomic<uint32_t>   buckets[PRODIKEYS_HIST_BUCKETS];
+    std::atomic<uint64_t>   count;
+    std::atomic<uint64_t>   sum_ns;
+    std::atomic<uint64_t>   max_ns;
+};
+
+struct prodikeys_stats {
+    uint64_t                    started_ns;                             // prodikeys_now_ns() at reset
+    struct prodikeys_histogram  stages[PRODIKEYS_STAGES];
+    std::atomic<unsigned long>  reports[PRODIKEYS_STATS_REPORT_IDS];    // reports decoded, by report id
+    std::atomic<unsigned long>  notes;                                  // note on/off messages sent
+    std::atomic<unsigned long>  notes_out_of_range;                     // keys dropped as the octave put them outside MIDI notes
+    std::atomic<unsigned long>  sink_calls;                             // MIDI port sends
+    std::atomic<unsigned long>  sink_errors;                            // MIDI port sends which failed
+    std::atomic<unsigned long>  transfers[LIBUSB_TRANSFER_OVERFLOW + 1];// transfers completed, by libusb_transfer_status
+    std::atomic<unsigned long>  errors[PRODIKEYS_STATS_ERRORS];         // libusb calls failed, by -libusb_error
+    std::atomic<unsigned long>  output_dropped;                         // MIDI messages dropped on a full output ring
+    std::atomic<unsigned long>  output_coalesced;                       // pitch bends merged on a full output ring
+    std::atomic<unsigned long>  output_blocked;                         // pushes which waited for room in an output ring
+    std::atomic<uint64_t>       output_max_depth;                       // deepest output ring seen
+    std::atomic<unsigned long>  actions_dropped;                        // launches and key injections dropped on a full executor queue
+    std::atomic<unsigned long>  read_backoffs;                          // failed reads rearmed after a backoff
+    std::atomic<unsigned long>  halts_cleared;                          // stalled interrupt endpoints cleared
+    std::atomic<unsigned long>  reads_lost;                             // keyboards given up as their reads failed for good
+    std::atomic<uint64_t>       ready_ns;                               // reset (launch) to the first keyboard ready to play, 0 until then
+};
+
+extern struct prodikeys_stats prodikeys_stats;
+
+/**
+ * Clear every histogram and counter and restart the uptime
+ */
+void prodikeys_stats_reset();
+
+/**
+ * Record a value in a histogram
+ * @param hist the histogram
+ * @param ns measured time in nanoseconds
+ */
+void prodikeys_hist_record(struct prodikeys_histogram *hist, uint64_t ns);
+
+/**
+ * Value below which a given fraction of the recorded values fall
+ * @param hist the histogram
+ * @param fraction 0.5 for the median, 0.99 for p99...
+ * @return upper bound of the matching bucket in nanoseconds (the exact maximum for the last one), 0 if empty
+ */
+uint64_t prodikeys_hist_percentile(const struct prodikeys_histogram *hist, double fraction);
+
+/**
+ * Record the duration of a pipeline stage
+ * @param stage the stage
+ * @param ns duration in nanoseconds
+ */
+static inline void prodikeys_stats_stage(enum prodikeys_stage stage, uint64_t ns){
+    prodikeys_hist_record(&prodikeys_stats.stages[stage], ns);
+}
+
+/**
+ * Note that a keyboard is ready to play (attached, port open, being read). Only the first call after a reset counts,
+ * giving the time to ready of the launch.
+ */
+void prodikeys_stats_ready();
+
+/**
+ * Count a completed libusb transfer
+ * @param status the transfer status
+ */
+static inline void prodikeys_stats_transfer(enum libusb_transfer_status status){
+    if (status >= LIBUSB_TRANSFER_COMPLETED && status <= LIBUSB_TRANSFER_OVERFLOW)
+        prodikeys_stats.transfers[status].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Count a failed libusb call
+ * @param code libusb_error returned
+ */
+static inline void prodikeys_stats_error(int code){
+    int index = -code > 0 && -code < PRODIKEYS_STATS_ERRORS ? -code : PRODIKEYS_STATS_ERRORS - 1;
+    prodikeys_stats.errors[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Dump every histogram (count, average, p50, p99 and max in us) and counter as a JSON object.
+ * Rates are computed over the time since the previous dump, so dumps must not run concurrently.
+ * @param buffer receives the nul terminated JSON text
+ * @param size buffer size
+ * @return length of the text (truncated if it reaches size)
+ */
+int prodikeys_stats_json(char *buffer, size_t size);
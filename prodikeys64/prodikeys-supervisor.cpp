@@ -0,0 +1,114 @@
+/* Prodikeys MIDI Interface - reading threads supervisor
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <atomic>
+#include <system_error>
+#include <thread>
+#include "prodikeys-supervisor.h"
+
+//A keyboard slot reading thread
+struct prodikeys_supervised {
+    std::thread                 thread;
+    struct pcmidi_snd           *pm;        // keyboard the thread reads
+    std::atomic<bool>           stop;       // the slot is being stopped, its read ring must not run
+    std::atomic<bool>           started;    // the read ring is set up, it can be cancelled and woken from now on
+    struct prodikeys_reader     reader;
+};
+
+static struct {
+    struct prodikeys_supervisor_config  config;
+    struct prodikeys_supervised         slots[PRODIKEYS_MAX_DEVICES];
+    std::atomic<int>                    threads;
+} prodikeys_supervisor;
+
+/* The reading loop of a slot : keeps the read ring going until the keyboard is gone or the slot is stopped.
+ * libusb runs completion callbacks of every keyboard one at a time, so keyboards sharing a port never send concurrently */
+static void prodikeys_supervisor_run(int slot, struct pcmidi_snd *pm){
+    struct prodikeys_supervised *s = &prodikeys_supervisor.slots[slot];
+    const struct prodikeys_supervisor_config *config = &prodikeys_supervisor.config;
+
+    prodikeys_thread_realtime(&config->rt);
+    if (config->lock_memory) {
+        prodikeys_lock_memory(&s->reader, sizeof(struct prodikeys_reader));
+        prodikeys_lock_memory(pm, sizeof(struct pcmidi_snd));
+    }
+    if (prodikeys_reader_start(&s->reader, pm, config->read_transfers)) {
+        prodikeys_reader_capture(&s->reader, config->capture, (uint8_t) slot);
+        s->started = true;
+        //a stop requested while the ring was starting found it not cancellable yet
+        if (!s->stop)
+            prodikeys_reader_run(&s->reader);
+        prodikeys_reader_stop(&s->reader);
+    }
+    prodikeys_thread_default();
+    if (s->reader.disconnected && !s->stop && config->disconnected != NULL)
+        config->disconnected(slot);
+}
+
+void prodikeys_supervisor_init(const struct prodikeys_supervisor_config *config){
+    prodikeys_supervisor.config = *config;
+}
+
+bool prodikeys_supervisor_start(int slot, struct pcmidi_snd *pm){
+    struct prodikeys_supervised *s = &prodikeys_supervisor.slots[slot];
+    if (s->thread.joinable() || pm == NULL || (pm->handle == NULL && pm->sim == NULL)) return false;
+    s->stop = false;
+    s->started = false;
+    s->pm = pm;
+    try {
+        s->thread = std::thread(prodikeys_supervisor_run, slot, pm);
+    } catch (const std::system_error &) {
+        return false;
+    }
+    prodikeys_supervisor.threads++;
+    return true;
+}
+
+bool prodikeys_supervisor_request(int slot, enum prodikeys_request request){
+    struct prodikeys_supervised *s = &prodikeys_supervisor.slots[slot];
+    if (!s->thread.joinable()) return false;
+    s->pm->request = request;
+    //a ring not started yet takes it before it first waits
+    if (s->started) prodikeys_reader_wake(&s->reader);
+    return true;
+}
+
+/* Make a slot reading loop return, without waiting for it */
+static void prodikeys_supervisor_cancel(int slot){
+    struct prodikeys_supervised *s = &prodikeys_supervisor.slots[slot];
+    if (!s->thread.joinable()) return;
+    s->stop = true;
+    if (s->started) prodikeys_reader_cancel(&s->reader);
+}
+
+static void prodikeys_supervisor_join(int slot){
+    struct prodikeys_supervised *s = &prodikeys_supervisor.slots[slot];
+    if (!s->thread.joinable()) return;
+    s->thread.join();
+    prodikeys_supervisor.threads--;
+}
+
+void prodikeys_supervisor_stop(int slot){
+    prodikeys_supervisor_cancel(slot);
+    prodikeys_supervisor_join(slot);
+}
+
+void prodikeys_supervisor_stop_all(){
+    for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++)
+        prodikeys_supervisor_cancel(i);
+    for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++)
+        prodikeys_supervisor_join(i);
+}
+
+bool prodikeys_supervisor_active(int slot){
+    return prodikeys_supervisor.slots[slot].thread.joinable();
+}
+
+unsigned long prodikeys_supervisor_starved(int slot){
+    return prodikeys_supervisor.slots[slot].reader.starved.load(std::memory_order_relaxed);
+}
+
+int prodikeys_supervisor_threads(){
+    return prodikeys_supervisor.threads;
+}
@@ -0,0 +1,84 @@
+/* Prodikeys MIDI Interface - reading threads supervisor
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Owns the reading thread of every keyboard slot, each one running the slot read ring (prodikeys-usb.h) until its
+ * keyboard is unplugged or the slot is stopped. A slot never has more than one reading thread : starting a slot
+ * whose previous thread hasn't been joined yet fails. Stopping a slot cancels its read ring, which wakes libusb
+ * event handling even while the keyboard is idle, and joins the thread, so unplugging, replugging and exiting
+ * take milliseconds.
+ * Each keyboard has a libusb context of its own (pcmidi_snd::context), so that a reading thread only ever handles
+ * the events of its keyboard : the reads and commands of a keyboard complete on its reading thread alone.
+ * Slots are started and stopped from a single controlling thread at a time (the startup thread until the first
+ * keyboards are attached, then the UI thread).
+ */
+#pragma once
+#include "prodikeys-core.h"
+#include "prodikeys-os.h"
+#include "prodikeys-trace.h"
+#include "prodikeys-usb.h"
+
+//How reading threads are run
+struct prodikeys_supervisor_config {
+    int                         read_transfers;     // transfers kept in flight on each keyboard
+    struct prodikeys_rt_config  rt;                 // reading threads scheduling
+    bool                        lock_memory;        // keep the read rings and device structs resident
+    struct prodikeys_trace      *capture;           // trace every report read is appended to, or NULL
+    void                        (*disconnected)(int slot);  // called from a reading thread once its keyboard is unplugged
+};
+
+/**
+ * Set how the reading threads started from now on are run
+ * @param config reading threads configuration (copied)
+ */
+void prodikeys_supervisor_init(const struct prodikeys_supervisor_config *config);
+
+/**
+ * Start the reading thread of a slot
+ * @param slot keyboard slot (0 to PRODIKEYS_MAX_DEVICES - 1)
+ * @param pm the attached keyboard (handle must be valid, opened in pm->context), or an offline device with a
+ *           simulated keyboard plugged in
+ * @return true iff the thread was started, false if the slot still has one or it couldn't be created
+ */
+bool prodikeys_supervisor_start(int slot, struct pcmidi_snd *pm);
+
+/**
+ * Have the reading thread of a slot change its keyboard between two reports, so that only that thread ever writes to
+ * the device state and its output ring. Returns right away, a later request replacing one not taken yet.
+ * @param slot keyboard slot
+ * @param request change to make
+ * @return true iff the slot has a reading thread to take it
+ */
+bool prodikeys_supervisor_request(int slot, enum prodikeys_request request);
+
+/**
+ * Stop the reading thread of a slot and join it. Returns right away if the slot has none.
+ * The disconnected callback isn't called for a stopped thread.
+ * @param slot keyboard slot
+ */
+void prodikeys_supervisor_stop(int slot);
+
+/**
+ * Stop every reading thread, all of them being cancelled before the first one is joined
+ */
+void prodikeys_supervisor_stop_all();
+
+/**
+ * Whether a slot has a reading thread, running or ended but not joined yet
+ * @param slot keyboard slot
+ * @return true iff the slot can't be started
+ */
+bool prodikeys_supervisor_active(int slot);
+
+/**
+ * Read underruns of a slot : reports completed while no other read was queued on the endpoint, since its keyboard
+ * was attached. Can be read while the thread runs.
+ * @param slot keyboard slot
+ * @return underrun count, 0 for a slot which never had a keyboard
+ */
+unsigned long prodikeys_supervisor_starved(int slot);
+
+/**
+ * Number of reading threads started and not joined yet
+ * @return thread count
+ */
+int prodikeys_supervisor_threads();
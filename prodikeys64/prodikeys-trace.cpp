@@ -0,0 +1,184 @@
+/* Prodikeys MIDI Interface - HID report traces
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "prodikeys-trace.h"
+#include "prodikeys-stats.h"
+
+#define PRODIKEYS_TRACE_BUFFER 65536
+
+struct prodikeys_trace {
+    FILE    *file;
+    char    buffer[PRODIKEYS_TRACE_BUFFER];     // stdio buffer, the reading thread doesn't hit the disk on every report
+};
+
+struct prodikeys_trace *prodikeys_trace_create(const char *path){
+    struct prodikeys_trace *trace = static_cast<prodikeys_trace *>(malloc(sizeof(struct prodikeys_trace)));
+    if (trace == NULL) return NULL;
+    trace->file = fopen(path, "wb");
+    if (trace->file == NULL){
+        free(trace);
+        return NULL;
+    }
+    setvbuf(trace->file, trace->buffer, _IOFBF, PRODIKEYS_TRACE_BUFFER);
+    fwrite(PRODIKEYS_TRACE_MAGIC, 1, PRODIKEYS_TRACE_MAGIC_SIZE, trace->file);
+    return trace;
+}
+
+void prodikeys_trace_write(struct prodikeys_trace *trace, uint8_t device, const struct prodikeys_report *report){
+    uint8_t record[PRODIKEYS_TRACE_RECORD_HEADER + PRODIKEYS_REPORT_SIZE];
+    if (trace == NULL || report->length <= 0) return;
+
+    uint8_t length = (uint8_t) (report->length < PRODIKEYS_REPORT_SIZE ? report->length : PRODIKEYS_REPORT_SIZE);
+    for (int i = 0; i < 8; i++)
+        record[i] = (uint8_t) (report->timestamp_ns >> (8 * i));
+    record[8] = device;
+    record[9] = length;
+    memcpy(&record[PRODIKEYS_TRACE_RECORD_HEADER], report->data, length);
+    fwrite(record, 1, PRODIKEYS_TRACE_RECORD_HEADER + length, trace->file);
+}
+
+void prodikeys_trace_close(struct prodikeys_trace *trace){
+    if (trace == NULL) return;
+    fclose(trace->file);
+    free(trace);
+}
+
+bool prodikeys_trace_mmap(struct prodikeys_trace_map *map, const char *path){
+    memset(map, 0, sizeof(struct prodikeys_trace_map));
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < PRODIKEYS_TRACE_MAGIC_SIZE){
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL){
+        CloseHandle(file);
+        return false;
+    }
+    map->data = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (map->data == NULL){
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    map->size = (size_t) size.QuadPart;
+    map->mapping = mapping;
+    map->file = file;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < PRODIKEYS_TRACE_MAGIC_SIZE){
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); //the mapping keeps the file referenced
+    if (data == MAP_FAILED) return false;
+    madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+    map->data = static_cast<const uint8_t *>(data);
+    map->size = (size_t) st.st_size;
+#endif
+    if (memcmp(map->data, PRODIKEYS_TRACE_MAGIC, PRODIKEYS_TRACE_MAGIC_SIZE) != 0){
+        prodikeys_trace_munmap(map);
+        return false;
+    }
+    return true;
+}
+
+void prodikeys_trace_munmap(struct prodikeys_trace_map *map){
+    if (map->data == NULL) return;
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    munmap((void *) map->data, map->size);
+#endif
+    memset(map, 0, sizeof(struct prodikeys_trace_map));
+}
+
+/* Decode the record at offset into report, return the offset of the next record or 0 at the end of the trace */
+static size_t prodikeys_trace_next(const struct prodikeys_trace_map *map, size_t offset,
+                                   uint8_t *device, struct prodikeys_report *report){
+    if (offset + PRODIKEYS_TRACE_RECORD_HEADER > map->size) return 0;
+    const uint8_t *record = map->data + offset;
+    uint8_t length = record[9];
+    if (length > PRODIKEYS_REPORT_SIZE || offset + PRODIKEYS_TRACE_RECORD_HEADER + length > map->size) return 0;
+
+    report->timestamp_ns = 0;
+    for (int i = 0; i < 8; i++)
+        report->timestamp_ns |= (uint64_t) record[i] << (8 * i);
+    *device = record[8];
+    report->length = length;
+    memset(report->data, 0, PRODIKEYS_REPORT_SIZE);
+    memcpy(report->data, &record[PRODIKEYS_TRACE_RECORD_HEADER], length);
+    return offset + PRODIKEYS_TRACE_RECORD_HEADER + length;
+}
+
+int prodikeys_trace_devices(const struct prodikeys_trace_map *map){
+    struct prodikeys_report report;
+    uint8_t device;
+    int devices = 0;
+    for (size_t offset = PRODIKEYS_TRACE_MAGIC_SIZE; (offset = prodikeys_trace_next(map, offset, &device, &report)) != 0;)
+        if (device + 1 > devices) devices = device + 1;
+    return devices;
+}
+
+void prodikeys_trace_replay(const struct prodikeys_trace_map *map, struct pcmidi_snd **pm, int num_devices,
+                            bool timed, const volatile bool *running, struct prodikeys_replay_stats *stats){
+    struct prodikeys_report report;
+    uint8_t device;
+    uint64_t first_ns = 0;
+    uint64_t start_ns = prodikeys_now_ns();
+
+    memset(stats, 0, sizeof(struct prodikeys_replay_stats));
+    size_t offset = PRODIKEYS_TRACE_MAGIC_SIZE, next;
+    for (; *running && (next = prodikeys_trace_next(map, offset, &device, &report)) != 0; offset = next){
+        if (device >= num_devices || pm[device] == NULL){
+            stats->skipped++;
+            continue;
+        }
+
+        if (timed){
+            //reports are dispatched at their original distance from the first one
+            if (stats->reports == 0) first_ns = report.timestamp_ns;
+            uint64_t due = start_ns + (report.timestamp_ns - first_ns);
+            uint64_t now = prodikeys_now_ns();
+            if (due > now)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+            now = prodikeys_now_ns();
+            uint64_t lateness = now > due ? now - due : 0;
+            prodikeys_stats_stage(PRODIKEYS_STAGE_LATENESS, lateness);
+            if (lateness > stats->lateness_max_ns) stats->lateness_max_ns = lateness;
+        }
+
+        report.timestamp_ns = prodikeys_now_ns();
+        pcmidi_handle_report(pm[device], &report);
+        uint64_t latency = prodikeys_now_ns() - report.timestamp_ns;
+        prodikeys_stats_stage(PRODIKEYS_STAGE_TOTAL, latency);
+        stats->latency_total_ns += latency;
+        if (latency > stats->latency_max_ns) stats->latency_max_ns = latency;
+        stats->reports++;
+    }
+    if (*running && offset < map->size)
+        stats->skipped++; //truncated last record
+    stats->elapsed_ns = prodikeys_now_ns() - start_ns;
+}
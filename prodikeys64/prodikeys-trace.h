@@ -0,0 +1,97 @@
+/* Prodikeys MIDI Interface - HID report traces
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Raw interrupt IN reports can be captured to a trace file and later replayed through the decoder,
+ * so that performance problems can be reproduced without a keyboard plugged in.
+ *
+ * Trace file layout (little endian, no padding) :
+ *   "PKTRACE1"                          8 bytes file magic
+ *   then one record per report, in capture order :
+ *   uint64_t timestamp_ns               prodikeys_now_ns() when the transfer completed
+ *   uint8_t  device                     keyboard slot the report was read from
+ *   uint8_t  length                     report length (report id included)
+ *   uint8_t  data[length]               report id followed by report data
+ */
+#pragma once
+#include <stddef.h>
+#include "prodikeys-core.h"
+
+#define PRODIKEYS_TRACE_MAGIC "PKTRACE1"
+#define PRODIKEYS_TRACE_MAGIC_SIZE 8
+#define PRODIKEYS_TRACE_RECORD_HEADER 10    // timestamp, device and length
+
+struct prodikeys_trace;
+
+//A trace file mapped in memory for replay
+struct prodikeys_trace_map {
+    const uint8_t   *data;          // whole file, magic included
+    size_t          size;           // file size
+    void            *mapping;       // platform handles
+    void            *file;
+};
+
+//Outcome of a replay
+struct prodikeys_replay_stats {
+    unsigned long   reports;            // reports handed to the decoder
+    unsigned long   skipped;            // reports of devices without a slot, or truncated records
+    uint64_t        elapsed_ns;         // wall time of the whole replay
+    uint64_t        latency_total_ns;   // sum of dispatch to report handled times
+    uint64_t        latency_max_ns;     // worst dispatch to report handled time
+    uint64_t        lateness_max_ns;    // worst delay between original timing and dispatch (timed replay only)
+};
+
+/**
+ * Create a trace file and write its magic
+ * @param path file to create (overwritten if it exists)
+ * @return the capture trace, or NULL on error
+ */
+struct prodikeys_trace *prodikeys_trace_create(const char *path);
+
+/**
+ * Append a report to a capture trace. Records are written with a single buffered write,
+ * so several reading threads can share a trace.
+ * @param trace the capture trace, nothing is done if NULL
+ * @param device keyboard slot the report was read from
+ * @param report the received report (timestamp_ns must be set)
+ */
+void prodikeys_trace_write(struct prodikeys_trace *trace, uint8_t device, const struct prodikeys_report *report);
+
+/**
+ * Flush and close a capture trace
+ * @param trace the capture trace
+ */
+void prodikeys_trace_close(struct prodikeys_trace *trace);
+
+/**
+ * Map a trace file in memory, read only
+ * @param map the mapping to initialize
+ * @param path trace file
+ * @return true iff the file could be mapped and starts with the trace magic
+ */
+bool prodikeys_trace_mmap(struct prodikeys_trace_map *map, const char *path);
+
+/**
+ * Unmap a trace file
+ * @param map the mapping
+ */
+void prodikeys_trace_munmap(struct prodikeys_trace_map *map);
+
+/**
+ * Number of keyboard slots a mapped trace refers to
+ * @param map the mapped trace
+ * @return highest device slot found plus one, 0 for an empty trace
+ */
+int prodikeys_trace_devices(const struct prodikeys_trace_map *map);
+
+/**
+ * Feed every report of a mapped trace to pcmidi_handle_report() of its device, from the calling thread.
+ * Each report is copied to a report slot first, so the decoder never reads past a record.
+ * @param map the mapped trace
+ * @param pm devices indexed by trace device slot (NULL entries are skipped)
+ * @param num_devices size of the pm array
+ * @param timed true to keep the original spacing between reports, false to replay as fast as possible
+ * @param running replay stops as soon as it becomes false
+ * @param stats replay outcome
+ */
+void prodikeys_trace_replay(const struct prodikeys_trace_map *map, struct pcmidi_snd **pm, int num_devices,
+                            bool timed, const volatile bool *running, struct prodikeys_replay_stats *stats);
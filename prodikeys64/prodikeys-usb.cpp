@@ -0,0 +1,315 @@
+/* Prodikeys MIDI Interface - USB transport
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "prodikeys-usb.h"
+#include "prodikeys-sim.h"
+#include "prodikeys-stats.h"
+
+struct prodikeys_report *prodikeys_report_acquire(struct prodikeys_report_pool *pool){
+    if (pool->num_free == 0){
+        pool->exhausted++;
+        return NULL;
+    }
+    return &pool->slots[pool->free_slots[--pool->num_free]];
+}
+
+void prodikeys_report_release(struct prodikeys_report_pool *pool, struct prodikeys_report *report){
+    pool->free_slots[pool->num_free++] = (uint16_t) (report - pool->slots);
+}
+
+/* Slot a transfer is reading into */
+static struct prodikeys_report *prodikeys_transfer_report(struct libusb_transfer *transfer){
+    return reinterpret_cast<prodikeys_report *>(transfer->buffer - offsetof(struct prodikeys_report, data));
+}
+
+enum prodikeys_read_error prodikeys_read_status_error(enum libusb_transfer_status status){
+    switch (status){
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return PRODIKEYS_READ_IDLE;
+        case LIBUSB_TRANSFER_STALL:
+            return PRODIKEYS_READ_STALL;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return PRODIKEYS_READ_FATAL;
+        default:
+            return PRODIKEYS_READ_TRANSIENT;
+    }
+}
+
+enum prodikeys_read_error prodikeys_read_call_error(int error){
+    switch (error){
+        case LIBUSB_ERROR_TIMEOUT:
+            return PRODIKEYS_READ_IDLE;
+        case LIBUSB_ERROR_PIPE:
+            return PRODIKEYS_READ_STALL;
+        case LIBUSB_ERROR_NO_DEVICE:
+        case LIBUSB_ERROR_NOT_FOUND:
+        case LIBUSB_ERROR_ACCESS:
+        case LIBUSB_ERROR_INVALID_PARAM:
+        case LIBUSB_ERROR_NOT_SUPPORTED:
+            return PRODIKEYS_READ_FATAL;
+        default:
+            return PRODIKEYS_READ_TRANSIENT;
+    }
+}
+
+static int prodikeys_reader_index(struct prodikeys_reader *reader, struct libusb_transfer *transfer){
+    int i = 0;
+    while (reader->transfers[i] != transfer) i++;
+    return i;
+}
+
+static void prodikeys_reader_resubmit(struct prodikeys_reader *reader, struct libusb_transfer *transfer);
+
+/* Deal with a failed read : rearm it now, later, or give the keyboard up.
+ * Called from completion callbacks and from prodikeys_reader_service, both on the thread handling the events of the
+ * device context : a parked transfer is owned by prodikeys_reader_service */
+static void prodikeys_reader_failed(struct prodikeys_reader *reader, struct libusb_transfer *transfer,
+                                    enum prodikeys_read_error error){
+    if (error == PRODIKEYS_READ_IDLE){
+        prodikeys_reader_resubmit(reader, transfer);
+        return;
+    }
+
+    uint64_t now = prodikeys_now_ns();
+    int failures = reader->failures.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (failures == 1)
+        reader->failing_since_ns.store(now, std::memory_order_relaxed);
+    if (error == PRODIKEYS_READ_FATAL
+        || now - reader->failing_since_ns.load(std::memory_order_relaxed) > PRODIKEYS_READ_FAILING_MAX_NS){
+        if (reader->running) prodikeys_stats.reads_lost.fetch_add(1, std::memory_order_relaxed);
+        reader->running = false;
+        reader->disconnected = true;
+        return;
+    }
+    if (!reader->running) return;
+
+    //park it, prodikeys_reader_service rearms it once the backoff is over
+    if (error == PRODIKEYS_READ_STALL) reader->halted = true;
+    int shift = failures - 1 < 16 ? failures - 1 : 16;
+    uint64_t backoff = PRODIKEYS_READ_BACKOFF_MIN_NS << shift;
+    if (backoff > PRODIKEYS_READ_BACKOFF_MAX_NS) backoff = PRODIKEYS_READ_BACKOFF_MAX_NS;
+    reader->num_parked++;
+    reader->parked_ns[prodikeys_reader_index(reader, transfer)].store(now + backoff, std::memory_order_release);
+    reader->wakeup = 1; //the reading thread must not block in libusb without a timeout now
+    prodikeys_stats.read_backoffs.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void prodikeys_reader_resubmit(struct prodikeys_reader *reader, struct libusb_transfer *transfer){
+    if (!reader->running) return;
+    int res = libusb_submit_transfer(transfer);
+    if (res == 0) {
+        reader->in_flight++;
+        return;
+    }
+    prodikeys_stats_error(res);
+    prodikeys_reader_failed(reader, transfer, prodikeys_read_call_error(res));
+}
+
+/* Hand a completed report to the decoder and account for the time it took to get it out */
+static void prodikeys_reader_decode(struct prodikeys_reader *reader, struct prodikeys_report *report){
+    prodikeys_trace_write(reader->trace, reader->trace_device, report);
+    pcmidi_handle_report(reader->pm, report);
+    uint64_t latency = prodikeys_now_ns() - report->timestamp_ns;
+    prodikeys_stats_stage(PRODIKEYS_STAGE_TOTAL, latency);
+    reader->latency_total_ns += latency;
+    if (latency > reader->latency_max_ns) reader->latency_max_ns = latency;
+}
+
+static void LIBUSB_CALL prodikeys_reader_cb(struct libusb_transfer *transfer){
+    struct prodikeys_reader *reader = static_cast<prodikeys_reader *>(transfer->user_data);
+    struct prodikeys_report *report = prodikeys_transfer_report(transfer);
+
+    if (--reader->in_flight == 0 && reader->running)
+        reader->starved.fetch_add(1, std::memory_order_relaxed); //endpoint is left without any pending read until this one is resubmitted
+
+    prodikeys_stats_transfer(transfer->status);
+    switch (transfer->status){
+        case LIBUSB_TRANSFER_COMPLETED: {
+            //libusb completes transfers of a same endpoint in submission order, and callbacks all run
+            //from the event handling thread, so reports reach the decoder in the order they were read
+            reader->completed++;
+            reader->failures.store(0, std::memory_order_relaxed);
+            report->timestamp_ns = prodikeys_now_ns();
+            report->length = transfer->actual_length;
+
+            //rearm right away on a fresh slot, the completed one stays untouched until the decoder is done with it
+            struct prodikeys_report *next = prodikeys_report_acquire(&reader->pool);
+            if (next == NULL){
+                //pool exhausted, decode first then rearm on the same slot
+                prodikeys_reader_decode(reader, report);
+                break;
+            }
+            transfer->buffer = next->data;
+            prodikeys_reader_resubmit(reader, transfer);
+            prodikeys_reader_decode(reader, report);
+            prodikeys_report_release(&reader->pool, report);
+            return;
+        }
+        case LIBUSB_TRANSFER_CANCELLED:
+            return;
+        default:
+            prodikeys_reader_failed(reader, transfer, prodikeys_read_status_error(transfer->status));
+            return;
+    }
+
+    prodikeys_reader_resubmit(reader, transfer);
+}
+
+bool prodikeys_reader_start(struct prodikeys_reader *reader, struct pcmidi_snd *pm, int num_transfers){
+    memset((void *) reader, 0, sizeof(struct prodikeys_reader));
+    if (pm->handle == NULL && pm->sim == NULL) return false;
+
+    if (num_transfers < 1) num_transfers = 1;
+    if (num_transfers > PRODIKEYS_READ_TRANSFERS_MAX) num_transfers = PRODIKEYS_READ_TRANSFERS_MAX;
+
+    reader->pm = pm;
+    reader->running = true;
+    for (int i = 0; i < PRODIKEYS_REPORT_POOL_SIZE; i++)
+        reader->pool.free_slots[reader->pool.num_free++] = (uint16_t) (PRODIKEYS_REPORT_POOL_SIZE - 1 - i);
+    if (pm->handle == NULL){
+        reader->sim = pm->sim;
+        return true;
+    }
+
+    for (int i = 0; i < num_transfers; i++){
+        struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+        if (transfer == NULL) break;
+        reader->transfers[reader->num_transfers++] = transfer;
+        libusb_fill_interrupt_transfer(transfer, pm->handle, PRODIKEYS_ENDPOINT_IN,
+                                       prodikeys_report_acquire(&reader->pool)->data, PRODIKEYS_REPORT_SIZE,
+                                       prodikeys_reader_cb, reader, 0);
+        prodikeys_reader_resubmit(reader, transfer);
+    }
+
+    if (reader->in_flight == 0 && reader->num_parked == 0){
+        prodikeys_reader_stop(reader);
+        return false;
+    }
+    return true;
+}
+
+void prodikeys_reader_capture(struct prodikeys_reader *reader, struct prodikeys_trace *trace, uint8_t device){
+    reader->trace_device = device;
+    reader->trace = trace;
+}
+
+int prodikeys_reader_play(struct prodikeys_reader *reader){
+    struct prodikeys_report *report = prodikeys_report_acquire(&reader->pool);
+    if (report == NULL) return 0;
+    if (!reader->running){
+        prodikeys_report_release(&reader->pool, report);
+        return 0;
+    }
+    if (reader->sim->unplug_ns != 0 && reader->sim->now_ns >= reader->sim->unplug_ns){
+        //as a transfer completing with LIBUSB_TRANSFER_NO_DEVICE
+        reader->running = false;
+        reader->disconnected = true;
+        prodikeys_report_release(&reader->pool, report);
+        return 0;
+    }
+
+    prodikeys_sim_next(reader->sim, report);
+    prodikeys_sim_played(reader->sim, report);
+    int report_id = report->data[0];
+    reader->completed++;
+    report->timestamp_ns = prodikeys_now_ns();
+    prodikeys_reader_decode(reader, report);
+    prodikeys_report_release(&reader->pool, report);
+    return report_id;
+}
+
+uint64_t prodikeys_reader_service(struct prodikeys_reader *reader){
+    if (reader->num_parked == 0) return 0;
+
+    if (reader->halted.exchange(false) && reader->running){
+        int res = libusb_clear_halt(reader->pm->handle, PRODIKEYS_ENDPOINT_IN);
+        if (res == 0)
+            prodikeys_stats.halts_cleared.fetch_add(1, std::memory_order_relaxed);
+        else
+            prodikeys_stats_error(res);
+        if (res != 0 && prodikeys_read_call_error(res) == PRODIKEYS_READ_FATAL){
+            reader->running = false;
+            reader->disconnected = true;
+        }
+    }
+
+    uint64_t now = prodikeys_now_ns(), next = 0;
+    for (int i = 0; i < reader->num_transfers; i++){
+        uint64_t due = reader->parked_ns[i].load(std::memory_order_acquire);
+        if (due != 0 && (due <= now || !reader->running)){
+            reader->parked_ns[i].store(0, std::memory_order_relaxed);
+            reader->num_parked--;
+            prodikeys_reader_resubmit(reader, reader->transfers[i]);   //parks it again if it fails right away
+            due = reader->parked_ns[i].load(std::memory_order_relaxed);
+        }
+        if (due == 0) continue;
+        due = due > now ? due - now : 1;
+        if (next == 0 || due < next) next = due;
+    }
+    return next;
+}
+
+void prodikeys_reader_run(struct prodikeys_reader *reader){
+    if (reader->sim != NULL){
+        do prodikeys_handle_request(reader->pm);
+        while (!reader->cancelled && prodikeys_reader_play(reader) != 0);
+        return;
+    }
+    while (true){
+        reader->wakeup = 0; //before checking, a cancel, a request or a park from now on makes libusb return right away
+        if (reader->cancelled || reader->pm->handle == NULL) break;
+        prodikeys_handle_request(reader->pm);
+        uint64_t wait_ns = prodikeys_reader_service(reader);
+        if (reader->in_flight == 0 && reader->num_parked == 0) break;
+        int res;
+        if (wait_ns == 0){
+            res = libusb_handle_events_completed(reader->pm->context, &reader->wakeup);
+        } else {
+            uint64_t wait_us = (wait_ns + 999) / 1000;
+            struct timeval tv = {(long) (wait_us / 1000000), (long) (wait_us % 1000000)};
+            res = libusb_handle_events_timeout_completed(reader->pm->context, &tv, &reader->wakeup);
+        }
+        if (res == LIBUSB_ERROR_NO_DEVICE)
+            reader->disconnected = true;
+    }
+}
+
+void prodikeys_reader_wake(struct prodikeys_reader *reader){
+    if (reader->sim != NULL) return; //a simulated keyboard never waits in libusb
+    //set under the event waiters lock, libusb checks it there before a thread waits for another one handling events
+    libusb_lock_event_waiters(reader->pm->context);
+    reader->wakeup = 1;
+    libusb_unlock_event_waiters(reader->pm->context);
+    //and wake the thread handling events, which in turn wakes the waiting ones
+    libusb_interrupt_event_handler(reader->pm->context);
+}
+
+void prodikeys_reader_cancel(struct prodikeys_reader *reader){
+    reader->cancelled = true;
+    prodikeys_reader_wake(reader);
+}
+
+void prodikeys_reader_stop(struct prodikeys_reader *reader){
+    reader->running = false;
+    prodikeys_reader_service(reader);   //unparks everything, now that nothing gets rearmed
+    for (int i = 0; i < reader->num_transfers; i++)
+        libusb_cancel_transfer(reader->transfers[i]);
+
+    //cancelled transfers still have to go through their callback before they can be freed
+    for (int retries = 0; reader->in_flight > 0 && retries < 10; retries++){
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(reader->pm->context, &tv, NULL);
+    }
+    if (reader->in_flight > 0) return; //still owned by libusb, leaking is safer than freeing them
+
+    for (int i = 0; i < reader->num_transfers; i++){
+        libusb_free_transfer(reader->transfers[i]);
+        reader->transfers[i] = NULL;
+    }
+    reader->num_transfers = 0;
+}
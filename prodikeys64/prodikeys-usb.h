@@ -0,0 +1,161 @@
+/* Prodikeys MIDI Interface - USB transport
+ * Copyright 2020, CrazyRedMachine
+ *
+ */
+#pragma once
+#include <atomic>
+#include "prodikeys-core.h"
+#include "prodikeys-trace.h"
+
+#define PRODIKEYS_ENDPOINT_IN 0x82
+#define PRODIKEYS_READ_TRANSFERS_DEFAULT 4
+#define PRODIKEYS_READ_TRANSFERS_MAX 16
+#define PRODIKEYS_REPORT_POOL_SIZE (2 * PRODIKEYS_READ_TRANSFERS_MAX)
+#define PRODIKEYS_READ_BACKOFF_MIN_NS 1000000ULL        // first rearm delay after a failed read, doubled on each failure
+#define PRODIKEYS_READ_BACKOFF_MAX_NS 100000000ULL      // longest rearm delay
+#define PRODIKEYS_READ_FAILING_MAX_NS 1000000000ULL     // reads failing for that long without a report mean the keyboard is gone
+
+//What a failed read means, and what the read ring does about it
+enum prodikeys_read_error {
+    PRODIKEYS_READ_IDLE,            // timed out, nothing was pressed : rearm right away
+    PRODIKEYS_READ_STALL,           // endpoint halted : clear the halt, then rearm after a backoff
+    PRODIKEYS_READ_TRANSIENT,       // i/o error, busy, out of memory... : rearm after a backoff
+    PRODIKEYS_READ_FATAL,           // the keyboard is gone : stop and report it disconnected
+};
+
+//Fixed pool of report slots, allocated once with the read ring. Transfers read straight into a slot,
+//and the slot is only recycled once its report went through the decoder
+struct prodikeys_report_pool {
+    struct prodikeys_report slots[PRODIKEYS_REPORT_POOL_SIZE];
+    uint16_t                free_slots[PRODIKEYS_REPORT_POOL_SIZE];  // stack of free slot indexes
+    int                     num_free;
+    unsigned long           exhausted;          // times no free slot was left (the completed slot is then reused)
+};
+
+//Interrupt IN read ring : several transfers are kept submitted on the endpoint so that it is still
+//serviced while a completed report is being decoded and forwarded to the MIDI driver.
+//A simulated keyboard (prodikeys-sim.h) is read through the same pool and decoder, without transfers
+struct prodikeys_reader {
+    struct pcmidi_snd       *pm;                // device the reports are dispatched to
+    struct prodikeys_sim    *sim;               // simulated keyboard read instead of the endpoint, or NULL
+    struct libusb_transfer  *transfers[PRODIKEYS_READ_TRANSFERS_MAX];
+    struct prodikeys_report_pool pool;          // report slots the transfers read into
+    int                     num_transfers;      // ring depth
+    std::atomic<int>        in_flight;          // transfers currently submitted
+    std::atomic<bool>       running;            // completed transfers get resubmitted
+    std::atomic<bool>       disconnected;       // a transfer reported the device is gone (read by the supervisor)
+    std::atomic<bool>       cancelled;          // set by prodikeys_reader_cancel
+    int                     wakeup;             // completed flag of the event loop, set on cancel and when a read gets parked
+    std::atomic<bool>       halted;             // the endpoint stalled, its halt is cleared before the next rearm
+    std::atomic<int>        num_parked;         // failed transfers waiting for their backoff to be over
+    std::atomic<uint64_t>   parked_ns[PRODIKEYS_READ_TRANSFERS_MAX];  // when each transfer gets rearmed, 0 if it isn't parked
+    std::atomic<int>        failures;           // consecutive failed reads, reset by a completed one
+    std::atomic<uint64_t>   failing_since_ns;   // first of these failures
+    unsigned long           completed;          // reports handed to the decoder
+    std::atomic<unsigned long> starved;         // completions seen while no other transfer was queued (read by the UI)
+    uint64_t                latency_total_ns;   // sum of transfer completion to report handled times
+    uint64_t                latency_max_ns;     // worst transfer completion to report handled time
+    struct prodikeys_trace  *trace;             // capture trace every report is appended to, or NULL
+    uint8_t                 trace_device;       // device slot recorded in the capture trace
+};
+
+/**
+ * Take a free slot from a report pool
+ * @param pool the report pool
+ * @return a free slot, or NULL if all of them are in use
+ */
+struct prodikeys_report *prodikeys_report_acquire(struct prodikeys_report_pool *pool);
+
+/**
+ * Give a slot back to its report pool
+ * @param pool the report pool
+ * @param report a slot previously returned by prodikeys_report_acquire
+ */
+void prodikeys_report_release(struct prodikeys_report_pool *pool, struct prodikeys_report *report);
+
+/**
+ * Allocate and submit the interrupt IN read ring for a device.
+ * Completed reports are timestamped and handed to pcmidi_handle_report() from within libusb event handling,
+ * in completion order, then their transfer is resubmitted with a slot from the report pool.
+ * Must be called from the thread which will handle the events of the device context (pm->context).
+ * An offline device with a simulated keyboard (pm->sim) gets no transfers, prodikeys_reader_play reads it.
+ * @param reader the read ring to initialize
+ * @param pm the Prodikeys device (handle must be valid, or pm->sim set)
+ * @param num_transfers number of transfers to keep in flight (1 to PRODIKEYS_READ_TRANSFERS_MAX)
+ * @return true iff at least one transfer was submitted
+ */
+bool prodikeys_reader_start(struct prodikeys_reader *reader, struct pcmidi_snd *pm, int num_transfers);
+
+/**
+ * Start capturing every report of a read ring, before it reaches the decoder
+ * @param reader the read ring (already started)
+ * @param trace the capture trace, or NULL to stop capturing
+ * @param device device slot recorded with the reports
+ */
+void prodikeys_reader_capture(struct prodikeys_reader *reader, struct prodikeys_trace *trace, uint8_t device);
+
+/**
+ * Classify a completed transfer status
+ * @param status status of a transfer which didn't complete (nor was cancelled)
+ * @return what the read ring does about it
+ */
+enum prodikeys_read_error prodikeys_read_status_error(enum libusb_transfer_status status);
+
+/**
+ * Classify a libusb call error
+ * @param error libusb_error returned by the call
+ * @return what the read ring does about it
+ */
+enum prodikeys_read_error prodikeys_read_call_error(int error);
+
+/**
+ * Rearm the transfers of a read ring whose backoff is over, clearing the endpoint halt first if it stalled.
+ * Failed reads are parked by the completion callback, as clearing a halt is a synchronous request which can't be
+ * made from within libusb event handling. Must be called from the thread which handles the events of the device
+ * context, outside of them.
+ * @param reader the read ring
+ * @return nanoseconds until the next parked transfer is due (libusb event handling must not block longer),
+ *         0 if none is parked
+ */
+uint64_t prodikeys_reader_service(struct prodikeys_reader *reader);
+
+/**
+ * Read the next report of a simulated keyboard into a slot of the report pool and hand it to the decoder,
+ * as a completed transfer would be. Its timestamp is when it was read, not its virtual due time.
+ * @param reader the read ring of a simulated keyboard
+ * Once its virtual clock reaches sim->unplug_ns the keyboard is gone : the ring stops, disconnected being set.
+ * @return report id of the report read, 0 if the read ring is stopped
+ */
+int prodikeys_reader_play(struct prodikeys_reader *reader);
+
+/**
+ * Handle libusb events for the read ring until it stops, either because the device was unplugged or reads kept failing
+ * (disconnected is then set), because the device handle was cleared or because it was cancelled.
+ * Blocks in libusb until a transfer completes, there is no polling while the keyboard is idle,
+ * and failed reads are rearmed after a backoff rather than right away.
+ * A simulated keyboard is read with prodikeys_reader_play instead, as fast as the decoder takes its reports.
+ * Requests posted to the device by other threads (pm->request) are handled between two reports.
+ * @param reader the read ring
+ */
+void prodikeys_reader_run(struct prodikeys_reader *reader);
+
+/**
+ * Wake the thread running a read ring, from any thread, so that it takes the request posted to its device
+ * (pm->request) right away even if the keyboard is idle
+ * @param reader the read ring
+ */
+void prodikeys_reader_wake(struct prodikeys_reader *reader);
+
+/**
+ * Make prodikeys_reader_run return, from any thread. Event handling is woken up right away even if the
+ * keyboard is idle, the transfers stay in flight until prodikeys_reader_stop.
+ * @param reader the read ring (started)
+ */
+void prodikeys_reader_cancel(struct prodikeys_reader *reader);
+
+/**
+ * Cancel every in-flight transfer, wait for their completion and free them.
+ * Must be called from the thread which handles the events of the device context.
+ * @param reader the read ring
+ */
+void prodikeys_reader_stop(struct prodikeys_reader *reader);
@@ -9,7 +9,17 @@
 
 #include "stdafx.h"
 #include "resource.h"
+#include <thread>
 #include "prodikeys-core.h"
+#include "prodikeys-usb.h"
+#include "prodikeys-executor.h"
+#include "prodikeys-inject.h"
+#include "prodikeys-keymap.h"
+#include "prodikeys-output.h"
+#include "prodikeys-trace.h"
+#include "prodikeys-stats.h"
+#include "prodikeys-supervisor.h"
+#include "prodikeys-os.h"
 
 #define TRAYICONID	1//				ID number for the Notify Icon
 #define SWM_TRAYMSG	WM_APP//		the message ID sent to our window
@@ -17,31 +27,82 @@
 #define SWM_ENABLE_MIDI WM_APP + 2 //enable midi
 #define SWM_EXIT	WM_APP + 3//	close the window
 #define SWM_INIT	WM_APP + 4//	close the window
+#define SWM_DISCONNECTED WM_APP + 5 //keyboard was unplugged, posted by the reader thread
+#define SWM_STATS	WM_APP + 6//	show pipeline statistics
+#define SWM_READY	WM_APP + 7 //first device discovery done, posted by the startup thread
 
 // Global Variables:
 HINSTANCE		hInst;	// current instance
+HWND			hMainWnd;	// dialog receiving tray and device notifications
 NOTIFYICONDATA	niData;	// notify icon data
 
 // Forward declarations of functions included in this code module:
 BOOL				InitInstance(HINSTANCE, int);
 BOOL				OnInitDialog(HWND hWnd);
 void				ShowContextMenu(HWND hWnd);
+void				SetTrayTip(LPCTSTR tip);
 ULONGLONG			GetDllVersion(LPCTSTR lpszDllName);
 
 INT_PTR CALLBACK	DlgProc(HWND, UINT, WPARAM, LPARAM);
 
-struct pcmidi_snd* pm;
+// One slot per attached keyboard, each with its own read ring and reading thread (owned by the supervisor)
+struct pcmidi_snd* pm[PRODIKEYS_MAX_DEVICES];
+struct prodikeys_location location[PRODIKEYS_MAX_DEVICES];     // where each slot keyboard was last plugged
+struct prodikeys_snapshot last_state[PRODIKEYS_MAX_DEVICES];    // its state when it was unplugged, restored if it comes back there
+int read_transfers = PRODIKEYS_READ_TRANSFERS_DEFAULT;
+BOOL merge_ports = FALSE;           // all keyboards share a single virtual port, each on its own channel
+struct pcmidi_port *shared_port = NULL;  // the port shared by all keyboards in merge mode
+struct prodikeys_trace *capture = NULL;  // trace every report read is appended to, or NULL
+struct prodikeys_rt_config rt = {PRODIKEYS_SCHED_DEFAULT, PRODIKEYS_RT_PRIORITY_DEFAULT, -1};  // reading threads scheduling
+BOOL lock_memory = FALSE;           // keep the read rings and device structs resident
+BOOL output_thread = TRUE;          // MIDI messages are written to the ports by the output thread
+enum prodikeys_overflow_policy overflow = PRODIKEYS_OVERFLOW_DROP_OLDEST;  // full output ring handling
+BOOL show_tray = TRUE;              // tray icon, none at all with "--no-tray" (autostart, headless)
+std::thread startup;                // first device discovery, running while the tray icon is set up
+BOOL startup_missed = FALSE;        // a device node changed during the first discovery, look again once it is done
+unsigned int startup_unplugged = 0; // slots unplugged during the first discovery, released once it is done
+
+/* Count the keyboards currently attached */
+int prodikeys_count(){
+    int count = 0;
+    for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++)
+        if (pm[i] != NULL && pm[i]->handle != NULL) count++;
+    return count;
+}
+
+/* A slot is free once its keyboard is gone and its reading thread has been joined */
+BOOL prodikeys_slot_free(int slot){
+    return pm[slot] == NULL || (pm[slot]->handle == NULL && !prodikeys_supervisor_active(slot));
+}
+
+/* Slot for a keyboard plugged at a given location : the one it had if it was plugged there before,
+ * else a free slot no other keyboard may come back to, else any free slot. -1 if there is none */
+int prodikeys_slot(const struct prodikeys_location *where){
+    for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++)
+        if (prodikeys_slot_free(slot) && prodikeys_location_equal(&location[slot], where)) return slot;
+    for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++)
+        if (prodikeys_slot_free(slot) && location[slot].num_ports == 0) return slot;
+    for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++)
+        if (prodikeys_slot_free(slot)) return slot;
+    return -1;
+}
+
+/* Attach to every Prodikeys keyboard not attached yet, init default values (midi mode OFF, fn state OFF..) and start their reading threads.
+ * A keyboard replugged in the port it was unplugged from gets its slot and state back instead.
+ * When interactive is FALSE, failing to find a device is silent (used at startup and on device arrival notifications) */
+BOOL prodikeys_init(BOOL interactive){
+    libusb_device_handle* handles[PRODIKEYS_MAX_DEVICES];  /* handles for USB devices */
+    libusb_context* contexts[PRODIKEYS_MAX_DEVICES];       /* the context of each one, its reading thread alone handles it */
+    int count;
 
-/* Attach to the USB device and init default values (midi mode OFF, fn state OFF..) */
-BOOL prodikeys_init(){
-    BOOL ret = FALSE;
-    int res                      = 0;  /* return codes from libusb functions */
-    libusb_device_handle* handle = 0;  /* handle for USB device */
     //connect to prodikeys
-    if (!prodikeys_claim_interface(&handle)){
+    count = prodikeys_claim_interfaces(handles, contexts, PRODIKEYS_MAX_DEVICES - prodikeys_count());
+    if (count == 0){
+        if (!interactive) return FALSE;
         int msgBoxId = MessageBoxW(NULL, L"Couldn't find prodikeys device. Make sure WinUSB driver is installed on interface 1 and that the keyboard is connected to the computer.", L"Error", MB_ICONERROR|MB_ABORTRETRYIGNORE|MB_SETFOREGROUND);
         while (msgBoxId == IDRETRY) {
-            if (!prodikeys_claim_interface(&handle)) {
+            count = prodikeys_claim_interfaces(handles, contexts, PRODIKEYS_MAX_DEVICES - prodikeys_count());
+            if (count == 0) {
                 msgBoxId = MessageBoxW(NULL,
                                        L"Couldn't find prodikeys device. Make sure WinUSB driver is installed on interface 1 and that the keyboard is connected to the computer.",
                                        L"Error", MB_ICONERROR | MB_ABORTRETRYIGNORE | MB_SETFOREGROUND);
@@ -52,81 +113,99 @@ BOOL prodikeys_init(){
                 break;
             case IDABORT:
             default:
-                goto error;
+                return FALSE;
         }
     }
 
-    pm = static_cast<pcmidi_snd *>(malloc(sizeof(struct pcmidi_snd)));
-    pm->handle = handle;
-    pm_init_values(pm);
-    ret = TRUE;
-
-error:
-    return ret;
+    for (int i = 0; i < count; i++){
+        struct prodikeys_location where;
+        prodikeys_location_get(libusb_get_device(handles[i]), &where);
+        int slot = prodikeys_slot(&where);
+        if (slot < 0) {
+            libusb_release_interface(handles[i], 1);
+            libusb_close(handles[i]);
+            libusb_exit(contexts[i]);
+            continue;
+        }
+        BOOL replugged = prodikeys_location_equal(&location[slot], &where);
+        location[slot] = where;
+        if (pm[slot] == NULL)
+            pm[slot] = static_cast<pcmidi_snd *>(malloc(sizeof(struct pcmidi_snd)));
+        memset((void *) pm[slot], 0, sizeof(struct pcmidi_snd));
+        pm[slot]->handle = handles[i];
+        pm[slot]->context = contexts[i];
+        if (merge_ports) {
+            pm[slot]->base_channel = slot <= PCMIDI_CHANNEL_MAX ? slot : PCMIDI_CHANNEL_MAX;
+            pm[slot]->shared_port = &shared_port;
+            strcpy_s(pm[slot]->port_name, 64, "Prodikeys MIDI Interface");
+        } else if (slot == 0) {
+            strcpy_s(pm[slot]->port_name, 64, "Prodikeys MIDI Interface");
+        } else {
+            sprintf_s(pm[slot]->port_name, 64, "Prodikeys MIDI Interface %d", slot + 1);
+        }
+        pm[slot]->ring = prodikeys_output_ring(slot);
+        prodikeys_cmd_init(pm[slot]);
+        pm_init_values(pm[slot]);
+        //created once per keyboard here rather than on the piano key, which only gates MIDI output
+        pcmidi_open_port(pm[slot]);
+        if (replugged)
+            prodikeys_restore_values(pm[slot], &last_state[slot]);
+        if (prodikeys_supervisor_start(slot, pm[slot]))
+            prodikeys_stats_ready();
+    }
+    return TRUE;
+}
 
+/* Called from a reading thread once its keyboard is unplugged, the slot is released on the UI thread */
+void ProdikeysUnplugged(int index) {
+    PostMessage(hMainWnd, SWM_DISCONNECTED, (WPARAM)index, 0);
 }
 
-HANDLE hProdikeysWDThread;
-DWORD   dwProdikeysWDThreadId;
-HANDLE hProdikeysThread;
-DWORD   dwProdikeysThreadId;
-
-/* This is the main USB HID reading loop, gathering messages from the Prodikeys endpoint and handling them */
-DWORD WINAPI HandleProdikeys() {
-    int res;
-    int numBytes                 = 0;  /* Actual bytes transferred. */
-    uint8_t buffer[31];                /* 31 byte transfer buffer */
-    while (pm->handle != NULL){
-        /* Read keys. */
-        memset(buffer, 0, 31);
-        res = libusb_interrupt_transfer(pm->handle, 0x82, buffer, 31, &numBytes, 3000);
-        if (0 == res) {
-            if (buffer[0] == 0x03)
-                pcmidi_handle_note_report(pm,buffer,numBytes);
-            else
-                pcmidi_handle_report_extra(pm,buffer,numBytes);
-        }
+/* Stop a keyboard reading thread and restore its slot to initial application startup state.
+ * Its last commands are written on its own libusb context, the other keyboards' events are left to their threads */
+void ProdikeysRelease(int index) {
+    struct pcmidi_snd *dev = pm[index];
+    prodikeys_supervisor_stop(index);
+    prodikeys_snapshot_read(dev, &last_state[index]);
+    pcmidi_close_port(dev);
+    prodikeys_cmd_free(dev);
+    if (dev->handle != NULL) {
+        libusb_release_interface(dev->handle, 1);
+        libusb_close(dev->handle);
+        libusb_exit(dev->context);
     }
-    return 0;
+    dev->handle = NULL;
+    dev->context = NULL;
+    prodikeys_snapshot_publish(dev);
 }
 
-/* This is a watchdog meant to manage unexpected unplugging of the keyboard */
-DWORD WINAPI ProdikeysWatchdog() {
-    while (true){
-        if (pm->handle == NULL) continue;
-        if (!prodikeys_send_hid_data(pm->handle, 0xC4)){
-            //Keyboard was disconnected. Close the main thread and restore the state to initial application startup state
-            int msgboxID = MessageBoxW(NULL, L"Prodikeys disconnected. Please plug it back then click \"Connect\" to reattach.", L"Error", MB_ICONERROR|MB_RETRYCANCEL|MB_SETFOREGROUND);
-            CloseHandle(hProdikeysThread);
-            pm->midi_mode = false;
-            if (pm->port){
-                virtualMIDIClosePort( pm->port );
-            }
-            pm->port = NULL;
-            int res = libusb_release_interface(pm->handle, 1);
-            if (0 != res)
-                MessageBoxW(NULL, L"Error releasing interface. It is recommended to exit the program, plug the keyboard then restart Prodikeys64.", L"Error", MB_ICONERROR|MB_SETFOREGROUND);
-            pm->handle = NULL;
-            switch (msgboxID)
-            {
-                case IDCANCEL:
-                    break;
-                case IDRETRY:
-                    //prodikeys_init will take care of respawning "Cancel Retry Ignore" dialogboxes
-                    if (prodikeys_init()) {
-                        hProdikeysThread = CreateThread(
-                                NULL,                   // default security attributes
-                                0,                      // use default stack size
-                                reinterpret_cast<LPTHREAD_START_ROUTINE>(HandleProdikeys),       // thread function name
-                                NULL,          // argument to thread function
-                                0,                      // use default creation flags
-                                &dwProdikeysThreadId);   // returns the thread identifier
-                    }
-                    break;
-            }
-        };
-        Sleep(3000);
-    }
+/* Keyboard was disconnected. Join its reading loop and release its slot.
+ * Called on the UI thread, reattaching is then driven by WM_DEVICECHANGE notifications */
+void ProdikeysDisconnected(int index) {
+    if (pm[index] == NULL) return;
+    ProdikeysRelease(index);
+    if (prodikeys_count() == 0)
+        SetTrayTip(_T("Prodikeys Midi Interface Driver (disconnected)"));
+}
+
+/* First device discovery, on its own thread so that the keyboards play while the tray icon is being set up.
+ * Never asks anything : a keyboard which isn't there yet is attached once plugged in (WM_DEVICECHANGE) */
+void ProdikeysStartup() {
+    prodikeys_init(FALSE);
+    PostMessage(hMainWnd, SWM_READY, 0, 0);
+}
+
+/* The startup thread is done, the UI thread has the slots from now on */
+void ProdikeysReady() {
+    startup.join();
+    for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++)
+        if (startup_unplugged & (1u << i)) ProdikeysDisconnected(i);
+    startup_unplugged = 0;
+    if (startup_missed && prodikeys_count() < PRODIKEYS_MAX_DEVICES)
+        prodikeys_init(FALSE);
+    startup_missed = FALSE;
+    SetTrayTip(prodikeys_count() > 0 ? _T("Prodikeys Midi Interface Driver")
+                                     : _T("Prodikeys Midi Interface Driver (waiting for keyboard)"));
 }
 
 int APIENTRY _tWinMain(HINSTANCE hInstance,
@@ -136,24 +215,93 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
 {
 	MSG msg;
 
-	// Perform application initialization:
-	if (!InitInstance (hInstance, nCmdShow)) return FALSE;
-
-	//setup prodikeys threads (at this point connection to the device has been handled in InitInstance function call)
-    hProdikeysThread = CreateThread(
-            NULL,                   // default security attributes
-            0,                      // use default stack size
-            reinterpret_cast<LPTHREAD_START_ROUTINE>(HandleProdikeys),       // thread function name
-            NULL,          // argument to thread function
-            0,                      // use default creation flags
-            &dwProdikeysThreadId);   // returns the thread identifier
-    hProdikeysWDThread = CreateThread(
-            NULL,                   // default security attributes
-            0,                      // use default stack size
-            reinterpret_cast<LPTHREAD_START_ROUTINE>(ProdikeysWatchdog),       // thread function name
-            NULL,          // argument to thread function
-            0,                      // use default creation flags
-            &dwProdikeysWDThreadId);   // returns the thread identifier
+	prodikeys_stats_reset();
+
+	// Number of interrupt IN transfers kept in flight, e.g. "prodikeys64.exe --transfers=8"
+	LPTSTR transfersArg = _tcsstr(lpCmdLine, _T("--transfers="));
+	if (transfersArg)
+		read_transfers = _ttoi(transfersArg + 12);
+
+	// Merge every keyboard into a single virtual port, keyboard n playing on channel n
+	if (_tcsstr(lpCmdLine, _T("--merge")))
+		merge_ports = TRUE;
+
+	// Reading threads as MMCSS "Pro Audio" tasks, optionally pinned to a cpu, e.g. "prodikeys64.exe --realtime --cpu=2"
+	if (_tcsstr(lpCmdLine, _T("--realtime")))
+		rt.policy = PRODIKEYS_SCHED_FIFO;
+	LPTSTR cpuArg = _tcsstr(lpCmdLine, _T("--cpu="));
+	if (cpuArg)
+		rt.cpu = _ttoi(cpuArg + 6);
+	// Keep the read rings resident
+	if (_tcsstr(lpCmdLine, _T("--mlock"))) {
+		lock_memory = TRUE;
+		prodikeys_lock_process();
+	}
+
+	// MIDI messages are queued to an output thread (same scheduling as the reading threads, not pinned) so that a slow
+	// MIDI driver never holds up USB reads. "--overflow=coalesce" or "--overflow=block" change what happens when it falls
+	// behind (drop-oldest by default), "--no-output-thread" writes them from the reading threads.
+	if (_tcsstr(lpCmdLine, _T("--overflow=coalesce")))
+		overflow = PRODIKEYS_OVERFLOW_COALESCE_PITCH;
+	else if (_tcsstr(lpCmdLine, _T("--overflow=block")))
+		overflow = PRODIKEYS_OVERFLOW_BLOCK;
+	if (_tcsstr(lpCmdLine, _T("--no-output-thread")))
+		output_thread = FALSE;
+	// No tray icon, for autostart or headless setups (keyboards are still attached when plugged in, exit with taskkill)
+	if (_tcsstr(lpCmdLine, _T("--no-tray")))
+		show_tray = FALSE;
+	struct prodikeys_rt_config output_rt = {rt.policy, rt.priority, -1};
+	if (output_thread)
+		prodikeys_output_start(overflow, &output_rt);
+
+	// Application launches and media key injection run on an executor thread (normal priority), the reading threads
+	// only queue them. "--sync-actions" runs them from the reading threads instead.
+	if (!_tcsstr(lpCmdLine, _T("--sync-actions")))
+		prodikeys_executor_start();
+	struct prodikeys_injector *injector = prodikeys_injector_open("Prodikeys");
+	prodikeys_executor_injector(injector);
+
+	// Record every report read to a trace file, e.g. "prodikeys64.exe --capture=session.pktrace" (replayed with prodikeysd --replay)
+	const char *captureArg = strstr(GetCommandLineA(), "--capture=");
+	if (captureArg) {
+		char capturePath[MAX_PATH];
+		if (sscanf_s(captureArg + 10, "%259s", capturePath, (unsigned) MAX_PATH) == 1)
+			capture = prodikeys_trace_create(capturePath);
+	}
+
+	// Rebind function buttons, e.g. "prodikeys64.exe --keymap=buttons.txt" (format in prodikeys-keymap.h)
+	// The file is reloaded whenever it changes, a file which doesn't parse leaves the previous keymap active
+	const char *keymapArg = strstr(GetCommandLineA(), "--keymap=");
+	if (keymapArg) {
+		char keymapPath[MAX_PATH];
+		if (sscanf_s(keymapArg + 9, "%259s", keymapPath, (unsigned) MAX_PATH) == 1)
+			prodikeys_keymap_watch(keymapPath);
+	}
+
+	// The default libusb context lists the keyboards for the whole session, each one (re)attached then gets a context of its own
+	if (libusb_init(NULL) != 0) {
+		MessageBoxW(NULL, L"Couldn't initialize libusb.", L"Error", MB_ICONERROR|MB_SETFOREGROUND);
+		prodikeys_output_stop();
+		prodikeys_executor_stop();
+		prodikeys_executor_injector(NULL);
+		prodikeys_injector_close(injector);
+		prodikeys_keymap_unwatch();
+		return FALSE;
+	}
+	struct prodikeys_supervisor_config supervisor = {read_transfers, rt, lock_memory != FALSE, capture, ProdikeysUnplugged};
+	prodikeys_supervisor_init(&supervisor);
+
+	// Perform application initialization (creates the window, and the tray icon while keyboards are being attached):
+	if (!InitInstance (hInstance, nCmdShow)) {
+		prodikeys_trace_close(capture);
+		libusb_exit(NULL);
+		prodikeys_output_stop();
+		prodikeys_executor_stop();
+		prodikeys_executor_injector(NULL);
+		prodikeys_injector_close(injector);
+		prodikeys_keymap_unwatch();
+		return FALSE;
+	}
 
     // Main message loop:
 	while (GetMessage(&msg, NULL, 0, 0))
@@ -164,10 +312,26 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
 			DispatchMessage(&msg);
 		}
 	}
+	// Cancel and join every reading thread before anything they use goes away
+	if (startup.joinable())
+		startup.join();
+	prodikeys_supervisor_stop_all();
+	for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++){
+		if (pm[i] == NULL || pm[i]->handle == NULL) continue;
+		prodikeys_disable_midi(pm[i]); //written before the slot is released, the keyboard is left typing
+		ProdikeysRelease(i);
+	}
+	prodikeys_trace_close(capture);
+	libusb_exit(NULL);
+	prodikeys_output_stop();
+	prodikeys_executor_stop();
+	prodikeys_executor_injector(NULL);
+	prodikeys_injector_close(injector);
+	prodikeys_keymap_unwatch();
 	return (int) msg.wParam;
 }
 
-//	Initialize the window and tray icon, attempt connection to the prodikeys device and initialize it
+//	Initialize the window, start looking for prodikeys devices in the background and set up the tray icon meanwhile
 BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
 {
 	 // store instance handle and create dialog
@@ -178,6 +342,12 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
 	    MessageBoxW(NULL, L"error", L"error", 0);
 	    return FALSE;
 	}
+	hMainWnd = hWnd;
+
+	// Attach the keyboards and create their ports without waiting for the tray icon, nor holding it up
+	startup = std::thread(ProdikeysStartup);
+	if (!show_tray)
+		return TRUE;
 
 	// Fill the NOTIFYICONDATA structure and call Shell_NotifyIcon
 
@@ -221,8 +391,7 @@ BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
 	if(niData.hIcon && DestroyIcon(niData.hIcon))
 		niData.hIcon = NULL;
 
-	// Initialize Prodikeys (connect and init startup values)
-    return prodikeys_init();
+	return TRUE;
 }
 
 BOOL OnInitDialog(HWND hWnd)
@@ -240,6 +409,14 @@ BOOL OnInitDialog(HWND hWnd)
 	return TRUE;
 }
 
+// Update the tray icon tooltip
+void SetTrayTip(LPCTSTR tip)
+{
+    if (!show_tray) return;
+    lstrcpyn(niData.szTip, tip, sizeof(niData.szTip)/sizeof(TCHAR));
+    Shell_NotifyIcon(NIM_MODIFY,&niData);
+}
+
 // Name says it all
 void ShowContextMenu(HWND hWnd)
 {
@@ -248,8 +425,30 @@ void ShowContextMenu(HWND hWnd)
 	HMENU hMenu = CreatePopupMenu();
 	if(hMenu)
 	{
-	    //"Connect" button available only if the libusb handle is invalid
-        if (pm->handle != NULL){
+	    //"Connect" button available only if no keyboard is attached
+	    //keyboard state is read from the published snapshots, never from fields the reading threads are changing
+	    int connected = 0;
+	    BOOL midi_mode = FALSE;
+	    struct prodikeys_snapshot first = {0};
+	    unsigned long starved = 0, cmd_sent = 0, cmd_coalesced = 0, cmd_max_latency = 0;
+	    int cmd_depth = 0;
+	    for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++){
+	        starved += prodikeys_supervisor_starved(i);
+	        if (pm[i] == NULL) continue;
+	        struct prodikeys_snapshot state;
+	        prodikeys_snapshot_read(pm[i], &state);
+	        if (state.connected && connected++ == 0) first = state;
+	        if (state.midi_mode) midi_mode = TRUE;
+	        cmd_sent += state.cmd_sent;
+	        cmd_coalesced += state.cmd_coalesced;
+	        if (state.cmd_max_latency_us > cmd_max_latency) cmd_max_latency = state.cmd_max_latency_us;
+	        if (state.connected) cmd_depth += (int) state.cmd_depth;
+	    }
+        if (connected > 1){
+            TCHAR keyboards[64];
+            _sntprintf(keyboards, 64, _T("Connected (%d keyboards)"), connected);
+            InsertMenu(hMenu, -1, MF_BYPOSITION|MF_DISABLED, NULL, keyboards);
+        } else if (connected == 1){
             InsertMenu(hMenu, -1, MF_BYPOSITION|MF_DISABLED, NULL, _T("Connected"));
         } else {
             InsertMenu(hMenu, -1, MF_BYPOSITION, SWM_INIT, _T("Connect"));
@@ -257,15 +456,39 @@ void ShowContextMenu(HWND hWnd)
 
         InsertMenu(hMenu, -1, MF_BYPOSITION|MF_SEPARATOR, NULL, NULL);
 
-        //Activate midi is grayed when the device isn't attached, and is checked only when midi keys are active. You can also use the piano key on the keyboard instead
-        if (pm->midi_mode){
+        //Activate midi is grayed when no device is attached, and is checked only when midi keys are active. You can also use the piano key on the keyboard instead
+        if (midi_mode){
             InsertMenu(hMenu, -1, MF_BYPOSITION|MF_CHECKED, SWM_DISABLE_MIDI, _T("Activate midi"));
-        } else if (pm->handle!= NULL){
+        } else if (connected > 0){
             InsertMenu(hMenu, -1, MF_BYPOSITION|MF_UNCHECKED, SWM_ENABLE_MIDI, _T("Activate midi"));
         } else {
             InsertMenu(hMenu, -1, MF_BYPOSITION|MF_UNCHECKED|MF_DISABLED, SWM_ENABLE_MIDI, _T("Activate midi"));
         }
+        //Current MIDI settings of the first keyboard
+        if (midi_mode && connected > 0 && first.midi_mode){
+            TCHAR settings[128];
+            _sntprintf(settings, 128, _T("Channel %d, octave %+d, instrument %d%s"),
+                       first.channel + 1, first.octave, first.instrument, first.sustain_mode ? _T(", sustain") : _T(""));
+            InsertMenu(hMenu, -1, MF_BYPOSITION|MF_DISABLED, NULL, settings);
+        }
         InsertMenu(hMenu, -1, MF_BYPOSITION|MF_SEPARATOR, NULL, NULL);
+
+        //Read ring diagnostic : how many times a report completed with no other read queued on the endpoint
+        if (starved > 0){
+            TCHAR underruns[64];
+            _sntprintf(underruns, 64, _T("Read underruns: %lu"), starved);
+            InsertMenu(hMenu, -1, MF_BYPOSITION|MF_DISABLED, NULL, underruns);
+            InsertMenu(hMenu, -1, MF_BYPOSITION|MF_SEPARATOR, NULL, NULL);
+        }
+        //Command writer diagnostic : LED and mode commands written, dropped as redundant, still queued, and worst write time
+        if (cmd_sent > 0){
+            TCHAR commands[128];
+            _sntprintf(commands, 128, _T("Commands: %lu sent, %lu coalesced, %d queued, max %lu us"),
+                       cmd_sent, cmd_coalesced, cmd_depth, cmd_max_latency);
+            InsertMenu(hMenu, -1, MF_BYPOSITION|MF_DISABLED, NULL, commands);
+            InsertMenu(hMenu, -1, MF_BYPOSITION|MF_SEPARATOR, NULL, NULL);
+        }
+        InsertMenu(hMenu, -1, MF_BYPOSITION|MF_STRING, SWM_STATS, _T("Statistics..."));
         InsertMenu(hMenu, -1, MF_BYPOSITION|MF_STRING, IDM_ABOUT, _T("About..."));
         InsertMenu(hMenu, -1, MF_BYPOSITION, SWM_EXIT, _T("Exit"));
 
@@ -343,26 +566,51 @@ INT_PTR CALLBACK DlgProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             case IDM_ABOUT:
                 ShowWindow(hWnd, SW_RESTORE);
                 break;
+            case SWM_STATS: {
+                //latency histograms and counters since startup, as JSON (Ctrl+C copies the message box text)
+                char json[8192];
+                prodikeys_stats_json(json, sizeof(json));
+                MessageBoxA(hWnd, json, "Prodikeys statistics", MB_OK|MB_ICONINFORMATION);
+                break;
+            }
             case SWM_ENABLE_MIDI:
-                prodikeys_enable_midi(pm);
+                if (startup.joinable()) break; //not while the startup thread is attaching keyboards
+                //made by each reading thread, the only writer of its keyboard state and output ring
+                for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++)
+                    prodikeys_supervisor_request(i, PRODIKEYS_REQUEST_MIDI_ON);
                 break;
             case SWM_DISABLE_MIDI:
-                prodikeys_disable_midi(pm);
+                if (startup.joinable()) break;
+                for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++)
+                    prodikeys_supervisor_request(i, PRODIKEYS_REQUEST_MIDI_OFF);
                 break;
 		    case SWM_INIT:
-		        /* prodikeys_init */
-		        if (prodikeys_init()) {
-                    hProdikeysThread = CreateThread(
-                            NULL,                   // default security attributes
-                            0,                      // use default stack size
-                            reinterpret_cast<LPTHREAD_START_ROUTINE>(HandleProdikeys),       // thread function name
-                            NULL,          // argument to thread function
-                            0,                      // use default creation flags
-                            &dwProdikeysThreadId);   // returns the thread identifier
-                }
+		        /* prodikeys_init, asking what to do if no keyboard is found (the startup thread never does) */
+		        if (startup.joinable()) break;
+		        if (prodikeys_init(TRUE) && prodikeys_count() > 0)
+		            SetTrayTip(_T("Prodikeys Midi Interface Driver"));
 		        break;
 		}
 		return 1;
+	case SWM_DISCONNECTED:
+		// slots belong to the startup thread until it is done
+		if (startup.joinable())
+		    startup_unplugged |= 1u << (int)wParam;
+		else
+		    ProdikeysDisconnected((int)wParam);
+		break;
+	case SWM_READY:
+		ProdikeysReady();
+		break;
+	case WM_DEVICECHANGE:
+		// a device node was added or removed, attach right away any keyboard we don't have yet
+		if (wParam == DBT_DEVNODES_CHANGED && startup.joinable()) {
+		    startup_missed = TRUE;
+		} else if (wParam == DBT_DEVNODES_CHANGED && prodikeys_count() < PRODIKEYS_MAX_DEVICES) {
+		    if (prodikeys_init(FALSE))
+		        SetTrayTip(_T("Prodikeys Midi Interface Driver"));
+		}
+		return TRUE;
 	case WM_INITDIALOG:
 		return OnInitDialog(hWnd);
 	case WM_CLOSE:
@@ -0,0 +1,699 @@
+/*
+ * prodikeysd, a headless linux daemon for Prodikeys MIDI Interface
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Publishes one ALSA sequencer port per keyboard (or a single one with --merge).
+ * Keyboards are attached and detached through libusb hotplug notifications,
+ * everything else runs from libusb event handling on the main thread.
+ * Reports can be captured to a trace file, and a trace can be replayed instead of reading keyboards.
+ * Simulated keyboards can be played instead, on a virtual clock.
+ * Pipeline statistics are dumped as JSON on SIGUSR1 and on exit.
+ * Function buttons can be rebound with a keymap file, reloaded by a watcher thread whenever it changes.
+ * The main thread decodes reports and queues MIDI events, which a dedicated output thread writes to the sequencer,
+ * so a slow sequencer client never holds up reading the keyboards. Both threads can be given real-time scheduling,
+ * a cpu, and locked memory.
+ */
+#include <signal.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prodikeys-core.h"
+#include "prodikeys-usb.h"
+#include "prodikeys-executor.h"
+#include "prodikeys-inject.h"
+#include "prodikeys-keymap.h"
+#include "prodikeys-output.h"
+#include "prodikeys-trace.h"
+#include "prodikeys-sim.h"
+#include "prodikeys-stats.h"
+#include "prodikeys-os.h"
+
+/* Budget from interrupt transfer completion to the last MIDI event of the report being written to the sequencer */
+#define PRODIKEYSD_LATENCY_BUDGET_NS 1000000
+
+struct pcmidi_snd* pm[PRODIKEYS_MAX_DEVICES];
+struct prodikeys_reader reader[PRODIKEYS_MAX_DEVICES];
+struct prodikeys_location location[PRODIKEYS_MAX_DEVICES];     // where each slot keyboard was last plugged
+struct prodikeys_snapshot last_state[PRODIKEYS_MAX_DEVICES];    // its state when it was unplugged, restored if it comes back there
+libusb_device *arrived[PRODIKEYS_MAX_DEVICES];  // devices announced by hotplug, attached from the main loop
+int num_arrived = 0;
+volatile bool running = true;
+
+int read_transfers = PRODIKEYS_READ_TRANSFERS_DEFAULT;
+bool merge_ports = false;           // all keyboards share a single sequencer port, each on its own channel
+bool midi_on_attach = true;         // enable piano keys as soon as a keyboard is attached
+struct pcmidi_port *shared_port = NULL;
+struct prodikeys_trace *capture = NULL;    // trace every report read is appended to (--capture)
+const char *replay_path = NULL;         // trace replayed instead of reading keyboards (--replay)
+double simulate_s = 0;                  // virtual seconds simulated keyboards are played instead of reading keyboards (--simulate)
+int sim_keyboards = 1;                  // simulated keyboards (--sim-keyboards)
+uint32_t sim_seed = 1;                  // performance of the first simulated keyboard, the next ones get the following seeds (--sim-seed)
+bool replay_fast = false;               // replay as fast as possible instead of with the original timing
+const char *stats_path = NULL;          // file the statistics are written to (--stats), stderr if NULL
+struct prodikeys_rt_config rt = {PRODIKEYS_SCHED_DEFAULT, PRODIKEYS_RT_PRIORITY_DEFAULT, -1};  // main thread scheduling
+bool lock_memory = false;               // keep every page resident (--mlock)
+bool output_thread = true;              // MIDI events are written by the output thread (--no-output-thread)
+bool forward_keys = true;               // media and system keys are injected through a uinput keyboard (--no-keys)
+struct prodikeys_injector *injector = NULL;
+bool sync_actions = false;              // launches run from the note path instead of the executor thread (--sync-actions)
+enum prodikeys_overflow_policy overflow = PRODIKEYS_OVERFLOW_DROP_OLDEST;  // full output ring handling (--overflow)
+int output_cpu = -1;                    // cpu the output thread is pinned to (--output-cpu)
+int snapshot_readers = 0;               // threads reading device state snapshots during a replay (--snapshot-readers)
+int replug_cycles = 0;                  // times the first replayed keyboard is unplugged and replugged after the replay (--replug)
+bool cold_replug = false;               // replugged keyboards start over from default values, with a libusb context and device scan
+                                        // of their own, as every reconnect used to (--cold-replug)
+#ifdef PRODIKEYS_BASELINES
+bool single_note_sends = false;         // one sequencer write per note instead of one per report (--no-batch)
+bool computed_notes = false;            // translate keys with arithmetic instead of the note table (--no-note-map)
+bool port_per_toggle = false;           // port closed when leaving MIDI mode and created again on the piano key (--port-per-toggle)
+#endif
+
+//A thread reading device state snapshots in a loop, as a UI or control client would (replay stress test)
+struct prodikeysd_snapshot_reader {
+    pthread_t               thread;
+    int                     devices;            // slots read
+    std::atomic<bool>       *running;
+    unsigned long           reads;
+    unsigned long           retries;            // reads taken again as a publication was in progress
+    unsigned long           inconsistent;       // snapshots with a field out of its range, or going back in time
+};
+
+/* Hotplug callback, runs within libusb event handling so opening the device is left to the main loop */
+static int LIBUSB_CALL prodikeysd_hotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data){
+    if (num_arrived < PRODIKEYS_MAX_DEVICES)
+        arrived[num_arrived++] = libusb_ref_device(device);
+    return 0;
+}
+
+/* Reset a slot for a keyboard (or a replayed one if handle is NULL), port name and channel depending on its position */
+static void prodikeysd_slot_init(int slot, libusb_device_handle *handle){
+    if (pm[slot] == NULL)
+        pm[slot] = static_cast<pcmidi_snd *>(malloc(sizeof(struct pcmidi_snd)));
+    memset((void *) pm[slot], 0, sizeof(struct pcmidi_snd));
+    pm[slot]->handle = handle;
+    pm[slot]->offline = handle == NULL;
+#ifdef PRODIKEYS_BASELINES
+    pm[slot]->single_note_sends = single_note_sends;
+    pm[slot]->computed_notes = computed_notes;
+    pm[slot]->port_per_toggle = port_per_toggle;
+#endif
+    pm[slot]->ring = prodikeys_output_ring(slot);
+    if (merge_ports) {
+        pm[slot]->base_channel = slot <= PCMIDI_CHANNEL_MAX ? slot : PCMIDI_CHANNEL_MAX;
+        pm[slot]->shared_port = &shared_port;
+        snprintf(pm[slot]->port_name, 64, "Prodikeys MIDI Interface");
+    } else if (slot == 0) {
+        snprintf(pm[slot]->port_name, 64, "Prodikeys MIDI Interface");
+    } else {
+        snprintf(pm[slot]->port_name, 64, "Prodikeys MIDI Interface %d", slot + 1);
+    }
+}
+
+/* Create the port of a keyboard for as long as it is attached, the piano key only gating it. false if it couldn't be */
+static bool prodikeysd_open_port(struct pcmidi_snd *dev){
+#ifdef PRODIKEYS_BASELINES
+    if (dev->port_per_toggle) return true; //created by prodikeys_enable_midi instead
+#endif
+    return pcmidi_open_port(dev);
+}
+
+/* Slot for a keyboard plugged at a given location : the one it had if it was plugged there before,
+ * else a free slot no other keyboard may come back to, else any free slot. -1 if there is none */
+static int prodikeysd_slot(const struct prodikeys_location *where){
+    for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++)
+        if ((pm[slot] == NULL || pm[slot]->handle == NULL) && prodikeys_location_equal(&location[slot], where)) return slot;
+    for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++)
+        if ((pm[slot] == NULL || pm[slot]->handle == NULL) && location[slot].num_ports == 0) return slot;
+    for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++)
+        if (pm[slot] == NULL || pm[slot]->handle == NULL) return slot;
+    return -1;
+}
+
+/* Start reading a keyboard plugged at a given location in a slot : a claimed one, or a simulated one (handle NULL,
+ * seeded as with --simulate). A keyboard coming back to where its slot was last plugged gets the slot state back.
+ * false if it couldn't be read, a claimed keyboard being released then */
+static bool prodikeysd_attach_slot(int slot, libusb_device_handle *handle, struct prodikeys_sim *sim,
+                                   const struct prodikeys_location *where){
+    bool replugged = prodikeys_location_equal(&location[slot], where);
+    location[slot] = *where;
+
+    prodikeysd_slot_init(slot, handle);
+    if (sim != NULL)
+        prodikeys_sim_init(sim, pm[slot], sim_seed + slot);
+    else
+        prodikeys_cmd_init(pm[slot]);
+    pm_init_values(pm[slot]);
+
+    if (!prodikeys_reader_start(&reader[slot], pm[slot], read_transfers)){
+        fprintf(stderr, "prodikeysd: couldn't start reading keyboard %d\n", slot + 1);
+        if (handle != NULL){
+            prodikeys_cmd_free(pm[slot]);
+            libusb_release_interface(handle, 1);
+            libusb_close(handle);
+        }
+        pm[slot]->handle = NULL;
+        pm[slot]->offline = false;
+        return false;
+    }
+    prodikeys_reader_capture(&reader[slot], capture, (uint8_t) slot);
+    //the port lives as long as the keyboard is attached, the piano key only gates it
+    if (!prodikeysd_open_port(pm[slot]))
+        fprintf(stderr, "prodikeysd: couldn't create sequencer port for keyboard %d\n", slot + 1);
+    else if (replugged)
+        prodikeys_restore_values(pm[slot], &last_state[slot]);
+    else if (midi_on_attach)
+        prodikeys_enable_midi(pm[slot]);
+    prodikeys_stats_ready();
+    return true;
+}
+
+/* Claim a newly plugged keyboard, give it a slot and start reading it.
+ * A keyboard replugged in the port it was unplugged from gets its slot and state back */
+static void prodikeysd_attach(libusb_device *device){
+    libusb_device_handle *handle;
+    struct prodikeys_location where;
+    prodikeys_location_get(device, &where);
+    int slot = prodikeysd_slot(&where);
+    if (slot < 0 || !prodikeys_claim_device(device, &handle))
+        return;
+    bool replugged = prodikeys_location_equal(&location[slot], &where);
+    if (!prodikeysd_attach_slot(slot, handle, NULL, &where))
+        return;
+    fprintf(stderr, "prodikeysd: keyboard %d %s (bus %d, address %d)\n", slot + 1, replugged ? "reattached" : "attached",
+            libusb_get_bus_number(device), libusb_get_device_address(device));
+}
+
+/* Release an unplugged keyboard slot, reporting how the reports of a claimed keyboard fared against the latency budget.
+ * A simulated keyboard is unplugged silently (replug benchmark) */
+static void prodikeysd_detach(int slot){
+    struct prodikeys_reader *r = &reader[slot];
+    struct pcmidi_snd *dev = pm[slot];
+    bool claimed = dev->handle != NULL;
+
+    prodikeys_reader_stop(r);
+    if (claimed && r->completed > 0){
+        fprintf(stderr, "prodikeysd: keyboard %d: %lu reports, %lu underruns, latency avg %llu us max %llu us (budget %d us)%s\n",
+                slot + 1, r->completed, r->starved.load(),
+                (unsigned long long) (r->latency_total_ns / r->completed / 1000),
+                (unsigned long long) (r->latency_max_ns / 1000),
+                PRODIKEYSD_LATENCY_BUDGET_NS / 1000,
+                r->latency_max_ns > PRODIKEYSD_LATENCY_BUDGET_NS ? " EXCEEDED" : "");
+    }
+
+    prodikeys_snapshot_read(dev, &last_state[slot]);
+    prodikeys_cmd_free(dev);
+    pcmidi_close_port(dev);
+    if (claimed){
+        libusb_release_interface(dev->handle, 1);
+        libusb_close(dev->handle);
+    }
+    dev->handle = NULL;
+    dev->offline = false;
+    dev->sim = NULL;
+    prodikeys_snapshot_publish(dev);
+    if (claimed)
+        fprintf(stderr, "prodikeysd: keyboard %d detached\n", slot + 1);
+}
+
+/* Write the statistics JSON dump, replacing the previous one */
+static void prodikeysd_dump_stats(){
+    char json[8192];
+    int len = prodikeys_stats_json(json, sizeof(json));
+    FILE *out = stats_path != NULL ? fopen(stats_path, "w") : stderr;
+    if (out == NULL){
+        fprintf(stderr, "prodikeysd: couldn't write %s\n", stats_path);
+        return;
+    }
+    fwrite(json, 1, len, out);
+    if (out != stderr) fclose(out);
+
+    //taken from the signal thread, while the main thread keeps decoding
+    for (int slot = 0; slot < PRODIKEYS_MAX_DEVICES; slot++){
+        struct prodikeys_snapshot state;
+        if (pm[slot] == NULL) continue;
+        prodikeys_snapshot_read(pm[slot], &state);
+        if (!state.connected) continue;
+        fprintf(stderr, "prodikeysd: keyboard %d: piano keys %s, channel %d, octave %+d, instrument %d, pitch %d, fn %s, sustain %s\n",
+                slot + 1, state.midi_mode ? "on" : "off", state.channel + 1, state.octave, state.instrument, state.pitch,
+                state.fn_state ? "on" : "off", state.sustain_mode ? "on" : "off");
+    }
+}
+
+/* Read the snapshot of every replayed device until stopped, checking that each one is in range and newer than the last */
+static void *prodikeysd_snapshot_read(void *arg){
+    struct prodikeysd_snapshot_reader *r = static_cast<prodikeysd_snapshot_reader *>(arg);
+    uint32_t versions[PRODIKEYS_MAX_DEVICES] = {0};
+    while (r->running->load(std::memory_order_relaxed)){
+        for (int slot = 0; slot < r->devices; slot++){
+            struct prodikeys_snapshot state;
+            r->retries += prodikeys_snapshot_read(pm[slot], &state);
+            r->reads++;
+            if (state.version < versions[slot] || state.channel > PCMIDI_CHANNEL_MAX || state.instrument > PCMIDI_INST_MAX
+                || state.octave < PCMIDI_OCTAVE_MIN || state.octave > PCMIDI_OCTAVE_MAX || state.pitch > PCMIDI_PITCH_MAX)
+                r->inconsistent++;
+            versions[slot] = state.version;
+        }
+    }
+    return NULL;
+}
+
+/* Start the output and executor threads, keyboards then queue their MIDI events and launches to them */
+static void prodikeysd_output_start(){
+    struct prodikeys_rt_config output_rt = {rt.policy, rt.priority, output_cpu};
+    if (output_thread && !prodikeys_output_start(overflow, &output_rt))
+        fprintf(stderr, "prodikeysd: couldn't start the output thread, writing MIDI events inline\n");
+    if (!sync_actions && !prodikeys_executor_start())
+        fprintf(stderr, "prodikeysd: couldn't start the executor thread, launching applications inline\n");
+}
+
+/* Waits for termination signals (and statistics requests) so the main thread never has to be woken up periodically */
+static void *prodikeysd_signals(void *arg){
+    sigset_t *signals = static_cast<sigset_t *>(arg);
+    int sig;
+    while (sigwait(signals, &sig) == 0 && sig == SIGUSR1)
+        prodikeysd_dump_stats();
+    running = false;
+    if (replay_path == NULL)
+        libusb_interrupt_event_handler(NULL);
+    return NULL;
+}
+
+/* Unplug and replug the first replayed keyboard through prodikeysd_detach and prodikeysd_attach_slot, a simulated
+ * keyboard being plugged back each time at the location the replayed one had, and time each replug up to the first
+ * note it plays handed to the port. The state it was unplugged with (the trace's, then whatever the simulated keyboard
+ * changed before its first note) is expected back after every replug, unless cold_replug is set */
+static void prodikeysd_replug(){
+    static struct prodikeys_sim sim;
+    static struct prodikeys_report release;
+    const struct prodikeys_location where = {0, 1, {1}};    // offline keyboards have no bus, port 1 of bus 0 stands in
+    unsigned long cycles = 0, restored = 0;
+    uint64_t total_ns = 0, max_ns = 0;
+
+    location[0] = where;
+
+    for (; (int) cycles < replug_cycles && running; cycles++){
+        struct prodikeys_snapshot state;
+        prodikeysd_detach(0);
+
+        uint64_t start = prodikeys_now_ns();
+        if (cold_replug){
+            //as every reconnect used to : a libusb context and device scan of its own, the slot location forgotten
+            libusb_context *ctx;
+            libusb_device **list;
+            if (libusb_init(&ctx) == 0){
+                ssize_t num_devices = libusb_get_device_list(ctx, &list);
+                if (num_devices >= 0)
+                    libusb_free_device_list(list, 1);
+                libusb_exit(ctx);
+            }
+            location[0].num_ports = 0;
+        }
+        if (!prodikeysd_attach_slot(0, NULL, &sim, &where))
+            break;
+        prodikeys_snapshot_read(pm[0], &state);
+
+        //read until its first note, what it played before (buttons, query replies) included
+        int report_id;
+        do report_id = prodikeys_reader_play(&reader[0]);
+        while (report_id != 0 && report_id != 3);
+        uint64_t ns = prodikeys_now_ns() - start;
+        prodikeys_stats_stage(PRODIKEYS_STAGE_REPLUG, ns);
+        total_ns += ns;
+        if (ns > max_ns) max_ns = ns;
+
+        //hands lifted, no note left held when it gets unplugged
+        prodikeys_sim_release(&sim, &release);
+        if (release.length > 0){
+            prodikeys_sim_played(&sim, &release);
+            release.timestamp_ns = prodikeys_now_ns();
+            pcmidi_handle_report(pm[0], &release);
+        }
+
+        const struct prodikeys_snapshot *unplugged = &last_state[0];
+        if (state.midi_mode == unplugged->midi_mode && state.fn_state == unplugged->fn_state
+            && state.sustain_mode == unplugged->sustain_mode && state.channel == unplugged->channel
+            && state.octave == unplugged->octave && state.instrument == unplugged->instrument
+            && state.pitch == unplugged->pitch)
+            restored++;
+    }
+    if (cycles > 0)
+        fprintf(stderr, "prodikeysd: %lu %sreplugs, first note after avg %llu us max %llu us, state kept %lu times\n",
+                cycles, cold_replug ? "cold " : "", (unsigned long long) (total_ns / cycles / 1000),
+                (unsigned long long) (max_ns / 1000), restored);
+}
+
+/* Replay a trace through the decoder, one offline slot per keyboard found in the trace */
+static int prodikeysd_replay(){
+    struct prodikeys_trace_map map;
+    struct prodikeys_replay_stats stats;
+    if (!prodikeys_trace_mmap(&map, replay_path)){
+        fprintf(stderr, "prodikeysd: %s is not a readable trace\n", replay_path);
+        return 1;
+    }
+
+    int devices = prodikeys_trace_devices(&map);
+    if (devices > PRODIKEYS_MAX_DEVICES) devices = PRODIKEYS_MAX_DEVICES;
+    for (int slot = 0; slot < devices; slot++){
+        prodikeysd_slot_init(slot, NULL);
+        pm_init_values(pm[slot]);
+        if (!prodikeysd_open_port(pm[slot]))
+            fprintf(stderr, "prodikeysd: couldn't create sequencer port for keyboard %d\n", slot + 1);
+        else if (midi_on_attach)
+            prodikeys_enable_midi(pm[slot]);
+    }
+    if (devices > 0)
+        prodikeys_stats_ready();
+
+    //UI and control clients stand-ins, reading while the replay publishes at full speed
+    static struct prodikeysd_snapshot_reader readers[PRODIKEYS_MAX_DEVICES];
+    std::atomic<bool> readers_running(true);
+    int num_readers = 0;
+    for (; num_readers < snapshot_readers && num_readers < PRODIKEYS_MAX_DEVICES; num_readers++){
+        struct prodikeysd_snapshot_reader *r = &readers[num_readers];
+        r->devices = devices;
+        r->running = &readers_running;
+        if (pthread_create(&r->thread, NULL, prodikeysd_snapshot_read, r) != 0) break;
+    }
+
+    prodikeys_trace_replay(&map, pm, devices, !replay_fast, &running, &stats);
+
+    readers_running = false;
+    unsigned long reads = 0, retries = 0, inconsistent = 0;
+    for (int i = 0; i < num_readers; i++){
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].reads;
+        retries += readers[i].retries;
+        inconsistent += readers[i].inconsistent;
+    }
+    fprintf(stderr, "prodikeysd: replayed %lu reports (%lu skipped) in %llu ms, %llu reports/s, latency avg %llu us max %llu us",
+            stats.reports, stats.skipped,
+            (unsigned long long) (stats.elapsed_ns / 1000000),
+            (unsigned long long) (stats.elapsed_ns > 0 ? stats.reports * 1000000000ULL / stats.elapsed_ns : 0),
+            (unsigned long long) (stats.reports > 0 ? stats.latency_total_ns / stats.reports / 1000 : 0),
+            (unsigned long long) (stats.latency_max_ns / 1000));
+    if (!replay_fast)
+        fprintf(stderr, ", lateness max %llu us", (unsigned long long) (stats.lateness_max_ns / 1000));
+    fprintf(stderr, "\n");
+    if (num_readers > 0)
+        fprintf(stderr, "prodikeysd: %d snapshot readers, %lu snapshots (%llu/s), %lu retries, %lu inconsistent\n",
+                num_readers, reads, (unsigned long long) (stats.elapsed_ns > 0 ? reads * 1000000000ULL / stats.elapsed_ns : 0),
+                retries, inconsistent);
+    if (devices > 0)
+        prodikeysd_replug();
+
+    for (int slot = 0; slot < devices; slot++){
+        prodikeys_disable_midi(pm[slot]);
+        pcmidi_close_port(pm[slot]);
+    }
+    if (shared_port != NULL)
+        pcmidi_port_close(shared_port);
+    prodikeys_trace_munmap(&map);
+    return 0;
+}
+
+/* Play simulated keyboards for simulate_s virtual seconds, one offline slot each. The keyboards are queried (C3, C4)
+ * once attached, and must end up agreeing with their slot on the FN led and piano keys, with no note left held */
+static int prodikeysd_simulate(){
+    static struct prodikeys_sim sims[PRODIKEYS_MAX_DEVICES];
+    struct prodikeys_replay_stats stats;
+    struct prodikeys_sim_stats sim_stats;
+
+    int devices = sim_keyboards < 1 ? 1 : sim_keyboards < PRODIKEYS_MAX_DEVICES ? sim_keyboards : PRODIKEYS_MAX_DEVICES;
+    for (int slot = 0; slot < devices; slot++){
+        prodikeysd_slot_init(slot, NULL);
+        prodikeys_sim_init(&sims[slot], pm[slot], sim_seed + slot);
+        pm_init_values(pm[slot]);
+        if (!prodikeysd_open_port(pm[slot]))
+            fprintf(stderr, "prodikeysd: couldn't create sequencer port for keyboard %d\n", slot + 1);
+        else if (midi_on_attach)
+            prodikeys_enable_midi(pm[slot]);
+        prodikeys_send_hid_data(pm[slot], 0xC3);
+        prodikeys_send_hid_data(pm[slot], 0xC4);
+    }
+    prodikeys_stats_ready();
+
+    prodikeys_sim_run(sims, devices, (uint64_t) (simulate_s * 1e9), capture, &running, &stats, &sim_stats);
+
+    fprintf(stderr, "prodikeysd: simulated %d keyboards for %.1f s in %llu ms, %lu reports (%lu notes, %lu buttons, %lu replies), "
+                    "%llu reports/s, latency avg %llu us max %llu us\n",
+            devices, (double) sim_stats.played_ns / 1e9, (unsigned long long) (stats.elapsed_ns / 1000000),
+            stats.reports, sim_stats.reports[3], sim_stats.reports[1] + sim_stats.reports[2] + sim_stats.reports[4],
+            sim_stats.reports[5],
+            (unsigned long long) (stats.elapsed_ns > 0 ? stats.reports * 1000000000ULL / stats.elapsed_ns : 0),
+            (unsigned long long) (stats.reports > 0 ? stats.latency_total_ns / stats.reports / 1000 : 0),
+            (unsigned long long) (stats.latency_max_ns / 1000));
+    fprintf(stderr, "prodikeysd: commands C1 %lu, C2 %lu, C3 %lu, C4 %lu, C5 %lu, C6 %lu, %lu keyboards out of step\n",
+            sim_stats.commands[0], sim_stats.commands[1], sim_stats.commands[2], sim_stats.commands[3],
+            sim_stats.commands[4], sim_stats.commands[5], sim_stats.mismatches);
+    //every keyboard is decoded by the same thread and shares the output thread, so each one is held up by the others
+    for (int slot = 0; slot < devices; slot++){
+        const struct prodikeys_histogram *latency = &sims[slot].latency;
+        uint64_t count = latency->count.load(std::memory_order_relaxed);
+        uint64_t max_ns = latency->max_ns.load(std::memory_order_relaxed);
+        if (count == 0) continue;
+        fprintf(stderr, "prodikeysd: keyboard %d: %llu reports, latency avg %llu us p99 %llu us max %llu us (budget %d us)%s\n",
+                slot + 1, (unsigned long long) count,
+                (unsigned long long) (latency->sum_ns.load(std::memory_order_relaxed) / count / 1000),
+                (unsigned long long) (prodikeys_hist_percentile(latency, 0.99) / 1000),
+                (unsigned long long) (max_ns / 1000), PRODIKEYSD_LATENCY_BUDGET_NS / 1000,
+                max_ns > PRODIKEYSD_LATENCY_BUDGET_NS ? " EXCEEDED" : "");
+    }
+
+    for (int slot = 0; slot < devices; slot++){
+        prodikeys_disable_midi(pm[slot]);
+        pcmidi_close_port(pm[slot]);
+    }
+    if (shared_port != NULL)
+        pcmidi_port_close(shared_port);
+    return sim_stats.mismatches == 0 ? 0 : 1;
+}
+
+static void prodikeysd_usage(){
+    fprintf(stderr, "usage: prodikeysd [--merge] [--transfers=N] [--no-midi] [--stats=FILE] [--capture=FILE | --replay=FILE [--fast]]\n"
+                    "                  [--simulate=SECONDS [--sim-keyboards=N] [--sim-seed=N]]\n"
+                    "                  [--rt=POLICY] [--rt-priority=N] [--cpu=N] [--mlock]\n"
+                    "                  [--keymap=FILE] [--sync-actions] [--no-keys] [--snapshot-readers=N]\n"
+                    "                  [--replug=N [--cold-replug]] [--overflow=POLICY] [--output-cpu=N] [--no-output-thread]\n"
+                    "  --merge         all keyboards share a single sequencer port, keyboard n starting on channel n\n"
+                    "  --transfers=N   USB reads kept in flight on each keyboard (default %d, max %d)\n"
+                    "  --no-midi       don't enable piano keys on attach (use the piano key)\n"
+                    "  --stats=FILE    write the statistics there on SIGUSR1 and on exit (default stderr)\n"
+                    "  --capture=FILE  record every report read to a trace file\n"
+                    "  --replay=FILE   feed a trace file to the decoder instead of reading keyboards\n"
+                    "  --fast          replay as fast as possible instead of with the original timing\n"
+                    "  --simulate=SECONDS  play simulated keyboards for SECONDS of virtual time instead of reading keyboards,\n"
+                    "                  as fast as possible (--capture records what they played)\n"
+                    "  --sim-keyboards=N  simulated keyboards (default 1)\n"
+                    "  --sim-seed=N    performance of the simulated keyboards (default 1)\n"
+                    "  --snapshot-readers=N  read the keyboards state from N threads during the replay (stress test)\n"
+                    "  --replug=N      unplug and replug the first replayed keyboard N times after the replay, a simulated\n"
+                    "                  keyboard coming back through the attach path, timing each replug up to its first\n"
+                    "                  note (benchmark)\n"
+                    "  --cold-replug   replugged keyboards start over from default values, libusb initialized\n"
+                    "                  again and devices scanned for each (benchmark baseline)\n"
+                    "  --rt=POLICY     real-time scheduling of the note path : fifo, rr or default\n"
+                    "  --rt-priority=N real-time priority (1 to 99, default %d)\n"
+                    "  --cpu=N         pin the note path to cpu N\n"
+                    "  --mlock         lock all memory, the note path never takes a page fault\n"
+                    "  --no-keys       don't forward media and system keys (through a uinput keyboard)\n"
+                    "  --sync-actions  launch applications from the note path instead of the executor thread (benchmark baseline)\n"
+                    "  --keymap=FILE   rebind function buttons (format in prodikeys-keymap.h), reloaded when the file changes\n"
+                    "  --overflow=POLICY  when the output thread falls %d events behind a keyboard :\n"
+                    "                  drop-oldest (default), coalesce (merge pitch bends, drop the rest) or block\n"
+                    "  --output-cpu=N  pin the output thread to cpu N (it gets the --rt scheduling too)\n"
+                    "  --no-output-thread  write MIDI events from the note path itself\n",
+                    PRODIKEYS_READ_TRANSFERS_DEFAULT, PRODIKEYS_READ_TRANSFERS_MAX, PRODIKEYS_RT_PRIORITY_DEFAULT,
+                    PRODIKEYS_RING_SIZE);
+#ifdef PRODIKEYS_BASELINES
+    fprintf(stderr, "benchmark baselines, the former code paths :\n"
+                    "  --no-batch      write every note on its own instead of a whole report at once\n"
+                    "  --no-note-map   compute the note of every key instead of looking it up\n"
+                    "  --port-per-toggle  create the port when piano keys get enabled and close it when they get\n"
+                    "                  disabled instead of keeping it while the keyboard is attached\n");
+#endif
+}
+
+int main(int argc, char **argv){
+    const char *capture_path = NULL;
+    const char *keymap_path = NULL;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--merge") == 0)
+            merge_ports = true;
+        else if (strncmp(argv[i], "--transfers=", 12) == 0)
+            read_transfers = atoi(argv[i] + 12);
+        else if (strcmp(argv[i], "--no-midi") == 0)
+            midi_on_attach = false;
+        else if (strncmp(argv[i], "--capture=", 10) == 0)
+            capture_path = argv[i] + 10;
+        else if (strncmp(argv[i], "--replay=", 9) == 0)
+            replay_path = argv[i] + 9;
+        else if (strcmp(argv[i], "--fast") == 0)
+            replay_fast = true;
+        else if (strncmp(argv[i], "--simulate=", 11) == 0)
+            simulate_s = atof(argv[i] + 11);
+        else if (strncmp(argv[i], "--sim-keyboards=", 16) == 0)
+            sim_keyboards = atoi(argv[i] + 16);
+        else if (strncmp(argv[i], "--sim-seed=", 11) == 0)
+            sim_seed = (uint32_t) strtoul(argv[i] + 11, NULL, 0);
+        else if (strncmp(argv[i], "--snapshot-readers=", 19) == 0)
+            snapshot_readers = atoi(argv[i] + 19);
+        else if (strncmp(argv[i], "--replug=", 9) == 0)
+            replug_cycles = atoi(argv[i] + 9);
+        else if (strcmp(argv[i], "--cold-replug") == 0)
+            cold_replug = true;
+        else if (strncmp(argv[i], "--stats=", 8) == 0)
+            stats_path = argv[i] + 8;
+        else if (strncmp(argv[i], "--rt=", 5) == 0 && prodikeys_sched_policy_parse(argv[i] + 5, &rt.policy))
+            continue;
+        else if (strncmp(argv[i], "--rt-priority=", 14) == 0)
+            rt.priority = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--cpu=", 6) == 0)
+            rt.cpu = atoi(argv[i] + 6);
+        else if (strcmp(argv[i], "--mlock") == 0)
+            lock_memory = true;
+        else if (strcmp(argv[i], "--no-keys") == 0)
+            forward_keys = false;
+        else if (strcmp(argv[i], "--sync-actions") == 0)
+            sync_actions = true;
+        else if (strncmp(argv[i], "--keymap=", 9) == 0)
+            keymap_path = argv[i] + 9;
+        else if (strncmp(argv[i], "--overflow=", 11) == 0 && prodikeys_overflow_policy_parse(argv[i] + 11, &overflow))
+            continue;
+        else if (strncmp(argv[i], "--output-cpu=", 13) == 0)
+            output_cpu = atoi(argv[i] + 13);
+        else if (strcmp(argv[i], "--no-output-thread") == 0)
+            output_thread = false;
+#ifdef PRODIKEYS_BASELINES
+        else if (strcmp(argv[i], "--no-batch") == 0)
+            single_note_sends = true;
+        else if (strcmp(argv[i], "--no-note-map") == 0)
+            computed_notes = true;
+        else if (strcmp(argv[i], "--port-per-toggle") == 0)
+            port_per_toggle = true;
+#endif
+        else {
+            prodikeysd_usage();
+            return 1;
+        }
+    }
+
+    //block termination signals in every thread (including libusb ones) and wait for them in a dedicated one
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGCHLD, SIG_IGN); //launched applications are never waited for
+
+    prodikeys_stats_reset();
+    if (keymap_path != NULL && !prodikeys_keymap_watch(keymap_path)){
+        prodikeys_keymap_unwatch();
+        return 1;
+    }
+    if (lock_memory)
+        prodikeys_lock_process();
+    pthread_t signal_thread;
+    if (replay_path != NULL || simulate_s > 0){
+        //a simulation can be captured, to be replayed later
+        if (replay_path == NULL && capture_path != NULL && (capture = prodikeys_trace_create(capture_path)) == NULL){
+            fprintf(stderr, "prodikeysd: couldn't create %s\n", capture_path);
+            prodikeys_keymap_unwatch();
+            return 1;
+        }
+        prodikeysd_output_start();
+        pthread_create(&signal_thread, NULL, prodikeysd_signals, &signals);
+        prodikeys_thread_realtime(&rt);
+        int ret = replay_path != NULL ? prodikeysd_replay() : prodikeysd_simulate();
+        pthread_kill(signal_thread, SIGTERM); //unblock the signal thread if the replay ran to its end
+        pthread_join(signal_thread, NULL);
+        prodikeys_output_stop();
+        prodikeys_executor_stop();
+        prodikeys_keymap_unwatch();
+        prodikeys_trace_close(capture);
+        prodikeysd_dump_stats();
+        return ret;
+    }
+
+    if (capture_path != NULL && (capture = prodikeys_trace_create(capture_path)) == NULL){
+        fprintf(stderr, "prodikeysd: couldn't create %s\n", capture_path);
+        prodikeys_keymap_unwatch();
+        return 1;
+    }
+    if (libusb_init(NULL) != 0){
+        fprintf(stderr, "prodikeysd: error initialising libusb\n");
+        prodikeys_keymap_unwatch();
+        return 1;
+    }
+
+    //never during a replay, replayed media keys would go to the desktop
+    if (forward_keys && (injector = prodikeys_injector_open("Prodikeys media keys")) != NULL)
+        prodikeys_executor_injector(injector);
+    prodikeysd_output_start();
+    pthread_create(&signal_thread, NULL, prodikeysd_signals, &signals);
+    //after libusb_init and the signal thread, so that neither libusb nor the signal thread inherit it
+    prodikeys_thread_realtime(&rt);
+
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+        libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+                                         PRODIKEYS_VID, PRODIKEYS_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+                                         prodikeysd_hotplug, NULL, NULL);
+    } else {
+        fprintf(stderr, "prodikeysd: libusb hotplug unavailable, keyboards plugged later won't be attached\n");
+        libusb_device **list;
+        ssize_t num_devices = libusb_get_device_list(NULL, &list);
+        for (ssize_t i = 0; i < num_devices; i++)
+            prodikeysd_attach(list[i]);
+        if (num_devices >= 0)
+            libusb_free_device_list(list, 1);
+    }
+
+    while (running){
+        //keyboards already plugged in at startup were announced while registering, attach them before blocking
+        while (num_arrived > 0){
+            libusb_device *device = arrived[--num_arrived];
+            prodikeysd_attach(device);
+            libusb_unref_device(device);
+        }
+
+        //failed reads wait out their backoff without keeping libusb from blocking until then
+        uint64_t wait_ns = 0;
+        for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++){
+            if (pm[i] == NULL || pm[i]->handle == NULL) continue;
+            uint64_t due_ns = prodikeys_reader_service(&reader[i]);
+            if (due_ns != 0 && (wait_ns == 0 || due_ns < wait_ns)) wait_ns = due_ns;
+        }
+        if (wait_ns == 0){
+            libusb_handle_events_completed(NULL, NULL);
+        } else {
+            uint64_t wait_us = (wait_ns + 999) / 1000;
+            struct timeval tv = {(long) (wait_us / 1000000), (long) (wait_us % 1000000)};
+            libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+        }
+
+        //unplugged keyboards are noticed by their read ring (LIBUSB_TRANSFER_NO_DEVICE, or reads failing for a second)
+        for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++){
+            if (pm[i] != NULL && pm[i]->handle != NULL && reader[i].disconnected && reader[i].in_flight == 0)
+                prodikeysd_detach(i);
+        }
+    }
+
+    for (int i = 0; i < PRODIKEYS_MAX_DEVICES; i++){
+        if (pm[i] == NULL || pm[i]->handle == NULL) continue;
+        prodikeys_disable_midi(pm[i]);
+        prodikeysd_detach(i);
+    }
+    prodikeys_output_stop();
+    prodikeys_executor_stop();
+    prodikeys_executor_injector(NULL);
+    prodikeys_injector_close(injector);
+    prodikeys_keymap_unwatch();
+    if (shared_port != NULL)
+        pcmidi_port_close(shared_port);
+    pthread_join(signal_thread, NULL);
+    libusb_exit(NULL);
+    prodikeys_trace_close(capture);
+    prodikeysd_dump_stats();
+    return 0;
+}
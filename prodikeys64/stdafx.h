@@ -17,9 +17,12 @@
 #include <commctrl.h>
 #include <Shellapi.h>
 #include <Shlwapi.h>
+#include <Dbt.h>
 
 // C RunTime Header Files
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <malloc.h>
 #include <memory.h>
 #include <tchar.h>
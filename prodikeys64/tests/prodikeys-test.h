@@ -0,0 +1,38 @@
+/* Prodikeys MIDI Interface - tests
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Tests are plain programs run by ctest, playing simulated keyboards (prodikeys-sim.h) so that no keyboard is needed.
+ * They exit with 0 when every check passed, 1 when one failed and PRODIKEYS_TEST_SKIP when they can't run here.
+ */
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include "prodikeys-core.h"
+#include "prodikeys-sim.h"
+
+#define PRODIKEYS_TEST_SKIP 77      // ctest SKIP_RETURN_CODE
+
+static int prodikeys_test_failures = 0;
+
+#define PRODIKEYS_CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            prodikeys_test_failures++; \
+        } \
+    } while (0)
+
+/* Exit code of a test once its checks are done */
+static inline int prodikeys_test_result(){
+    return prodikeys_test_failures == 0 ? 0 : 1;
+}
+
+/* Attach a simulated keyboard to an offline device, as prodikeysd does for --simulate : port open, piano keys on */
+static inline void prodikeys_test_device(struct pcmidi_snd *pm, struct prodikeys_sim *sim, int slot, uint32_t seed){
+    memset((void *) pm, 0, sizeof(struct pcmidi_snd));
+    pm->offline = true;
+    snprintf(pm->port_name, 64, "Prodikeys test %d", slot + 1);
+    prodikeys_sim_init(sim, pm, seed);
+    pm_init_values(pm);
+    pcmidi_open_port(pm);
+    prodikeys_enable_midi(pm);
+}
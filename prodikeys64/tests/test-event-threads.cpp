@@ -0,0 +1,380 @@
+/* Prodikeys MIDI Interface - keyboards event handling test
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Two keyboards are claimed and read by their supervisor threads, as the tray application does it, through a libusb
+ * double (linker --wrap) : each keyboard completes a read every PRODIKEYS_TEST_PERIOD_NS, and a completion is handed
+ * to whichever thread handles the events of the context its keyboard was opened in, one thread at a time, as libusb does.
+ * The reads and commands of a keyboard must only ever complete on its own reading thread, which alone makes its
+ * tray requests and writes its device state and output ring, while both keyboards play and piano keys are turned on
+ * and off from the tray. Releasing a keyboard (stopping its thread, writing its last commands) must not complete
+ * anything of the other one.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "prodikeys-output.h"
+#include "prodikeys-supervisor.h"
+#include "prodikeys-test.h"
+
+#define PRODIKEYS_TEST_KEYBOARDS 2
+#define PRODIKEYS_TEST_PERIOD_NS 200000ULL      // a keyboard completes a read that long after it was submitted
+#define PRODIKEYS_TEST_TOGGLES 20               // piano keys turned off and on again from the tray
+#define PRODIKEYS_TEST_PLAY_US 20000            // playing between two toggles, and while the other keyboard is released
+#define PRODIKEYS_TEST_WAIT_US 5000000          // longest wait for a reading thread, in 1 ms steps
+#define PRODIKEYS_TEST_REPORTS_MIN 100          // reads each keyboard must at least complete
+
+/* libusb double : contexts, devices and handles are ours, transfers complete from the event handling calls */
+
+//A libusb context, the default one being used for NULL
+struct prodikeys_test_context {
+    bool                handling;           // a thread is handling its events
+    bool                interrupted;        // libusb_interrupt_event_handler was called since
+};
+
+//A keyboard as listed in a context, or opened
+struct prodikeys_test_usb {
+    struct prodikeys_test_context *context;
+    int                 keyboard;
+};
+
+//A submitted transfer
+struct prodikeys_test_transfer {
+    struct libusb_transfer *transfer;
+    uint64_t            due_ns;             // when it completes
+    bool                cancelled;
+};
+
+//What happened to a keyboard
+struct prodikeys_test_keyboard {
+    bool                open;               // a handle is open on it, it can't be opened again
+    bool                reading;            // a reading thread submitted its reads
+    std::thread::id     reader;             // that thread
+    bool                released;           // its reading thread was stopped, the application handles its events
+    unsigned long       reports;            // reads completed
+    unsigned long       commands;           // commands written
+    unsigned long       foreign;            // transfers completed by another thread than its reading thread
+    uint8_t             key;                // piano key it presses and releases
+};
+
+static std::mutex lock;
+static std::condition_variable changed;
+static struct prodikeys_test_context default_context;
+static std::vector<struct prodikeys_test_transfer> submitted;
+static struct prodikeys_test_keyboard keyboards[PRODIKEYS_TEST_KEYBOARDS];
+static int live_contexts = 0;               // contexts initialized and not exited yet
+static int live_transfers = 0;              // transfers allocated and not freed yet
+
+static struct prodikeys_test_context *prodikeys_test_ctx(libusb_context *ctx){
+    return ctx != NULL ? reinterpret_cast<prodikeys_test_context *>(ctx) : &default_context;
+}
+
+static struct prodikeys_test_usb *prodikeys_test_handle(libusb_device_handle *handle){
+    return reinterpret_cast<prodikeys_test_usb *>(handle);
+}
+
+/* Complete a transfer, lock held. Reads get the next report of their keyboard, a press or a release of its key */
+static void prodikeys_test_complete(struct prodikeys_test_transfer *pending){
+    struct libusb_transfer *transfer = pending->transfer;
+    struct prodikeys_test_keyboard *keyboard = &keyboards[prodikeys_test_handle(transfer->dev_handle)->keyboard];
+    if (!keyboard->reading || (std::this_thread::get_id() != keyboard->reader && !keyboard->released))
+        keyboard->foreign++;
+    if (pending->cancelled){
+        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        transfer->actual_length = 0;
+        return;
+    }
+    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    transfer->actual_length = transfer->length;
+    if (transfer->endpoint != PRODIKEYS_ENDPOINT_IN){
+        keyboard->commands++;
+        return;
+    }
+    bool press = keyboard->reports++ % 2 == 0;
+    transfer->buffer[0] = 0x03;
+    transfer->buffer[1] = (uint8_t) (press ? keyboard->key : keyboard->key + 0x40);
+    transfer->buffer[2] = press ? 0x60 : 0;
+    transfer->actual_length = 3;
+}
+
+/* Handle the events of a context until something completed, the wait is interrupted or completed is set */
+static int prodikeys_test_events(libusb_context *ctx, uint64_t timeout_ns, int *completed){
+    struct prodikeys_test_context *context = prodikeys_test_ctx(ctx);
+    uint64_t deadline_ns = prodikeys_now_ns() + timeout_ns;
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;){
+        if (completed != NULL && *completed) return 0;
+        if (context->interrupted){
+            context->interrupted = false;
+            return 0;
+        }
+        uint64_t now = prodikeys_now_ns(), next_ns = deadline_ns;
+        if (!context->handling){
+            std::vector<struct prodikeys_test_transfer> done;
+            for (size_t i = 0; i < submitted.size();){
+                struct prodikeys_test_transfer *pending = &submitted[i];
+                if (prodikeys_test_handle(pending->transfer->dev_handle)->context != context){
+                    i++;
+                } else if (pending->cancelled || pending->due_ns <= now){
+                    prodikeys_test_complete(pending);
+                    done.push_back(*pending);
+                    submitted.erase(submitted.begin() + i);
+                } else {
+                    next_ns = std::min(next_ns, pending->due_ns);
+                    i++;
+                }
+            }
+            if (!done.empty()){
+                //callbacks run outside of the lock, they submit again
+                context->handling = true;
+                guard.unlock();
+                for (size_t i = 0; i < done.size(); i++)
+                    done[i].transfer->callback(done[i].transfer);
+                guard.lock();
+                context->handling = false;
+                changed.notify_all();
+                return 0;
+            }
+        }
+        if (now >= deadline_ns) return 0;
+        changed.wait_for(guard, std::chrono::nanoseconds(next_ns - now));
+    }
+}
+
+extern "C" {
+int __wrap_libusb_init(libusb_context **ctx){
+    std::lock_guard<std::mutex> guard(lock);
+    if (ctx != NULL)
+        *ctx = reinterpret_cast<libusb_context *>(new prodikeys_test_context());
+    live_contexts++;
+    return 0;
+}
+
+void __wrap_libusb_exit(libusb_context *ctx){
+    std::lock_guard<std::mutex> guard(lock);
+    live_contexts--;
+    if (ctx != NULL) delete prodikeys_test_ctx(ctx);
+}
+
+ssize_t __wrap_libusb_get_device_list(libusb_context *ctx, libusb_device ***list){
+    *list = new libusb_device *[PRODIKEYS_TEST_KEYBOARDS + 1];
+    for (int i = 0; i < PRODIKEYS_TEST_KEYBOARDS; i++)
+        (*list)[i] = reinterpret_cast<libusb_device *>(new prodikeys_test_usb{prodikeys_test_ctx(ctx), i});
+    (*list)[PRODIKEYS_TEST_KEYBOARDS] = NULL;
+    return PRODIKEYS_TEST_KEYBOARDS;
+}
+
+void __wrap_libusb_free_device_list(libusb_device **list, int unref_devices){
+    for (int i = 0; list[i] != NULL; i++)
+        delete reinterpret_cast<prodikeys_test_usb *>(list[i]);
+    delete[] list;
+}
+
+int __wrap_libusb_get_device_descriptor(libusb_device *device, struct libusb_device_descriptor *desc){
+    memset(desc, 0, sizeof(struct libusb_device_descriptor));
+    desc->idVendor = PRODIKEYS_VID;
+    desc->idProduct = PRODIKEYS_PID;
+    return 0;
+}
+
+uint8_t __wrap_libusb_get_bus_number(libusb_device *device){
+    return 1;
+}
+
+uint8_t __wrap_libusb_get_device_address(libusb_device *device){
+    return (uint8_t) (2 + reinterpret_cast<prodikeys_test_usb *>(device)->keyboard);
+}
+
+int __wrap_libusb_get_port_numbers(libusb_device *device, uint8_t *port_numbers, int port_numbers_len){
+    port_numbers[0] = (uint8_t) (1 + reinterpret_cast<prodikeys_test_usb *>(device)->keyboard);
+    return 1;
+}
+
+//as on windows, a keyboard can't be opened twice
+int __wrap_libusb_open(libusb_device *device, libusb_device_handle **handle){
+    std::lock_guard<std::mutex> guard(lock);
+    struct prodikeys_test_usb *listed = reinterpret_cast<prodikeys_test_usb *>(device);
+    if (keyboards[listed->keyboard].open) return LIBUSB_ERROR_ACCESS;
+    keyboards[listed->keyboard].open = true;
+    *handle = reinterpret_cast<libusb_device_handle *>(new prodikeys_test_usb(*listed));
+    return 0;
+}
+
+void __wrap_libusb_close(libusb_device_handle *handle){
+    std::lock_guard<std::mutex> guard(lock);
+    keyboards[prodikeys_test_handle(handle)->keyboard].open = false;
+    delete prodikeys_test_handle(handle);
+}
+
+int __wrap_libusb_set_auto_detach_kernel_driver(libusb_device_handle *handle, int enable){
+    return 0;
+}
+
+int __wrap_libusb_claim_interface(libusb_device_handle *handle, int interface_number){
+    return 0;
+}
+
+int __wrap_libusb_release_interface(libusb_device_handle *handle, int interface_number){
+    return 0;
+}
+
+int __wrap_libusb_clear_halt(libusb_device_handle *handle, unsigned char endpoint){
+    return 0;
+}
+
+struct libusb_transfer *__wrap_libusb_alloc_transfer(int iso_packets){
+    std::lock_guard<std::mutex> guard(lock);
+    live_transfers++;
+    return static_cast<libusb_transfer *>(calloc(1, sizeof(struct libusb_transfer)));
+}
+
+void __wrap_libusb_free_transfer(struct libusb_transfer *transfer){
+    std::lock_guard<std::mutex> guard(lock);
+    live_transfers--;
+    free(transfer);
+}
+
+int __wrap_libusb_submit_transfer(struct libusb_transfer *transfer){
+    std::lock_guard<std::mutex> guard(lock);
+    struct prodikeys_test_keyboard *keyboard = &keyboards[prodikeys_test_handle(transfer->dev_handle)->keyboard];
+    uint64_t due_ns = prodikeys_now_ns();
+    if (transfer->endpoint == PRODIKEYS_ENDPOINT_IN){
+        if (!keyboard->reading){
+            keyboard->reading = true;
+            keyboard->reader = std::this_thread::get_id();
+        }
+        due_ns += PRODIKEYS_TEST_PERIOD_NS;
+    }
+    submitted.push_back(prodikeys_test_transfer{transfer, due_ns, false});
+    changed.notify_all();
+    return 0;
+}
+
+int __wrap_libusb_cancel_transfer(struct libusb_transfer *transfer){
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < submitted.size(); i++){
+        if (submitted[i].transfer != transfer) continue;
+        submitted[i].cancelled = true;
+        changed.notify_all();
+        return 0;
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int __wrap_libusb_handle_events_completed(libusb_context *ctx, int *completed){
+    return prodikeys_test_events(ctx, 60000000000ULL, completed);
+}
+
+int __wrap_libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed){
+    return prodikeys_test_events(ctx, (uint64_t) tv->tv_sec * 1000000000ULL + (uint64_t) tv->tv_usec * 1000, completed);
+}
+
+void __wrap_libusb_lock_event_waiters(libusb_context *ctx){
+    lock.lock();
+}
+
+void __wrap_libusb_unlock_event_waiters(libusb_context *ctx){
+    lock.unlock();
+}
+
+void __wrap_libusb_interrupt_event_handler(libusb_context *ctx){
+    std::lock_guard<std::mutex> guard(lock);
+    prodikeys_test_ctx(ctx)->interrupted = true;
+    changed.notify_all();
+}
+}
+
+/* Wait until a device publishes the piano keys state asked for, false on timeout */
+static bool prodikeys_test_wait_midi(const struct pcmidi_snd *pm, bool midi_mode){
+    for (int waited = 0; waited < PRODIKEYS_TEST_WAIT_US; waited += 1000){
+        struct prodikeys_snapshot state;
+        prodikeys_snapshot_read(pm, &state);
+        if (state.midi_mode == midi_mode) return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+/* Release a keyboard as the tray application does : stop its reading thread, write its last commands, close it */
+static void prodikeys_test_release(int slot, struct pcmidi_snd *pm){
+    prodikeys_supervisor_stop(slot);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        keyboards[slot].released = true;
+    }
+    prodikeys_disable_midi(pm);
+    pcmidi_close_port(pm);
+    prodikeys_cmd_free(pm);
+    libusb_release_interface(pm->handle, 1);
+    libusb_close(pm->handle);
+    libusb_exit(pm->context);
+    pm->handle = NULL;
+    pm->context = NULL;
+}
+
+int main(){
+    static struct pcmidi_snd pm[PRODIKEYS_TEST_KEYBOARDS];
+    libusb_device_handle *handles[PRODIKEYS_TEST_KEYBOARDS];
+    libusb_context *contexts[PRODIKEYS_TEST_KEYBOARDS];
+
+    struct prodikeys_rt_config rt = {PRODIKEYS_SCHED_DEFAULT, PRODIKEYS_RT_PRIORITY_DEFAULT, -1};
+    PRODIKEYS_CHECK(prodikeys_output_start(PRODIKEYS_OVERFLOW_DROP_OLDEST, &rt));
+    struct prodikeys_supervisor_config config;
+    memset(&config, 0, sizeof(config));
+    config.read_transfers = PRODIKEYS_READ_TRANSFERS_DEFAULT;
+    config.rt = rt;
+    prodikeys_supervisor_init(&config);
+
+    libusb_init(NULL);
+    PRODIKEYS_CHECK(prodikeys_claim_interfaces(handles, contexts, PRODIKEYS_TEST_KEYBOARDS) == PRODIKEYS_TEST_KEYBOARDS);
+    for (int slot = 0; slot < PRODIKEYS_TEST_KEYBOARDS; slot++){
+        keyboards[slot].key = (uint8_t) (PRODIKEYS_SIM_KEY_LOW + 12 * slot);
+        memset((void *) &pm[slot], 0, sizeof(struct pcmidi_snd));
+        pm[slot].handle = handles[slot];
+        pm[slot].context = contexts[slot];
+        snprintf(pm[slot].port_name, 64, "Prodikeys test %d", slot + 1);
+        pm[slot].ring = prodikeys_output_ring(slot);
+        PRODIKEYS_CHECK(prodikeys_cmd_init(&pm[slot]));
+        pm_init_values(&pm[slot]);
+        pcmidi_open_port(&pm[slot]);
+        PRODIKEYS_CHECK(prodikeys_supervisor_start(slot, &pm[slot]));
+    }
+
+    //both keyboards play while their piano keys are turned on and off from the tray
+    for (int toggle = 0; toggle < PRODIKEYS_TEST_TOGGLES; toggle++){
+        for (int slot = 0; slot < PRODIKEYS_TEST_KEYBOARDS; slot++)
+            PRODIKEYS_CHECK(prodikeys_supervisor_request(slot, PRODIKEYS_REQUEST_MIDI_ON));
+        for (int slot = 0; slot < PRODIKEYS_TEST_KEYBOARDS; slot++)
+            PRODIKEYS_CHECK(prodikeys_test_wait_midi(&pm[slot], true));
+        usleep(PRODIKEYS_TEST_PLAY_US);
+        for (int slot = 0; slot < PRODIKEYS_TEST_KEYBOARDS; slot++)
+            PRODIKEYS_CHECK(prodikeys_supervisor_request(slot, PRODIKEYS_REQUEST_MIDI_OFF));
+        for (int slot = 0; slot < PRODIKEYS_TEST_KEYBOARDS; slot++)
+            PRODIKEYS_CHECK(prodikeys_test_wait_midi(&pm[slot], false));
+    }
+
+    //the first keyboard is released while the other one goes on playing
+    PRODIKEYS_CHECK(prodikeys_supervisor_request(1, PRODIKEYS_REQUEST_MIDI_ON));
+    prodikeys_test_release(0, &pm[0]);
+    usleep(PRODIKEYS_TEST_PLAY_US);
+    PRODIKEYS_CHECK(prodikeys_supervisor_active(1));
+    prodikeys_test_release(1, &pm[1]);
+    libusb_exit(NULL);
+    prodikeys_output_stop();
+
+    for (int slot = 0; slot < PRODIKEYS_TEST_KEYBOARDS; slot++){
+        fprintf(stderr, "event-threads: keyboard %d, %lu reads and %lu commands completed, %lu by another thread\n",
+                slot + 1, keyboards[slot].reports, keyboards[slot].commands, keyboards[slot].foreign);
+        PRODIKEYS_CHECK(keyboards[slot].foreign == 0);
+        PRODIKEYS_CHECK(keyboards[slot].reports >= PRODIKEYS_TEST_REPORTS_MIN);
+        PRODIKEYS_CHECK(!keyboards[slot].open);
+    }
+    PRODIKEYS_CHECK(submitted.empty());
+    PRODIKEYS_CHECK(live_transfers == 0);
+    PRODIKEYS_CHECK(live_contexts == 0);
+    return prodikeys_test_result();
+}
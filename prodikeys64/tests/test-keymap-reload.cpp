@@ -0,0 +1,80 @@
+/* Prodikeys MIDI Interface - keymap reload test
+ * Copyright 2020, CrazyRedMachine
+ *
+ * A reload frees the keymap it replaces, but only once no reading thread holds it : installing waits for a reader
+ * still dispatching with the previous keymap, not for readers which came after and got the new one. Keymaps are then
+ * reloaded over and over while reading threads keep holding the active one, each reader checking the keymap it holds
+ * stays as it was while it holds it.
+ */
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include "prodikeys-keymap.h"
+#include "prodikeys-test.h"
+
+#define PRODIKEYS_TEST_READERS 2
+#define PRODIKEYS_TEST_RELOADS 10000
+#define PRODIKEYS_TEST_BLOCKED_US 50000     // how long a reload must stay blocked by a held keymap
+
+/* A keymap told apart from the others by the program of its first button */
+static struct prodikeys_keymap *prodikeys_test_keymap(uint8_t mark){
+    struct prodikeys_keymap *map = new struct prodikeys_keymap;
+    prodikeys_keymap_default(map);
+    map->buttons[0][0].state[0].arg[0] = mark;
+    return map;
+}
+
+static std::atomic<bool> reading(true);
+static std::atomic<unsigned long> changed(0);    // keymaps seen changing while held
+
+static void prodikeys_test_reader(){
+    while (reading){
+        unsigned hold;
+        const struct prodikeys_keymap *map = prodikeys_keymap_hold(&hold);
+        uint8_t mark = map->buttons[0][0].state[0].arg[0];
+        std::this_thread::yield();
+        if (map->buttons[0][0].state[0].arg[0] != mark) changed++;
+        prodikeys_keymap_release(hold);
+    }
+}
+
+int main(){
+    //a held keymap isn't freed under its reader : the reload replacing it waits until it is released
+    struct prodikeys_keymap *first = prodikeys_test_keymap(1);
+    prodikeys_keymap_install(first);
+    unsigned hold;
+    const struct prodikeys_keymap *held = prodikeys_keymap_hold(&hold);
+    PRODIKEYS_CHECK(held == first);
+
+    std::atomic<bool> installed(false);
+    struct prodikeys_keymap *second = prodikeys_test_keymap(2);
+    std::thread reload([second, &installed]{
+        prodikeys_keymap_install(second);
+        installed = true;
+    });
+    usleep(PRODIKEYS_TEST_BLOCKED_US);
+    PRODIKEYS_CHECK(!installed);
+    //readers coming meanwhile get the new keymap and don't hold the reload back
+    unsigned next_hold;
+    PRODIKEYS_CHECK(prodikeys_keymap_hold(&next_hold) == second);
+    prodikeys_keymap_release(next_hold);
+    PRODIKEYS_CHECK(held->buttons[0][0].state[0].arg[0] == 1);
+    prodikeys_keymap_release(hold);
+    reload.join();
+    PRODIKEYS_CHECK(installed);
+
+    //reloads while reading threads dispatch : every one of them ends, and no reader sees its keymap change
+    std::thread readers[PRODIKEYS_TEST_READERS];
+    for (int i = 0; i < PRODIKEYS_TEST_READERS; i++)
+        readers[i] = std::thread(prodikeys_test_reader);
+    for (int i = 0; i < PRODIKEYS_TEST_RELOADS; i++)
+        prodikeys_keymap_install(prodikeys_test_keymap((uint8_t) (3 + i % 250)));
+    reading = false;
+    for (int i = 0; i < PRODIKEYS_TEST_READERS; i++)
+        readers[i].join();
+    PRODIKEYS_CHECK(changed == 0);
+
+    prodikeys_keymap_unwatch();
+    fprintf(stderr, "keymap-reload: %d reloads while %d threads were reading\n", PRODIKEYS_TEST_RELOADS, PRODIKEYS_TEST_READERS);
+    return prodikeys_test_result();
+}
@@ -0,0 +1,102 @@
+/* Prodikeys MIDI Interface - report pool test
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Plays a simulated keyboard through its read ring : every report is read into a slot of the report pool and
+ * decoded in place. Once warmed up, the note path must not allocate anything, the slot must go back to the pool
+ * after each report (the same one being taken again), and slots must never be cleared.
+ * Allocations are counted by replacing operator new and by wrapping malloc, calloc and realloc (linker --wrap).
+ */
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include "prodikeys-usb.h"
+#include "prodikeys-stats.h"
+#include "prodikeys-test.h"
+
+#define PRODIKEYS_TEST_WARMUP 64
+#define PRODIKEYS_TEST_REPORTS 20000
+#define PRODIKEYS_TEST_CANARY 0xA5      // a report slot byte no simulated report reaches
+
+static std::atomic<unsigned long> allocations(0);
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size){
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size){
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+}
+
+void *operator new(size_t size){
+    allocations++;
+    void *ptr = __real_malloc(size != 0 ? size : 1);
+    if (ptr == NULL) throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size){
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+int main(){
+    static struct pcmidi_snd pm;
+    static struct prodikeys_sim sim;
+    static struct prodikeys_reader reader;
+
+    prodikeys_stats_reset();
+    prodikeys_test_device(&pm, &sim, 0, 1);
+    PRODIKEYS_CHECK(prodikeys_reader_start(&reader, &pm, PRODIKEYS_READ_TRANSFERS_DEFAULT));
+    PRODIKEYS_CHECK(reader.sim == &sim);
+    for (int i = 0; i < PRODIKEYS_REPORT_POOL_SIZE; i++)
+        memset(reader.pool.slots[i].data, PRODIKEYS_TEST_CANARY, PRODIKEYS_REPORT_SIZE);
+
+    for (int i = 0; i < PRODIKEYS_TEST_WARMUP; i++)
+        prodikeys_reader_play(&reader);
+
+    //the slot on top of the free stack is the one every report is read into
+    uint16_t slot = reader.pool.free_slots[reader.pool.num_free - 1];
+    unsigned long allocated = allocations.load();
+    unsigned long notes = prodikeys_stats.notes.load();
+    int played = 0, reused = 0;
+    for (; played < PRODIKEYS_TEST_REPORTS; played++){
+        if (prodikeys_reader_play(&reader) == 0) break;
+        if (reader.pool.num_free == PRODIKEYS_REPORT_POOL_SIZE && reader.pool.free_slots[reader.pool.num_free - 1] == slot)
+            reused++;
+    }
+    allocated = allocations.load() - allocated;
+
+    PRODIKEYS_CHECK(played == PRODIKEYS_TEST_REPORTS);
+    PRODIKEYS_CHECK(reader.completed == PRODIKEYS_TEST_WARMUP + PRODIKEYS_TEST_REPORTS);
+    PRODIKEYS_CHECK(prodikeys_stats.notes.load() > notes);
+    PRODIKEYS_CHECK(allocated == 0);
+    PRODIKEYS_CHECK(reused == played);
+    PRODIKEYS_CHECK(reader.pool.exhausted == 0);
+    for (int i = 0; i < PRODIKEYS_REPORT_POOL_SIZE; i++)
+        PRODIKEYS_CHECK(reader.pool.slots[i].data[PRODIKEYS_REPORT_SIZE - 1] == PRODIKEYS_TEST_CANARY);
+    fprintf(stderr, "report pool: %d reports, %lu allocations, slot %u reused %d times\n", played, allocated, slot, reused);
+
+    prodikeys_reader_stop(&reader);
+    pcmidi_close_port(&pm);
+    return prodikeys_test_result();
+}
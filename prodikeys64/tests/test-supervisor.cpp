@@ -0,0 +1,122 @@
+/* Prodikeys MIDI Interface - reading threads supervisor test
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Simulated keyboards are unplugged and replugged over and over, as the tray application does it : by stopping
+ * their slot (exit, device node gone) or by unplugging themselves, the disconnected callback being called and the
+ * slot started again once its thread is joined. A slot must never get a second reading thread, starting it again
+ * must fail until the previous one is joined, and stopped threads must not call the disconnected callback.
+ * Tray requests must be made by the reading thread of a running slot.
+ */
+#include <atomic>
+#include <unistd.h>
+#include "prodikeys-supervisor.h"
+#include "prodikeys-test.h"
+
+#define PRODIKEYS_TEST_SLOTS 4
+#define PRODIKEYS_TEST_CYCLES 200
+#define PRODIKEYS_TEST_PLAY_NS 100000000ULL    // virtual time a keyboard plays before unplugging itself
+#define PRODIKEYS_TEST_WAIT_US 5000000         // longest wait for the reading threads, in 1 ms steps
+
+static std::atomic<unsigned> unplugged[PRODIKEYS_TEST_SLOTS];
+
+static void prodikeys_test_disconnected(int slot){
+    unplugged[slot]++;
+}
+
+/* Wait until every slot has been unplugged that many times, false on timeout */
+static bool prodikeys_test_wait_unplugged(unsigned count){
+    for (int waited = 0; waited < PRODIKEYS_TEST_WAIT_US; waited += 1000){
+        bool done = true;
+        for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++)
+            if (unplugged[slot] < count) done = false;
+        if (done) return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+/* Wait until a device publishes the piano keys state asked for, false on timeout */
+static bool prodikeys_test_wait_midi(const struct pcmidi_snd *pm, bool midi_mode){
+    for (int waited = 0; waited < PRODIKEYS_TEST_WAIT_US; waited += 1000){
+        struct prodikeys_snapshot state;
+        prodikeys_snapshot_read(pm, &state);
+        if (state.midi_mode == midi_mode) return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+int main(){
+    static struct pcmidi_snd pm[PRODIKEYS_TEST_SLOTS];
+    static struct prodikeys_sim sims[PRODIKEYS_TEST_SLOTS];
+
+    struct prodikeys_supervisor_config config;
+    memset(&config, 0, sizeof(config));
+    config.read_transfers = PRODIKEYS_READ_TRANSFERS_DEFAULT;
+    config.rt.policy = PRODIKEYS_SCHED_DEFAULT;
+    config.rt.priority = PRODIKEYS_RT_PRIORITY_DEFAULT;
+    config.rt.cpu = -1;
+    config.disconnected = prodikeys_test_disconnected;
+    prodikeys_supervisor_init(&config);
+    for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++)
+        prodikeys_test_device(&pm[slot], &sims[slot], slot, (uint32_t) slot + 1);
+
+    //a slot without a reading thread takes no request
+    PRODIKEYS_CHECK(!prodikeys_supervisor_request(0, PRODIKEYS_REQUEST_MIDI_OFF));
+
+    //unplugged by the application : the slot is stopped, then started again
+    for (int cycle = 0; cycle < PRODIKEYS_TEST_CYCLES; cycle++){
+        for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++){
+            PRODIKEYS_CHECK(prodikeys_supervisor_start(slot, &pm[slot]));
+            PRODIKEYS_CHECK(!prodikeys_supervisor_start(slot, &pm[slot]));
+            PRODIKEYS_CHECK(prodikeys_supervisor_active(slot));
+        }
+        PRODIKEYS_CHECK(prodikeys_supervisor_threads() == PRODIKEYS_TEST_SLOTS);
+        if (cycle == 0){
+            PRODIKEYS_CHECK(prodikeys_supervisor_request(0, PRODIKEYS_REQUEST_MIDI_OFF));
+            PRODIKEYS_CHECK(prodikeys_test_wait_midi(&pm[0], false));
+            PRODIKEYS_CHECK(prodikeys_supervisor_request(0, PRODIKEYS_REQUEST_MIDI_ON));
+            PRODIKEYS_CHECK(prodikeys_test_wait_midi(&pm[0], true));
+        }
+        if (cycle % 2 == 0){
+            for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++)
+                prodikeys_supervisor_stop(slot);
+        } else {
+            prodikeys_supervisor_stop_all();
+        }
+        PRODIKEYS_CHECK(prodikeys_supervisor_threads() == 0);
+        for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++)
+            PRODIKEYS_CHECK(!prodikeys_supervisor_active(slot));
+    }
+    for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++)
+        PRODIKEYS_CHECK(unplugged[slot] == 0);
+
+    //unplugged by the keyboard itself : its thread ends and calls back, the slot is joined then started again
+    unsigned long played = 0;
+    for (int cycle = 0; cycle < PRODIKEYS_TEST_CYCLES; cycle++){
+        for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++){
+            sims[slot].unplug_ns = sims[slot].now_ns + PRODIKEYS_TEST_PLAY_NS;
+            PRODIKEYS_CHECK(prodikeys_supervisor_start(slot, &pm[slot]));
+        }
+        PRODIKEYS_CHECK(prodikeys_test_wait_unplugged((unsigned) cycle + 1));
+        //ended, but a slot is only free again once its thread is joined
+        PRODIKEYS_CHECK(prodikeys_supervisor_threads() == PRODIKEYS_TEST_SLOTS);
+        for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++){
+            PRODIKEYS_CHECK(!prodikeys_supervisor_start(slot, &pm[slot]));
+            prodikeys_supervisor_stop(slot);
+        }
+        PRODIKEYS_CHECK(prodikeys_supervisor_threads() == 0);
+    }
+    for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++){
+        PRODIKEYS_CHECK(unplugged[slot] == PRODIKEYS_TEST_CYCLES);
+        PRODIKEYS_CHECK(sims[slot].now_ns >= PRODIKEYS_TEST_CYCLES * PRODIKEYS_TEST_PLAY_NS);
+        for (int id = 0; id < PRODIKEYS_SIM_REPORT_IDS; id++)
+            played += sims[slot].reports[id];
+    }
+    fprintf(stderr, "supervisor: %d slots, %d stop cycles, %d unplug cycles, %lu reports played\n",
+            PRODIKEYS_TEST_SLOTS, PRODIKEYS_TEST_CYCLES, PRODIKEYS_TEST_CYCLES, played);
+
+    for (int slot = 0; slot < PRODIKEYS_TEST_SLOTS; slot++)
+        pcmidi_close_port(&pm[slot]);
+    return prodikeys_test_result();
+}
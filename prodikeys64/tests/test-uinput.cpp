@@ -0,0 +1,117 @@
+/* Prodikeys MIDI Interface - uinput key injection test
+ * Copyright 2020, CrazyRedMachine
+ *
+ * Creates the uinput keyboard media keys are forwarded through, opens the evdev node the kernel made for it and
+ * reads back what a batch injects : its key events in order, keys without a linux equivalent left out, followed
+ * by a single SYN_REPORT, so that readers get the whole batch in one frame.
+ * Skipped when /dev/uinput can't be written to (or the node can't be read, e.g. outside the input group).
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include "prodikeys-inject.h"
+#include "prodikeys-test.h"
+
+#define PRODIKEYS_TEST_NODE_TRIES 100       // 10 ms apart, for the node to show up in /dev/input
+#define PRODIKEYS_TEST_READ_MS 1000
+
+/* Open the evdev node of the input device with that name, -1 if there is none. *denied is set if a node couldn't be read */
+static int prodikeys_test_open_node(const char *name, bool *denied){
+    DIR *dir = opendir("/dev/input");
+    if (dir == NULL) return -1;
+    int fd = -1;
+    struct dirent *entry;
+    while (fd < 0 && (entry = readdir(dir)) != NULL){
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+        char path[300];
+        snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+        int node = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (node < 0){
+            if (errno == EACCES || errno == EPERM) *denied = true;
+            continue;
+        }
+        char node_name[256] = "";
+        if (ioctl(node, EVIOCGNAME(sizeof(node_name) - 1), node_name) >= 0 && strcmp(node_name, name) == 0)
+            fd = node;
+        else
+            close(node);
+    }
+    closedir(dir);
+    return fd;
+}
+
+/* Read the next event of a node, false if none came in time */
+static bool prodikeys_test_read(int fd, struct input_event *event){
+    struct pollfd pfd = {fd, POLLIN, 0};
+    for (;;){
+        ssize_t length = read(fd, event, sizeof(struct input_event));
+        if (length == (ssize_t) sizeof(struct input_event)) return true;
+        if (length < 0 && errno != EAGAIN && errno != EINTR) return false;
+        if (poll(&pfd, 1, PRODIKEYS_TEST_READ_MS) <= 0) return false;
+    }
+}
+
+/* Check that a batch comes back as its key events then one SYN_REPORT */
+static void prodikeys_test_batch(int fd, const unsigned short *codes, int value, int count){
+    struct input_event event;
+    for (int i = 0; i < count; i++){
+        PRODIKEYS_CHECK(prodikeys_test_read(fd, &event));
+        PRODIKEYS_CHECK(event.type == EV_KEY);
+        PRODIKEYS_CHECK(event.code == codes[i]);
+        PRODIKEYS_CHECK(event.value == value);
+    }
+    PRODIKEYS_CHECK(prodikeys_test_read(fd, &event));
+    PRODIKEYS_CHECK(event.type == EV_SYN && event.code == SYN_REPORT);
+}
+
+int main(){
+    if (access("/dev/uinput", W_OK) != 0){
+        fprintf(stderr, "uinput: /dev/uinput can't be written to, skipped\n");
+        return PRODIKEYS_TEST_SKIP;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "Prodikeys test keys %d", (int) getpid());
+    struct prodikeys_injector *injector = prodikeys_injector_open(name);
+    PRODIKEYS_CHECK(injector != NULL);
+    if (injector == NULL) return prodikeys_test_result();
+
+    int fd = -1;
+    bool denied = false;
+    for (int i = 0; i < PRODIKEYS_TEST_NODE_TRIES && fd < 0; i++){
+        fd = prodikeys_test_open_node(name, &denied);
+        if (fd < 0) usleep(10000);
+    }
+    if (fd < 0 && denied){
+        fprintf(stderr, "uinput: /dev/input nodes can't be read, skipped\n");
+        prodikeys_injector_close(injector);
+        return PRODIKEYS_TEST_SKIP;
+    }
+    PRODIKEYS_CHECK(fd >= 0);
+
+    if (fd >= 0){
+        //0x01 isn't a forwarded key, it is left out of the batch
+        const uint8_t keys[3] = {PRODIKEYS_KEY_VOLUME_UP, 0x01, PRODIKEYS_KEY_MEDIA_PLAY_PAUSE};
+        const bool pressed[3] = {true, true, true};
+        const bool released[3] = {false, false, false};
+        const unsigned short codes[2] = {KEY_VOLUMEUP, KEY_PLAYPAUSE};
+
+        PRODIKEYS_CHECK(prodikeys_injector_send(injector, keys, pressed, 3));
+        PRODIKEYS_CHECK(prodikeys_injector_send(injector, keys, released, 3));
+        prodikeys_test_batch(fd, codes, 1, 2);
+        prodikeys_test_batch(fd, codes, 0, 2);
+
+        //nothing else : no repeat, no empty frame for a batch without any forwarded key
+        PRODIKEYS_CHECK(prodikeys_injector_send(injector, keys + 1, pressed + 1, 1));
+        struct input_event event;
+        PRODIKEYS_CHECK(read(fd, &event, sizeof(event)) < 0 && errno == EAGAIN);
+        close(fd);
+    }
+
+    prodikeys_injector_close(injector);
+    return prodikeys_test_result();
+}